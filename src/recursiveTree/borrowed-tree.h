@@ -0,0 +1,531 @@
+#ifndef _DBLISP_BORROWED_TREE_H_
+#define _DBLISP_BORROWED_TREE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "dblisp-lexer.h"
+#include "recursive-map.h"
+
+namespace dblisp {
+
+class BorrowedTree;
+class BorrowedNode;
+class BorrowedNode_const_iterator;
+class DbLispParser;
+
+// The values of a BorrowedNode, each one a std::string_view.
+class BorrowedValues {
+  friend class BorrowedNode;
+
+ public:
+  class const_iterator {
+    friend class BorrowedValues;
+
+   public:
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef std::string_view value_type;
+    typedef std::string_view reference;
+    typedef const std::string_view* pointer;
+    typedef ptrdiff_t difference_type;
+
+    const_iterator() = default;
+
+    reference operator*() const { return values_->operator[](index_); }
+
+    const_iterator& operator++() {
+      ++index_;
+      return *this;
+    }
+
+    const_iterator operator++(int) {
+      auto temp = *this;
+      ++index_;
+      return temp;
+    }
+
+    bool operator==(const const_iterator& x) const {
+      return index_ == x.index_;
+    }
+
+    bool operator!=(const const_iterator& x) const { return !(*this == x); }
+
+   private:
+    const_iterator(const BorrowedValues* values, size_t index)
+        : values_(values), index_(index) {}
+
+   private:
+    const BorrowedValues* values_ = nullptr;
+    size_t index_ = 0;
+  };
+
+  size_t size() const { return count_; }
+
+  bool empty() const { return count_ == 0; }
+
+  inline std::string_view operator[](const size_t index) const;
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+
+  const_iterator end() const { return const_iterator(this, count_); }
+
+ private:
+  BorrowedValues(const BorrowedTree* tree, uint32_t first, uint32_t count)
+      : tree_(tree), first_(first), count_(count) {}
+
+ private:
+  const BorrowedTree* tree_;
+  uint32_t first_;
+  uint32_t count_;
+};
+
+// Read-only tree whose keys and values are std::string_views into a source
+// buffer that the tree keeps alive. Children of a node are stored as one
+// sorted range, so the layout is fixed once DbLispParser has built it. Only
+// values that contain `\"` are unescaped, on first access; keys with `\"`
+// are unescaped while parsing since they are sorted and looked up.
+class BorrowedTree {
+  friend class BorrowedNode;
+  friend class BorrowedNode_const_iterator;
+  friend class BorrowedValues;
+  friend class DbLispParser;
+
+ public:
+  using VALUE_TYPE = RecTree::VALUE_TYPE;
+
+  explicit BorrowedTree(const std::string& key = "") {
+    ownedKeys_.push_back(key);
+    rootKey_ = StrRef{ownedKeys_.back().data(),
+                      static_cast<uint32_t>(ownedKeys_.back().size()),
+                      kNoCache};
+    nodes_.push_back(NodeRec{rootKey_, 0, 0, RecTree::INITAL});
+  }
+
+  BorrowedTree(const BorrowedTree&) = delete;
+
+  BorrowedTree& operator=(const BorrowedTree&) = delete;
+
+  BorrowedTree(BorrowedTree&& x) noexcept : BorrowedTree() { swap(x); }
+
+  BorrowedTree& operator=(BorrowedTree&& x) noexcept {
+    BorrowedTree temp(std::move(x));
+    swap(temp);
+    return *this;
+  }
+
+  ~BorrowedTree() { clearUnescaped(); }
+
+  void swap(BorrowedTree& x) noexcept {
+    source_.swap(x.source_);
+    ownedKeys_.swap(x.ownedKeys_);
+    std::swap(rootKey_, x.rootKey_);
+    std::swap(rootIndex_, x.rootIndex_);
+    nodes_.swap(x.nodes_);
+    slots_.swap(x.slots_);
+    values_.swap(x.values_);
+    unescaped_.swap(x.unescaped_);
+    std::swap(unescapedSize_, x.unescapedSize_);
+  }
+
+  inline BorrowedNode root() const;
+
+  std::string_view key() const { return str(rootKey_); }
+
+  // Converts into a mutable tree, every key and value is copied.
+  inline RecTree toRecTree() const;
+
+  // Copies `rmap` into an immutable tree: nodes in breadth-first order,
+  // so every level and every sibling range is contiguous, and all keys
+  // and values in one arena, each distinct key once. Number columns
+  // become their text. toRecTree() thaws it again.
+  static inline BorrowedTree freeze(const RecTree& rmap);
+
+ private:
+  static constexpr uint32_t kNoCache = UINT32_MAX;
+
+  struct StrRef {
+    const char* data_;
+    uint32_t size_;
+    uint32_t cacheIndex_;
+  };
+
+  static constexpr uint32_t kNoSlots = UINT32_MAX;
+  static constexpr uint32_t kEmptySlot = UINT32_MAX;
+
+  // `first_`/`count_` index nodes_ for RECTREE and values_ otherwise.
+  // A map with ChildMap::kHashThreshold children or more also has a hash
+  // index of slotCount(count_) slots from slots_[slotFirst_].
+  struct NodeRec {
+    StrRef key_;
+    uint32_t first_;
+    uint32_t count_;
+    VALUE_TYPE status_;
+    uint32_t slotFirst_ = kNoSlots;
+  };
+
+  // `index` counts from the first child.
+  struct Slot {
+    uint32_t index;
+    uint32_t hash;
+  };
+
+  std::string_view str(const StrRef& strRef) const {
+    if (strRef.cacheIndex_ == kNoCache) {
+      return std::string_view(strRef.data_, strRef.size_);
+    }
+    std::atomic<std::string*>& slot = unescaped_[strRef.cacheIndex_];
+    std::string* value = slot.load(std::memory_order_acquire);
+    if (value == nullptr) {
+      std::string* unescaped = new std::string();
+      DbLispToken::unescape(std::string_view(strRef.data_, strRef.size_),
+                            *unescaped);
+      if (slot.compare_exchange_strong(value, unescaped,
+                                       std::memory_order_acq_rel)) {
+        value = unescaped;
+      } else {
+        delete unescaped;
+      }
+    }
+    return *value;
+  }
+
+  static size_t hashKey(std::string_view key) {
+    return std::hash<std::string_view>()(key);
+  }
+
+  // At most a quarter full, like ChildMap.
+  static size_t slotCount(size_t count) {
+    size_t capacity = 16;
+    for (; capacity < count * 4; capacity *= 2) {
+    }
+    return capacity;
+  }
+
+  // Hashes the children of every wide map once nodes_ is complete.
+  void buildIndex() {
+    slots_.clear();
+    for (NodeRec& node : nodes_) {
+      if (node.status_ != RecTree::RECTREE ||
+          node.count_ < ChildMap::kHashThreshold) {
+        node.slotFirst_ = kNoSlots;
+        continue;
+      }
+      node.slotFirst_ = slots_.size();
+      const size_t mask = slotCount(node.count_) - 1;
+      slots_.resize(slots_.size() + mask + 1, Slot{kEmptySlot, 0});
+      Slot* slots = slots_.data() + node.slotFirst_;
+      for (uint32_t index = 0; index != node.count_; ++index) {
+        const size_t hash = hashKey(str(nodes_[node.first_ + index].key_));
+        size_t slot = hash & mask;
+        for (; slots[slot].index != kEmptySlot; slot = (slot + 1) & mask) {
+        }
+        slots[slot] = Slot{index, static_cast<uint32_t>(hash)};
+      }
+    }
+  }
+
+  void clearUnescaped() {
+    for (uint32_t index = 0; unescaped_ && index != unescapedSize_; ++index) {
+      delete unescaped_[index].load(std::memory_order_relaxed);
+    }
+    unescaped_.reset();
+    unescapedSize_ = 0;
+  }
+
+ private:
+  std::shared_ptr<const void> source_;
+  std::deque<std::string> ownedKeys_;
+  StrRef rootKey_;
+  uint32_t rootIndex_ = 0;
+  std::vector<NodeRec> nodes_;
+  std::vector<Slot> slots_;
+  std::vector<StrRef> values_;
+  std::unique_ptr<std::atomic<std::string*>[]> unescaped_;
+  uint32_t unescapedSize_ = 0;
+};
+
+// A node of a BorrowedTree, cheap to copy. It stays valid as long as the
+// tree it came from.
+class BorrowedNode {
+  friend class BorrowedTree;
+  friend class BorrowedNode_const_iterator;
+  using NodeRec = BorrowedTree::NodeRec;
+
+ public:
+  typedef BorrowedNode_const_iterator const_iterator;
+  typedef const_iterator iterator;
+
+  BorrowedNode() = default;
+
+  std::string_view key() const { return tree_->str(node_->key_); }
+
+  bool isValue() const {
+    return node_->status_ == RecTree::VALUE ||
+           node_->status_ == RecTree::VALUE_VECTOR;
+  }
+
+  bool isMap() const { return node_->status_ == RecTree::RECTREE; }
+
+  size_t size() const { return isMap() ? node_->count_ : 0; }
+
+  bool empty() const { return size() == 0; }
+
+  inline const_iterator begin() const;
+
+  inline const_iterator end() const;
+
+  inline const_iterator cbegin() const;
+
+  inline const_iterator cend() const;
+
+  inline const_iterator find(std::string_view key) const;
+
+  inline BorrowedNode at(std::string_view key) const;
+
+  std::string_view value(const size_t index = 0) const {
+    return tree_->str(tree_->values_[node_->first_ + index]);
+  }
+
+  BorrowedValues valueVector() const {
+    return BorrowedValues(tree_, node_->first_, isValue() ? node_->count_ : 0);
+  }
+
+  inline size_t count() const;
+
+  RecTree toRecTree() const {
+    RecTree tree{std::string(key())};
+    toRecTree(tree);
+    return tree;
+  }
+
+ private:
+  BorrowedNode(const BorrowedTree* tree, const NodeRec* node)
+      : tree_(tree), node_(node) {}
+
+  uint32_t childFirst() const { return isMap() ? node_->first_ : 0; }
+
+  inline void toRecTree(RecTree& tree) const;
+
+  const NodeRec* childBegin() const {
+    return tree_->nodes_.data() + childFirst();
+  }
+
+ private:
+  const BorrowedTree* tree_ = nullptr;
+  const NodeRec* node_ = nullptr;
+};
+
+class BorrowedNode_const_iterator {
+  friend class BorrowedNode;
+
+ public:
+  typedef std::random_access_iterator_tag iterator_category;
+  typedef BorrowedNode value_type;
+  typedef const BorrowedNode& reference;
+  typedef const BorrowedNode* pointer;
+  typedef ptrdiff_t difference_type;
+
+  typedef BorrowedNode_const_iterator self;
+
+  BorrowedNode_const_iterator() = default;
+
+  reference operator*() const { return node_; }
+
+  pointer operator->() const { return &node_; }
+
+  self& operator++() {
+    ++node_.node_;
+    return *this;
+  }
+
+  self operator++(int) {
+    auto temp = *this;
+    ++node_.node_;
+    return temp;
+  }
+
+  self& operator--() {
+    --node_.node_;
+    return *this;
+  }
+
+  self operator--(int) {
+    auto temp = *this;
+    --node_.node_;
+    return temp;
+  }
+
+  bool operator==(const self& x) const {
+    return node_.node_ == x.node_.node_;
+  }
+
+  bool operator!=(const self& x) const { return !(*this == x); }
+
+ private:
+  BorrowedNode_const_iterator(const BorrowedTree* tree,
+                              const BorrowedTree::NodeRec* node)
+      : node_(tree, node) {}
+
+ private:
+  BorrowedNode node_;
+};
+
+inline BorrowedNode::const_iterator BorrowedNode::begin() const {
+  return const_iterator(tree_, childBegin());
+}
+
+inline BorrowedNode::const_iterator BorrowedNode::end() const {
+  return const_iterator(tree_, childBegin() + size());
+}
+
+inline BorrowedNode::const_iterator BorrowedNode::cbegin() const {
+  return begin();
+}
+
+inline BorrowedNode::const_iterator BorrowedNode::cend() const {
+  return end();
+}
+
+// A wide map probes its hash index. Otherwise the search halves the range
+// without a branch of its own, so it runs log2(size) steps whatever the
+// key and only the key comparison branches.
+inline BorrowedNode::const_iterator BorrowedNode::find(
+    std::string_view key) const {
+  const NodeRec* pos = childBegin();
+  if (empty()) {
+    return end();
+  }
+  if (node_->slotFirst_ != BorrowedTree::kNoSlots) {
+    const size_t hash = BorrowedTree::hashKey(key);
+    const size_t mask = BorrowedTree::slotCount(size()) - 1;
+    const BorrowedTree::Slot* slots =
+        tree_->slots_.data() + node_->slotFirst_;
+    for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+      if (slots[slot].index == BorrowedTree::kEmptySlot) {
+        return end();
+      }
+      if (slots[slot].hash == static_cast<uint32_t>(hash) &&
+          tree_->str(pos[slots[slot].index].key_) == key) {
+        return const_iterator(tree_, pos + slots[slot].index);
+      }
+    }
+  }
+  for (size_t length = size(); length > 1;) {
+    const size_t half = length / 2;
+    pos += tree_->str(pos[half].key_) <= key ? half : 0;
+    length -= half;
+  }
+  if (tree_->str(pos->key_) != key) {
+    return end();
+  }
+  return const_iterator(tree_, pos);
+}
+
+inline BorrowedNode BorrowedNode::at(std::string_view key) const {
+  const_iterator iter = find(key);
+  if (iter == end()) {
+    throw std::out_of_range("BorrowedNode::at");
+  }
+  return *iter;
+}
+
+inline size_t BorrowedNode::count() const {
+  size_t ret = 1;
+  for (const auto& child : *this) {
+    ret += child.count();
+  }
+  return ret;
+}
+
+inline void BorrowedNode::toRecTree(RecTree& tree) const {
+  if (isValue()) {
+    for (std::string_view val : valueVector()) {
+      tree.pushValue(val);
+    }
+  } else if (isMap() && empty()) {
+    tree.makeMap();
+  }
+  for (const auto& child : *this) {
+    child.toRecTree(tree[std::string(child.key())]);
+  }
+}
+
+inline std::string_view BorrowedValues::operator[](const size_t index) const {
+  return tree_->str(tree_->values_[first_ + index]);
+}
+
+inline BorrowedNode BorrowedTree::root() const {
+  return BorrowedNode(this, &nodes_[rootIndex_]);
+}
+
+inline RecTree BorrowedTree::toRecTree() const { return root().toRecTree(); }
+
+inline BorrowedTree BorrowedTree::freeze(const RecTree& rmap) {
+  BorrowedTree tree(rmap.key().toString());
+  auto arena = std::make_shared<std::string>();
+  std::unordered_map<std::string_view, size_t> arenaKeys;
+  // The arena grows while it is filled, so strings are kept as offsets
+  // until it is done.
+  std::vector<size_t> keyOffsets{0};
+  std::vector<size_t> valueOffsets;
+  auto append = [&arena](std::string_view str) {
+    arena->append(str.data(), str.size());
+    return arena->size() - str.size();
+  };
+  std::vector<const RecTree*> queue{&rmap};
+  for (size_t index = 0; index != queue.size(); ++index) {
+    const RecTree* node = queue[index];
+    NodeRec rec = tree.nodes_[index];
+    if (node->isTree()) {
+      rec.status_ = RecTree::RECTREE;
+      rec.first_ = tree.nodes_.size();
+      rec.count_ = node->size();
+      for (const auto& child : *node) {
+        std::string_view key = child.refRealKey();
+        auto inserted = arenaKeys.try_emplace(key, 0);
+        if (inserted.second) {
+          inserted.first->second = append(key);
+        }
+        keyOffsets.push_back(inserted.first->second);
+        tree.nodes_.push_back(
+            NodeRec{StrRef{nullptr, static_cast<uint32_t>(key.size()),
+                           kNoCache},
+                    0, 0, RecTree::INITAL});
+        queue.push_back(&child);
+      }
+    } else if (node->isValue()) {
+      rec.first_ = tree.values_.size();
+      node->visitValues([&](std::string_view val) {
+        valueOffsets.push_back(append(val));
+        tree.values_.push_back(
+            StrRef{nullptr, static_cast<uint32_t>(val.size()), kNoCache});
+      });
+      rec.count_ = tree.values_.size() - rec.first_;
+      rec.status_ =
+          rec.count_ == 1 ? RecTree::VALUE : RecTree::VALUE_VECTOR;
+    }
+    tree.nodes_[index] = rec;
+  }
+  for (size_t index = 1; index != tree.nodes_.size(); ++index) {
+    tree.nodes_[index].key_.data_ = arena->data() + keyOffsets[index];
+  }
+  for (size_t index = 0; index != tree.values_.size(); ++index) {
+    tree.values_[index].data_ = arena->data() + valueOffsets[index];
+  }
+  tree.buildIndex();
+  tree.source_ = std::move(arena);
+  return tree;
+}
+
+}  // namespace dblisp
+
+#endif
@@ -0,0 +1,308 @@
+#ifndef _DBLISP_CONCURRENT_TREE_H_
+#define _DBLISP_CONCURRENT_TREE_H_
+
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "recursive-map.h"
+
+namespace dblisp {
+
+// A settings tree many threads change at once. The top level children are
+// spread over shards by the hash of their key, each shard with its own
+// lock, and each top level child is a RecTree with its own reader/writer
+// lock. Writers to different top level children never wait for each
+// other: they only share their shard's lock, never exclusively. Adding or
+// erasing a top level child locks its shard.
+//
+// The second level children are spread the same way over kStripeCount
+// locks of their top level child. pushValue and erase below an existing
+// second level child only read lock the top level child and lock the
+// child's stripe, so writers under different second level children go on
+// at once. Adding or erasing a second level child, writing through
+// write, and the first write after toRecTree shared the child, lock the
+// whole top level child. Readers of a whole top level child read lock it
+// and all of its stripes. References do not escape a lock: read and write
+// hand the child to a function that runs under it.
+//
+// forEach and toRecTree see every top level child whole, as it was at
+// some point during the call, but not all of them at the same point. Use
+// a PublishedTree when readers need one version of everything. Readers
+// should read number columns through the spans, see RecTree.
+//
+// The resource is used by every thread, so it must be thread safe. Key
+// pools are not.
+class ConcurrentTree {
+ public:
+  static constexpr size_t kShardCount = 64;
+  static constexpr size_t kStripeCount = 16;
+
+ private:
+  struct Entry {
+    Entry(const std::string& key, std::pmr::memory_resource* resource)
+        : key(key), tree(key, resource) {}
+
+    std::shared_mutex& stripeOf(std::string_view childKey) const {
+      return stripes[std::hash<std::string_view>()(childKey) % kStripeCount];
+    }
+
+    // What the shard's map key points to.
+    const std::string key;
+    mutable std::shared_mutex mutex;
+    mutable std::shared_mutex stripes[kStripeCount];
+    RecTree tree;
+  };
+
+  // Read locks a whole top level child, its lock first, then every stripe
+  // in order.
+  class ReadLock {
+   public:
+    explicit ReadLock(const Entry& entry) : entry_(entry) {
+      entry_.mutex.lock_shared();
+      for (auto& stripe : entry_.stripes) {
+        stripe.lock_shared();
+      }
+    }
+
+    ReadLock(const ReadLock&) = delete;
+
+    ReadLock& operator=(const ReadLock&) = delete;
+
+    ~ReadLock() {
+      for (auto& stripe : entry_.stripes) {
+        stripe.unlock_shared();
+      }
+      entry_.mutex.unlock_shared();
+    }
+
+   private:
+    const Entry& entry_;
+  };
+
+  // One cache line each, so shards do not share one.
+  struct alignas(64) Shard {
+    mutable std::shared_mutex mutex;
+    std::unordered_map<std::string_view, std::unique_ptr<Entry>> entries;
+  };
+
+ public:
+  explicit ConcurrentTree(const std::string& key,
+                          std::pmr::memory_resource* resource =
+                              std::pmr::get_default_resource())
+      : key_(key), resource_(resource), shards_(new Shard[kShardCount]) {}
+
+  ConcurrentTree(const ConcurrentTree&) = delete;
+
+  ConcurrentTree& operator=(const ConcurrentTree&) = delete;
+
+  const std::string& key() const { return key_; }
+
+  // Calls `write` with the top level child `key`, made first if missing,
+  // while no other thread uses it. Returns what `write` returns.
+  template <typename Write>
+  auto write(const std::string& key, Write write) {
+    Shard& shard = shardOf(key);
+    for (;;) {
+      {
+        std::shared_lock<std::shared_mutex> shardLock(shard.mutex);
+        auto pos = shard.entries.find(key);
+        if (pos != shard.entries.end()) {
+          std::unique_lock<std::shared_mutex> lock(pos->second->mutex);
+          return write(pos->second->tree);
+        }
+      }
+      // Another writer may add it first, then this entry is dropped.
+      std::unique_lock<std::shared_mutex> shardLock(shard.mutex);
+      auto entry = std::make_unique<Entry>(key, resource_);
+      std::string_view entryKey = entry->key;
+      shard.entries.emplace(entryKey, std::move(entry));
+    }
+  }
+
+  // Calls `read` with the top level child `key` while no thread writes
+  // it. Returns false, without calling it, when there is no such child.
+  template <typename Read>
+  bool read(const std::string& key, Read read) const {
+    const Shard& shard = shardOf(key);
+    std::shared_lock<std::shared_mutex> shardLock(shard.mutex);
+    auto pos = shard.entries.find(key);
+    if (pos == shard.entries.end()) {
+      return false;
+    }
+    ReadLock lock(*pos->second);
+    const RecTree& tree = pos->second->tree;
+    read(tree);
+    return true;
+  }
+
+  // Like operator[] along `path`, which starts with a top level key.
+  // Returns false, and changes nothing, when `path` is empty.
+  bool pushValue(const std::vector<std::string>& path, std::string_view val) {
+    if (path.empty()) {
+      return false;
+    }
+    auto push = [&path, val](RecTree& tree, size_t index) {
+      RecTree* node = &tree;
+      for (; index != path.size(); ++index) {
+        node = &(*node)[path[index]];
+      }
+      node->pushValue(val);
+    };
+    if (path.size() == 1 ||
+        !writeChild(path, [&push](RecTree& child) { push(child, 2); })) {
+      write(path.front(), [&push](RecTree& tree) { push(tree, 1); });
+    }
+    return true;
+  }
+
+  // Erases the node at `path`, returns how many nodes were erased.
+  size_t erase(const std::vector<std::string>& path) {
+    if (path.empty()) {
+      return 0;
+    }
+    if (path.size() == 1) {
+      Shard& shard = shardOf(path.front());
+      std::unique_lock<std::shared_mutex> shardLock(shard.mutex);
+      return shard.entries.erase(path.front());
+    }
+    auto eraseFrom = [&path](RecTree& tree, size_t index) -> size_t {
+      RecTree* node = &tree;
+      for (; index + 1 < path.size(); ++index) {
+        if (!node->isMap() || node->find(path[index]) == node->end()) {
+          return 0;
+        }
+        node = &node->at(path[index]);
+      }
+      return node->isMap() ? node->erase(path.back()) : 0;
+    };
+    size_t ret = 0;
+    if (path.size() > 2 &&
+        writeChild(path, [&eraseFrom, &ret](RecTree& child) {
+          ret = eraseFrom(child, 2);
+        })) {
+      return ret;
+    }
+    Shard& shard = shardOf(path.front());
+    std::shared_lock<std::shared_mutex> shardLock(shard.mutex);
+    auto pos = shard.entries.find(path.front());
+    if (pos == shard.entries.end()) {
+      return 0;
+    }
+    std::unique_lock<std::shared_mutex> lock(pos->second->mutex);
+    return eraseFrom(pos->second->tree, 1);
+  }
+
+  // False for an empty `path`.
+  bool contains(const std::vector<std::string>& path) const {
+    if (path.empty()) {
+      return false;
+    }
+    const Shard& shard = shardOf(path.front());
+    std::shared_lock<std::shared_mutex> shardLock(shard.mutex);
+    auto pos = shard.entries.find(path.front());
+    if (pos == shard.entries.end()) {
+      return false;
+    }
+    const Entry& entry = *pos->second;
+    std::shared_lock<std::shared_mutex> lock(entry.mutex);
+    std::shared_lock<std::shared_mutex> stripeLock;
+    if (path.size() > 1) {
+      stripeLock = std::shared_lock<std::shared_mutex>(entry.stripeOf(path[1]));
+    }
+    const RecTree* node = &entry.tree;
+    for (size_t index = 1; index != path.size(); ++index) {
+      if (!node->isMap() || node->find(path[index]) == node->end()) {
+        return false;
+      }
+      node = &node->at(path[index]);
+    }
+    return true;
+  }
+
+  // Number of top level children.
+  size_t size() const {
+    size_t ret = 0;
+    for (size_t index = 0; index != kShardCount; ++index) {
+      std::shared_lock<std::shared_mutex> shardLock(shards_[index].mutex);
+      ret += shards_[index].entries.size();
+    }
+    return ret;
+  }
+
+  // Calls `visit` with every top level child in turn, under its read lock,
+  // in no particular order.
+  template <typename Visit>
+  void forEach(Visit visit) const {
+    for (size_t index = 0; index != kShardCount; ++index) {
+      std::shared_lock<std::shared_mutex> shardLock(shards_[index].mutex);
+      for (const auto& entry : shards_[index].entries) {
+        ReadLock lock(*entry.second);
+        const RecTree& tree = entry.second->tree;
+        visit(tree);
+      }
+    }
+  }
+
+  // A copy of the whole tree, which shares every subtree, so it costs one
+  // node per top level child.
+  RecTree toRecTree() const {
+    RecTree rmap(key_, resource_);
+    std::vector<RecTree::link_type> trees;
+    forEach([&rmap, &trees](const RecTree& tree) {
+      trees.push_back(rmap.createTree(tree, RecTree::ShareTag()));
+    });
+    rmap.adoptChildren(trees.begin(), trees.end());
+    return rmap;
+  }
+
+ private:
+  // Calls `change` with the second level child at path[1], which must
+  // exist, while only its stripe is locked. Returns false, without calling
+  // it, when the child is missing or the child or the map holding it is
+  // shared with a copy: then the whole top level child must be locked.
+  template <typename Change>
+  bool writeChild(const std::vector<std::string>& path, Change change) {
+    Shard& shard = shardOf(path.front());
+    std::shared_lock<std::shared_mutex> shardLock(shard.mutex);
+    auto pos = shard.entries.find(path.front());
+    if (pos == shard.entries.end()) {
+      return false;
+    }
+    Entry& entry = *pos->second;
+    std::shared_lock<std::shared_mutex> lock(entry.mutex);
+    std::unique_lock<std::shared_mutex> stripeLock(entry.stripeOf(path[1]));
+    // Sharing only grows under a read lock of the whole top level child,
+    // which the stripe lock keeps out.
+    if (!entry.tree.isTree() || entry.tree.refChildren().shared()) {
+      return false;
+    }
+    RecTree* child = entry.tree.findChild(path[1]);
+    if (child == nullptr ||
+        child->refs_.load(std::memory_order_acquire) > 1) {
+      return false;
+    }
+    change(*child);
+    return true;
+  }
+
+  Shard& shardOf(std::string_view key) const {
+    return shards_[std::hash<std::string_view>()(key) % kShardCount];
+  }
+
+ private:
+  std::string key_;
+  std::pmr::memory_resource* resource_;
+  std::unique_ptr<Shard[]> shards_;
+};
+
+}  // namespace dblisp
+
+#endif
@@ -0,0 +1,599 @@
+#ifndef _DBLISP_DBLISP_BINARY_H_
+#define _DBLISP_DBLISP_BINARY_H_
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "dblisp-file.h"
+#include "dblisp-writer.h"
+#include "recursive-map.h"
+
+namespace dblisp {
+
+class MappedNode;
+class MappedNode_const_iterator;
+class MappedTree;
+class MappedValues;
+
+// Binary encoding of a recursive_map, for trees that are saved once and
+// loaded often. Integers are unsigned LEB128 varints unless a width is
+// given, fixed width fields are little-endian. Offsets count from the
+// first byte of the file. An `offset` table entry is a u32le, or a u64le
+// when kWideTable is set in the kind of its node. Number columns start at
+// a multiple of 8 after a zero `pad`.
+//
+//   file    := "DBLB" version:u32le keyCount:u64le keyOffset:u32le*
+//              (keySize keyBytes)* node* rootOffset:u64le
+//   node    := kind:u8 keyIndex payload
+//   INIT    := (nothing)
+//   VALUE   := valueSize valueBytes
+//   VALUES  := count offset* (valueSize valueBytes)*
+//   INT64S  := count pad int64le*     DOUBLES := count pad float64le*
+//   MAP     := count offset*
+//
+// Nodes are written children first, a map right after its last child,
+// and the root last. Keys are stored once and shared by every node that
+// uses them, map children are sorted by key. The offset tables let a
+// MappedTree reach any key, value or child of an mmap'ed file in place.
+// A load checks every size, offset, index and child order, so a corrupt
+// file is rejected instead of building a broken tree. Like DbLispParser,
+// loading keeps the target's own key and replaces everything else.
+class DbLispBinary {
+  friend class MappedNode;
+  friend class MappedNode_const_iterator;
+  friend class MappedTree;
+  friend class MappedValues;
+  using link_type = recursive_map::link_type;
+
+ public:
+  static constexpr uint32_t kVersion = 2;
+
+  // Returns false when the writer fails or the distinct keys take more
+  // than 4 GiB.
+  bool saveBinary(const recursive_map& rmap, DbLispWriter& writer) {
+    std::vector<std::string_view> keys;
+    std::unordered_map<std::string_view, uint64_t> keyIndex;
+    std::vector<uint64_t> nodeKeys;
+    collectKeys(rmap, keys, keyIndex, nodeKeys);
+    std::vector<uint64_t> keyOffsets;
+    uint64_t keyOffset = kHeaderSize + kNarrow * keys.size();
+    for (std::string_view key : keys) {
+      keyOffsets.push_back(keyOffset);
+      keyOffset += varintSize(key.size()) + key.size();
+    }
+    if (keyOffset > UINT32_MAX) {
+      return false;
+    }
+    Encoder out(writer);
+    out.write(std::string_view(kMagic, sizeof(kMagic)));
+    out.writeFixed(kVersion, 4);
+    out.writeFixed(keys.size(), 8);
+    for (uint64_t offset : keyOffsets) {
+      out.writeFixed(offset, kNarrow);
+    }
+    for (std::string_view key : keys) {
+      out.writeString(key);
+    }
+    const uint64_t* nodeKey = nodeKeys.data();
+    std::vector<uint64_t> offsetStk;
+    out.writeFixed(writeNode(rmap, nodeKey, offsetStk, out), 8);
+    return writer.flush();
+  }
+
+  // Replaces `fileName` atomically, see DbLispWriter::saveToFile.
+  bool saveBinary(const recursive_map& rmap, const std::string& fileName) {
+    return DbLispWriter::saveToFile(
+        fileName, DbLispWriter::FORMAT_COMPACT,
+        [this, &rmap](DbLispWriter& writer) {
+          return saveBinary(rmap, writer);
+        });
+  }
+
+  bool loadBinary(const std::string& fileName, recursive_map& rmap) {
+    fileName_ = fileName;
+    DbLispFile file;
+    if (!file.open(fileName)) {
+      return errorLog("open error: " + fileName);
+    }
+    return load(file.view(), rmap);
+  }
+
+  bool loadBinaryBuf(std::string_view buf, recursive_map& rmap,
+                     const std::string& bufName = "<buffer>") {
+    fileName_ = bufName;
+    return load(buf, rmap);
+  }
+
+  // Maps `fileName` into `tree` without building any node. Only the
+  // frame and the root are checked here, MappedNode checks every other
+  // node as it is reached. Defined in mapped-tree.h.
+  inline bool mapBinary(const std::string& fileName, MappedTree& tree);
+
+ private:
+  static constexpr char kMagic[4] = {'D', 'B', 'L', 'B'};
+  static constexpr size_t kHeaderSize = 16;
+  static constexpr size_t kAlign = 8;
+  static constexpr size_t kNarrow = 4;
+  static constexpr size_t kWide = 8;
+  static constexpr uint8_t kWideTable = 0x80;
+
+  // Node kinds on disk, independent of RecTree::VALUE_TYPE.
+  enum NODE_KIND : uint8_t {
+    NODE_INIT,
+    NODE_VALUE,
+    NODE_VALUES,
+    NODE_INT64S,
+    NODE_DOUBLES,
+    NODE_MAP
+  };
+
+  // A decoded kind and keyIndex. `bytes` is the value of a NODE_VALUE and
+  // the `count` entries of `width` bytes of the other kinds, empty for
+  // NODE_INIT.
+  struct NodeHeader {
+    uint8_t kind = NODE_INIT;
+    uint8_t width = kNarrow;
+    uint64_t keyIndex = 0;
+    uint64_t count = 0;
+    std::string_view bytes;
+  };
+
+  // Bounds checked cursor over the buffer.
+  class Reader {
+   public:
+    explicit Reader(std::string_view buf)
+        : begin_(buf.data()), pos_(buf.data()), end_(buf.data() + buf.size()) {}
+
+    size_t remaining() const { return end_ - pos_; }
+
+    uint64_t offset() const { return pos_ - begin_; }
+
+    bool seek(uint64_t offset) {
+      if (offset > static_cast<uint64_t>(end_ - begin_)) return false;
+      pos_ = begin_ + offset;
+      return true;
+    }
+
+    // Skips the pad before a number column.
+    bool align() { return seek((offset() + kAlign - 1) / kAlign * kAlign); }
+
+    bool readBytes(size_t size, std::string_view& bytes) {
+      if (size > remaining()) return false;
+      bytes = std::string_view(pos_, size);
+      pos_ += size;
+      return true;
+    }
+
+    bool readByte(uint8_t& byte) {
+      if (pos_ == end_) return false;
+      byte = static_cast<uint8_t>(*pos_++);
+      return true;
+    }
+
+    bool readVarint(uint64_t& value) {
+      value = 0;
+      for (unsigned shift = 0; shift < 64; shift += 7) {
+        uint8_t byte;
+        if (!readByte(byte)) return false;
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) return true;
+      }
+      return false;
+    }
+
+    bool readString(std::string_view& str) {
+      uint64_t size;
+      return readVarint(size) && readBytes(size, str);
+    }
+
+    // `count` fixed fields of `width` bytes.
+    bool readTable(uint64_t count, size_t width, std::string_view& table) {
+      return count <= remaining() / width &&
+             readBytes(count * width, table);
+    }
+
+   private:
+    const char* begin_;
+    const char* pos_;
+    const char* end_;
+  };
+
+  // Counts the bytes given to the writer, for pads and offsets.
+  class Encoder {
+   public:
+    explicit Encoder(DbLispWriter& writer) : writer_(writer) {}
+
+    uint64_t offset() const { return offset_; }
+
+    void put(const char c) {
+      writer_.put(c);
+      offset_ += 1;
+    }
+
+    void write(std::string_view bytes) {
+      writer_.write(bytes);
+      offset_ += bytes.size();
+    }
+
+    void align() {
+      while (offset_ % kAlign != 0) put('\0');
+    }
+
+    void writeFixed(uint64_t value, size_t size) {
+      char bytes[8];
+      for (size_t index = 0; index != size; ++index) {
+        bytes[index] = static_cast<char>(value >> (8 * index));
+      }
+      write(std::string_view(bytes, size));
+    }
+
+    void writeVarint(uint64_t value) {
+      char bytes[10];
+      size_t size = 0;
+      for (; value >= 0x80; value >>= 7) {
+        bytes[size++] = static_cast<char>(value | 0x80);
+      }
+      bytes[size++] = static_cast<char>(value);
+      write(std::string_view(bytes, size));
+    }
+
+    void writeString(std::string_view str) {
+      writeVarint(str.size());
+      write(str);
+    }
+
+   private:
+    DbLispWriter& writer_;
+    uint64_t offset_ = 0;
+  };
+
+  static size_t varintSize(uint64_t value) {
+    size_t size = 1;
+    for (; value >= 0x80; value >>= 7) size += 1;
+    return size;
+  }
+
+  // Fills the key table and the key index of every node in pre-order, so
+  // writeNode hashes nothing.
+  static void collectKeys(
+      const recursive_map& tree, std::vector<std::string_view>& keys,
+      std::unordered_map<std::string_view, uint64_t>& keyIndex,
+      std::vector<uint64_t>& nodeKeys) {
+    auto inserted = keyIndex.try_emplace(tree.refRealKey(), keys.size());
+    if (inserted.second) {
+      keys.push_back(tree.refRealKey());
+    }
+    nodeKeys.push_back(inserted.first->second);
+    if (tree.isTree()) {
+      for (const auto& child : tree) {
+        collectKeys(child, keys, keyIndex, nodeKeys);
+      }
+    }
+  }
+
+  // Writes the children of `tree`, then `tree` itself, and returns the
+  // offset of `tree`. The offsets of unwritten maps' children wait in
+  // offsetStk. A table is wide only when an entry does not fit a u32le.
+  static uint64_t writeNode(const recursive_map& tree,
+                            const uint64_t*& nodeKey,
+                            std::vector<uint64_t>& offsetStk, Encoder& out) {
+    using VALUE_TYPE = recursive_map::VALUE_TYPE;
+    const uint64_t keyIndex = *nodeKey++;
+    const size_t childBegin = offsetStk.size();
+    if (tree.valueStatus_ == VALUE_TYPE::RECTREE) {
+      for (const auto& child : tree) {
+        uint64_t childOffset = writeNode(child, nodeKey, offsetStk, out);
+        offsetStk.push_back(childOffset);
+      }
+    }
+    const uint64_t offset = out.offset();
+    NODE_KIND kind = NODE_INIT;
+    switch (tree.valueStatus_) {
+      case VALUE_TYPE::VALUE:
+        kind = NODE_VALUE;
+        break;
+      case VALUE_TYPE::VALUE_VECTOR:
+        kind = NODE_VALUES;
+        break;
+      case VALUE_TYPE::INT64_VECTOR:
+        kind = NODE_INT64S;
+        break;
+      case VALUE_TYPE::DOUBLE_VECTOR:
+        kind = NODE_DOUBLES;
+        break;
+      case VALUE_TYPE::RECTREE:
+        kind = NODE_MAP;
+        break;
+      default:;
+    }
+    size_t width = kNarrow;
+    if (kind == NODE_VALUES) {
+      const size_t count = tree.refValVector().size();
+      uint64_t valueEnd = offset + 1 + varintSize(keyIndex) +
+                          varintSize(count) + kNarrow * count;
+      for (const auto& val : tree.refValVector()) {
+        const size_t size = val.asStringView().size();
+        valueEnd += varintSize(size) + size;
+      }
+      width = valueEnd > UINT32_MAX ? kWide : kNarrow;
+    } else if (kind == NODE_MAP) {
+      width = offset > UINT32_MAX ? kWide : kNarrow;
+    }
+    out.put(static_cast<char>(width == kWide ? kind | kWideTable : kind));
+    out.writeVarint(keyIndex);
+    switch (kind) {
+      case NODE_VALUE:
+        out.writeString(tree.refRealVal());
+        break;
+      case NODE_VALUES: {
+        const auto& values = tree.refValVector();
+        out.writeVarint(values.size());
+        uint64_t valueOffset = out.offset() + width * values.size();
+        for (const auto& val : values) {
+          const size_t size = val.asStringView().size();
+          out.writeFixed(valueOffset, width);
+          valueOffset += varintSize(size) + size;
+        }
+        for (const auto& val : values) {
+          out.writeString(val.asStringView());
+        }
+        break;
+      }
+      case NODE_INT64S:
+        writeNumbers(out, tree.asInt64Span());
+        break;
+      case NODE_DOUBLES:
+        writeNumbers(out, tree.asDoubleSpan());
+        break;
+      case NODE_MAP:
+        out.writeVarint(offsetStk.size() - childBegin);
+        for (size_t index = childBegin; index != offsetStk.size(); ++index) {
+          out.writeFixed(offsetStk[index], width);
+        }
+        offsetStk.resize(childBegin);
+        break;
+      default:;
+    }
+    return offset;
+  }
+
+  template <typename Number>
+  static void writeNumbers(Encoder& out, NumberSpan<Number> numbers) {
+    out.writeVarint(numbers.size());
+    out.align();
+    for (Number number : numbers) {
+      uint64_t bits;
+      std::memcpy(&bits, &number, sizeof(bits));
+      out.writeFixed(bits, sizeof(bits));
+    }
+  }
+
+  static uint64_t readFixed(std::string_view bytes) {
+    uint64_t value = 0;
+    for (size_t index = 0; index != bytes.size(); ++index) {
+      value |= static_cast<uint64_t>(static_cast<uint8_t>(bytes[index]))
+               << (8 * index);
+    }
+    return value;
+  }
+
+  // Entry `index` of a table of `width` byte entries.
+  static uint64_t tableEntry(std::string_view table, size_t width,
+                             uint64_t index) {
+    return readFixed(table.substr(index * width, width));
+  }
+
+  static bool readHeader(Reader& reader, NodeHeader& header) {
+    if (!reader.readByte(header.kind) || !reader.readVarint(header.keyIndex)) {
+      return false;
+    }
+    header.width = kNarrow;
+    if ((header.kind & kWideTable) != 0) {
+      header.kind &= ~kWideTable;
+      header.width = kWide;
+      if (header.kind != NODE_VALUES && header.kind != NODE_MAP) {
+        return false;
+      }
+    }
+    switch (header.kind) {
+      case NODE_INIT:
+        header.count = 0;
+        header.bytes = std::string_view();
+        return true;
+      case NODE_VALUE:
+        header.count = 1;
+        return reader.readString(header.bytes);
+      case NODE_VALUES:
+      case NODE_MAP:
+        return reader.readVarint(header.count) &&
+               reader.readTable(header.count, header.width, header.bytes);
+      case NODE_INT64S:
+      case NODE_DOUBLES:
+        header.width = kWide;
+        return reader.readVarint(header.count) && reader.align() &&
+               reader.readTable(header.count, kWide, header.bytes);
+      default:
+        return false;
+    }
+  }
+
+  // Checks magic and version, returns the key count and the root offset.
+  bool readFrame(std::string_view buf, uint64_t& keyCount,
+                 uint64_t& rootOffset) {
+    Reader reader(buf);
+    std::string_view magic, version, keyCountBytes;
+    if (!reader.readBytes(sizeof(kMagic), magic) ||
+        magic != std::string_view(kMagic, sizeof(kMagic)) ||
+        !reader.readBytes(4, version) ||
+        !reader.readBytes(8, keyCountBytes)) {
+      return errorLog("not a dblisp binary file");
+    }
+    if (readFixed(version) != kVersion) {
+      return errorLog("unsupported version " +
+                      std::to_string(readFixed(version)));
+    }
+    keyCount = readFixed(keyCountBytes);
+    if (buf.size() < kHeaderSize + 8 ||
+        keyCount > (buf.size() - kHeaderSize - 8) / (kNarrow + 1)) {
+      return errorLog("corrupt key table");
+    }
+    rootOffset = readFixed(buf.substr(buf.size() - 8));
+    if (rootOffset < kHeaderSize + (kNarrow + 1) * keyCount ||
+        rootOffset >= buf.size() - 8) {
+      return errorLog("bad root offset");
+    }
+    return true;
+  }
+
+  bool load(std::string_view buf, recursive_map& rmap) {
+    uint64_t keyCount, rootOffset;
+    if (!readFrame(buf, keyCount, rootOffset)) {
+      return false;
+    }
+    Reader reader(buf.substr(0, buf.size() - 8));
+    std::string_view keyTable;
+    if (!reader.seek(kHeaderSize) ||
+        !reader.readTable(keyCount, kNarrow, keyTable)) {
+      return errorLog("corrupt key table");
+    }
+    recursive_map rmapTemp(rmap.key(), rmap.resource(), rmap.keyPool());
+    rmapTemp.setChildPolicy(rmap.childPolicy());
+    std::vector<KeyType> keys;
+    keys.reserve(keyCount);
+    for (uint64_t index = 0; index != keyCount; ++index) {
+      std::string_view key;
+      if (tableEntry(keyTable, kNarrow, index) != reader.offset() ||
+          !reader.readString(key)) {
+        return errorLog("corrupt key table");
+      }
+      keys.push_back(rmapTemp.makeKey(key));
+    }
+    if (!loadNodes(reader, keys, rootOffset, &rmapTemp)) {
+      return errorLog("corrupt node at offset " +
+                      std::to_string(reader.offset()));
+    }
+    if (reader.remaining() != 0) {
+      return errorLog("trailing bytes");
+    }
+    rmap.swap(rmapTemp);
+    return true;
+  }
+
+  // Builds the tree without recursion: every node is staged with its
+  // offset until the map after it adopts it, as in DbLispParser.
+  bool loadNodes(Reader& reader, const std::vector<KeyType>& keys,
+                 uint64_t rootOffset, link_type root) {
+    std::vector<link_type> childStk;
+    std::vector<uint64_t> offsetStk;
+    bool ret = true;
+    for (bool isRoot = false; ret && !isRoot;) {
+      const uint64_t offset = reader.offset();
+      NodeHeader header;
+      isRoot = offset == rootOffset;
+      if (offset > rootOffset || !readHeader(reader, header) ||
+          header.keyIndex >= keys.size()) {
+        ret = false;
+        break;
+      }
+      link_type tree = isRoot ? root : root->createChild(keys[header.keyIndex]);
+      ret = loadPayload(reader, header, tree, childStk, offsetStk);
+      if (!isRoot && ret) {
+        childStk.push_back(tree);
+        offsetStk.push_back(offset);
+      } else if (!isRoot) {
+        root->freeTree(tree);
+      }
+    }
+    ret = ret && childStk.empty();
+    for (link_type child : childStk) {
+      root->freeTree(child);
+    }
+    return ret;
+  }
+
+  bool loadPayload(Reader& reader, const NodeHeader& header, link_type tree,
+                   std::vector<link_type>& childStk,
+                   std::vector<uint64_t>& offsetStk) {
+    std::string_view bytes;
+    switch (header.kind) {
+      case NODE_INIT:
+        return true;
+      case NODE_VALUE:
+        tree->pushValue(header.bytes);
+        return true;
+      case NODE_VALUES:
+        tree->createValVector();
+        tree->valueStatus_ = recursive_map::VALUE_TYPE::VALUE_VECTOR;
+        tree->refValVector().reserve(header.count);
+        for (uint64_t index = 0; index != header.count; ++index) {
+          if (tableEntry(header.bytes, header.width, index) !=
+                  reader.offset() ||
+              !reader.readString(bytes)) {
+            return false;
+          }
+          tree->refValVector().emplace_back(bytes);
+        }
+        return true;
+      case NODE_INT64S:
+        readNumbers(header, tree, tree->nodeValue_.int64Vec_,
+                    recursive_map::VALUE_TYPE::INT64_VECTOR);
+        return true;
+      case NODE_DOUBLES:
+        readNumbers(header, tree, tree->nodeValue_.doubleVec_,
+                    recursive_map::VALUE_TYPE::DOUBLE_VECTOR);
+        return true;
+      case NODE_MAP: {
+        if (header.count > childStk.size()) return false;
+        const size_t childBegin = childStk.size() - header.count;
+        for (uint64_t index = 0; index != header.count; ++index) {
+          if (tableEntry(header.bytes, header.width, index) !=
+                  offsetStk[childBegin + index] ||
+              (index != 0 && !(childStk[childBegin + index - 1]->key_ <
+                               childStk[childBegin + index]->key_))) {
+            return false;
+          }
+        }
+        tree->makeMap();
+        tree->adoptChildren(childStk.begin() + childBegin, childStk.end());
+        childStk.resize(childBegin);
+        offsetStk.resize(childBegin);
+        return true;
+      }
+      default:
+        return false;
+    }
+  }
+
+  template <typename Vector>
+  static void readNumbers(const NodeHeader& header, link_type tree,
+                          Vector& column, recursive_map::VALUE_TYPE status) {
+    ::new (&column) Vector(header.count, tree->allocator());
+    tree->valueStatus_ = status;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    std::memcpy(column.data(), header.bytes.data(), header.bytes.size());
+#else
+    for (uint64_t index = 0; index != header.count; ++index) {
+      uint64_t bits = tableEntry(header.bytes, kWide, index);
+      std::memcpy(&column[index], &bits, sizeof(bits));
+    }
+#endif
+  }
+
+  bool errorLog(const std::string& logInfo) const {
+    std::cerr << "dblisp: binary: error: " << fileName_ << ":" << logInfo
+              << std::endl;
+    return false;
+  }
+
+ private:
+  std::string fileName_;
+};
+
+}  // namespace dblisp
+
+#endif
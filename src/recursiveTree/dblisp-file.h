@@ -0,0 +1,149 @@
+#ifndef _DBLISP_DBLISP_FILE_H_
+#define _DBLISP_DBLISP_FILE_H_
+
+#include <string>
+#include <string_view>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define _DBLISP_HAS_MMAP_
+#else
+#include <fstream>
+#endif
+
+namespace dblisp {
+
+// Read-only view of a whole file as one contiguous range. The file is
+// mmap'ed when possible, otherwise it is read into memory with one large
+// read.
+class DbLispFile {
+ public:
+  DbLispFile() = default;
+
+  explicit DbLispFile(const std::string& fileName) { open(fileName); }
+
+  DbLispFile(const DbLispFile&) = delete;
+
+  DbLispFile& operator=(const DbLispFile&) = delete;
+
+  DbLispFile(DbLispFile&& x) noexcept { swap(x); }
+
+  DbLispFile& operator=(DbLispFile&& x) noexcept {
+    DbLispFile temp(std::move(x));
+    swap(temp);
+    return *this;
+  }
+
+  ~DbLispFile() { close(); }
+
+  void swap(DbLispFile& x) noexcept {
+    std::swap(data_, x.data_);
+    std::swap(size_, x.size_);
+    std::swap(mapped_, x.mapped_);
+    buffer_.swap(x.buffer_);
+    if (!mapped_) data_ = buffer_.data();
+    if (!x.mapped_) x.data_ = x.buffer_.data();
+  }
+
+  bool open(const std::string& fileName) {
+    close();
+#ifdef _DBLISP_HAS_MMAP_
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd == -1) {
+      return false;
+    }
+    struct stat fileStat;
+    const bool regular =
+        ::fstat(fd, &fileStat) == 0 && S_ISREG(fileStat.st_mode);
+    bool ret = false;
+    if (regular && fileStat.st_size > 0) {
+      void* addr = ::mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE,
+                          fd, 0);
+      if (addr != MAP_FAILED) {
+        ::madvise(addr, fileStat.st_size, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(addr);
+        size_ = fileStat.st_size;
+        mapped_ = true;
+        ret = true;
+      }
+    }
+    if (!ret) {
+      // The size is only a hint for the buffer, 0 when fstat failed.
+      ret = readAll(fd, regular ? fileStat.st_size : 0);
+    }
+    ::close(fd);
+    return ret;
+#else
+    std::ifstream inf(fileName, std::ios::binary);
+    if (!inf.is_open()) {
+      return false;
+    }
+    buffer_.assign(std::istreambuf_iterator<char>(inf),
+                   std::istreambuf_iterator<char>());
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+    return true;
+#endif
+  }
+
+  void close() {
+#ifdef _DBLISP_HAS_MMAP_
+    if (mapped_) {
+      ::munmap(const_cast<char*>(data_), size_);
+    }
+#endif
+    std::string().swap(buffer_);
+    data_ = buffer_.data();
+    size_ = 0;
+    mapped_ = false;
+  }
+
+  const char* data() const { return data_; }
+
+  size_t size() const { return size_; }
+
+  std::string_view view() const { return std::string_view(data_, size_); }
+
+  bool isMapped() const { return mapped_; }
+
+ private:
+#ifdef _DBLISP_HAS_MMAP_
+  bool readAll(int fd, size_t sizeHint) {
+    buffer_.resize(sizeHint ? sizeHint + 1 : 1 << 16);
+    size_t readSize = 0;
+    for (;;) {
+      if (readSize == buffer_.size()) {
+        buffer_.resize(buffer_.size() * 2);
+      }
+      ssize_t n = ::read(fd, &buffer_[readSize], buffer_.size() - readSize);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        buffer_.clear();
+        return false;
+      }
+      if (n == 0) {
+        break;
+      }
+      readSize += n;
+    }
+    buffer_.resize(readSize);
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+    return true;
+  }
+#endif
+
+ private:
+  const char* data_ = "";
+  size_t size_ = 0;
+  bool mapped_ = false;
+  std::string buffer_;
+};
+
+}  // namespace dblisp
+
+#endif
@@ -0,0 +1,612 @@
+#ifndef _DBLISP_DBLISP_LEXER_H_
+#define _DBLISP_DBLISP_LEXER_H_
+
+#include <exception>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <iterator>
+#define _DBLISP_COROUTINES_
+#endif
+
+#include "dblisp-scan.h"
+
+namespace dblisp {
+
+enum WordType { LEFT_PARENTHESIS, RIGHT_PARENTHESIS, STRING_VALUE, VARIABLE };
+
+class DbLispLexer;
+class DbLispChunkLexer;
+
+// A word as it appears in the source buffer. For STRING_VALUE the text
+// excludes the quotes and still holds the `\"` escapes.
+class DbLispToken {
+  friend class DbLispLexer;
+  friend class DbLispChunkLexer;
+
+ public:
+  DbLispToken() = default;
+
+  DbLispToken(WordType wordType, std::string_view text)
+      : wordType_(wordType), text_(text) {}
+
+  WordType wordType() const { return wordType_; }
+
+  std::string_view text() const { return text_; }
+
+  bool escaped() const { return escaped_; }
+
+  size_t offset() const { return offset_; }
+
+  void valueTo(std::string& value) const {
+    if (escaped_) {
+      unescape(text_, value);
+    } else {
+      value.assign(text_.data(), text_.size());
+    }
+  }
+
+  std::string value() const {
+    std::string val;
+    valueTo(val);
+    return val;
+  }
+
+  // Inside a string every `"` is preceded by the `\` that escaped it, so
+  // unescaping drops exactly that `\`.
+  static void unescape(std::string_view text, std::string& value) {
+    value.clear();
+    value.reserve(text.size());
+    for (size_t index = 0; index != text.size(); ++index) {
+      if (text[index] == '\\' && index + 1 != text.size() &&
+          text[index + 1] == '"') {
+        continue;
+      }
+      value.push_back(text[index]);
+    }
+  }
+
+ private:
+  WordType wordType_ = LEFT_PARENTHESIS;
+  std::string_view text_;
+  bool escaped_ = false;
+  size_t offset_ = 0;
+};
+
+// Pulls words out of one contiguous buffer without copying them.
+class DbLispLexer {
+ public:
+  DbLispLexer(const char* first, const char* last)
+      : first_(first), cur_(first), last_(last) {}
+
+  explicit DbLispLexer(std::string_view lispBuf)
+      : DbLispLexer(lispBuf.data(), lispBuf.data() + lispBuf.size()) {}
+
+  // Lexes only [begin, end) of `lispBuf`, offsets and line numbers stay
+  // relative to the start of `lispBuf`.
+  DbLispLexer(std::string_view lispBuf, size_t begin, size_t end)
+      : first_(lispBuf.data()),
+        cur_(lispBuf.data() + begin),
+        last_(lispBuf.data() + end) {}
+
+  // Returns false once the buffer is exhausted or a string is not closed,
+  // quotNotClose() tells the two apart.
+  bool next(DbLispToken& token) {
+    for (; cur_ != last_;) {
+      const char c = *cur_;
+      switch (c) {
+        case '(':
+          setToken(token, LEFT_PARENTHESIS, cur_, cur_ + 1);
+          cur_ += 1;
+          return true;
+        case ')':
+          setToken(token, RIGHT_PARENTHESIS, cur_, cur_ + 1);
+          cur_ += 1;
+          return true;
+        case ';':
+          cur_ = DbLispScanner::findChar(cur_, last_, '\n');
+          cur_ += cur_ != last_;
+          break;
+        case '"':
+          return nextString(token);
+        default:
+          if (isSpace(c)) {
+            cur_ = DbLispScanner::skipSpace(cur_ + 1, last_);
+          } else {
+            const char* start = cur_;
+            cur_ = DbLispScanner::findWordEnd(cur_ + 1, last_);
+            setToken(token, VARIABLE, start, cur_);
+            return true;
+          }
+      }
+    }
+    return false;
+  }
+
+  // Moves past the `)` that closes the innermost open form, without
+  // making a word of anything in between. Only `(`, `)`, strings and
+  // comments are looked at, so a variable word must not hold any of
+  // `(`, `"` or `;`. Returns false when the buffer ends first.
+  bool skipForm() {
+    bool escaped = false;
+    for (size_t depth = 1;;) {
+      cur_ = DbLispScanner::findSyntax(cur_, last_);
+      if (cur_ == last_) {
+        return false;
+      }
+      switch (*cur_) {
+        case '(':
+          depth += 1;
+          cur_ += 1;
+          break;
+        case ')':
+          cur_ += 1;
+          if (--depth == 0) {
+            return true;
+          }
+          break;
+        case ';':
+          cur_ = DbLispScanner::findChar(cur_, last_, '\n');
+          break;
+        default:
+          cur_ = stringEnd(cur_, escaped);
+          cur_ += cur_ != last_;
+      }
+    }
+  }
+
+  bool quotNotClose() const { return quotNotClose_; }
+
+  // Offset of the `"` that opened the unclosed string.
+  size_t errorOffset() const { return errorOffset_; }
+
+  size_t offset() const { return cur_ - first_; }
+
+  // Zero-based line and column of a byte offset, only used to report
+  // errors.
+  std::pair<size_t, size_t> lineColumn(size_t offset) const {
+    size_t lineIndex = 0, lineStart = 0;
+    for (size_t index = 0; index != offset; ++index) {
+      if (first_[index] == '\n') {
+        lineIndex += 1;
+        lineStart = index + 1;
+      }
+    }
+    return {lineIndex, offset - lineStart};
+  }
+
+  static bool isSpace(const char c) { return DbLispScanner::isSpace(c); }
+
+ private:
+  bool nextString(DbLispToken& token) {
+    const char* open = cur_;
+    bool escaped = false;
+    const char* quot = stringEnd(open, escaped);
+    if (quot == last_) {
+      return false;
+    }
+    setToken(token, STRING_VALUE, open + 1, quot);
+    token.escaped_ = escaped;
+    token.offset_ = open - first_;
+    cur_ = quot + 1;
+    return true;
+  }
+
+  // The `"` that closes the string opened at `open`. At the end of the
+  // buffer it marks the string as not closed and returns `last_`.
+  const char* stringEnd(const char* open, bool& escaped) {
+    for (const char* pos = open + 1;;) {
+      const char* quot = DbLispScanner::findChar(pos, last_, '"');
+      if (quot == last_) {
+        quotNotClose_ = true;
+        errorOffset_ = open - first_;
+        cur_ = last_;
+        return last_;
+      }
+      if (quot[-1] != '\\') {
+        return quot;
+      }
+      escaped = true;
+      pos = quot + 1;
+    }
+  }
+
+  void setToken(DbLispToken& token, WordType wordType, const char* start,
+                const char* end) const {
+    token.wordType_ = wordType;
+    token.text_ = std::string_view(start, end - start);
+    token.escaped_ = false;
+    token.offset_ = start - first_;
+  }
+
+ private:
+  const char* first_;
+  const char* cur_;
+  const char* last_;
+  bool quotNotClose_ = false;
+  size_t errorOffset_ = 0;
+};
+
+// Pulls the words of a document that arrives in chunks, e.g. from a pipe
+// or a socket: feed a chunk, take words with next until it returns false,
+// then feed the next chunk, and call finish after the last one. Words,
+// strings and comments may span any number of chunks. A word points into
+// the chunk, or into a copy of its bytes when it spans chunks, and stays
+// valid until next is called again. Only that one word is ever copied,
+// so the memory held is bounded by the largest word.
+//
+// Offsets count from the start of the document. A chunk may be freed
+// once next returned false.
+class DbLispChunkLexer {
+ public:
+  void feed(const char* data, size_t size) {
+    first_ = data;
+    cur_ = data;
+    last_ = data + size;
+    markSize_ = 0;
+    markLineColumn_ = chunkLineColumn_;
+  }
+
+  // No chunk follows, so a variable word at the end is complete.
+  void finish() {
+    feed(nullptr, 0);
+    finished_ = true;
+  }
+
+  // Returns false once the chunk is exhausted, or at the end of the
+  // document when a string is not closed, quotNotClose() tells.
+  bool next(DbLispToken& token) {
+    if (partial_ != PARTIAL_NONE) {
+      if (resume(token)) {
+        return true;
+      }
+      if (partial_ != PARTIAL_NONE) {
+        return endChunk();
+      }
+    }
+    for (; cur_ != last_;) {
+      const char c = *cur_;
+      switch (c) {
+        case '(':
+          setToken(token, LEFT_PARENTHESIS, cur_, cur_ + 1);
+          cur_ += 1;
+          return true;
+        case ')':
+          setToken(token, RIGHT_PARENTHESIS, cur_, cur_ + 1);
+          cur_ += 1;
+          return true;
+        case ';':
+          cur_ = DbLispScanner::findChar(cur_, last_, '\n');
+          if (cur_ == last_) {
+            partial_ = PARTIAL_COMMENT;
+          } else {
+            cur_ += 1;
+          }
+          break;
+        case '"':
+          if (nextString(token)) {
+            return true;
+          }
+          break;
+        default:
+          if (isSpace(c)) {
+            cur_ = DbLispScanner::skipSpace(cur_ + 1, last_);
+            break;
+          }
+          const char* start = cur_;
+          cur_ = DbLispScanner::findWordEnd(cur_ + 1, last_);
+          if (cur_ == last_ && !finished_) {
+            startCarry(PARTIAL_WORD, start, start);
+            break;
+          }
+          setToken(token, VARIABLE, start, cur_);
+          return true;
+      }
+    }
+    return endChunk();
+  }
+
+  bool quotNotClose() const { return quotNotClose_; }
+
+  // Offset of the `"` that opened the unclosed string.
+  size_t errorOffset() const { return carryOffset_; }
+
+  // Zero-based line and column of the word next returned last, or of the
+  // unclosed string.
+  std::pair<size_t, size_t> lineColumn(size_t offset) const {
+    if (offset < chunkOffset_ || first_ == nullptr) {
+      return carryLineColumn_;
+    }
+    return lineColumnAt(offset - chunkOffset_);
+  }
+
+  static bool isSpace(const char c) { return DbLispScanner::isSpace(c); }
+
+ private:
+  // What the last chunk ended in.
+  enum Partial { PARTIAL_NONE, PARTIAL_STRING, PARTIAL_WORD, PARTIAL_COMMENT };
+
+  bool nextString(DbLispToken& token) {
+    const char* open = cur_;
+    bool escaped = false;
+    const char* quot = stringEnd(open + 1, '"', escaped);
+    if (quot == last_) {
+      startCarry(PARTIAL_STRING, open, open + 1);
+      carryEscaped_ = escaped;
+      return false;
+    }
+    setToken(token, STRING_VALUE, open + 1, quot);
+    token.escaped_ = escaped;
+    token.offset_ = chunkOffset_ + (open - first_);
+    cur_ = quot + 1;
+    return true;
+  }
+
+  // The `"` that closes a string in [pos, last_), or `last_`. `before` is
+  // the byte before `pos`, which may be in an earlier chunk.
+  const char* stringEnd(const char* pos, char before, bool& escaped) const {
+    for (;;) {
+      const char* quot = DbLispScanner::findChar(pos, last_, '"');
+      if (quot == last_) {
+        return last_;
+      }
+      if ((quot == pos ? before : quot[-1]) != '\\') {
+        return quot;
+      }
+      escaped = true;
+      before = '"';
+      pos = quot + 1;
+    }
+  }
+
+  // Keeps the bytes from `text` to the end of the chunk of the word that
+  // starts at `start`.
+  void startCarry(Partial partial, const char* start, const char* text) {
+    partial_ = partial;
+    carryOffset_ = chunkOffset_ + (start - first_);
+    carryLineColumn_ = lineColumnAt(start - first_);
+    carry_.assign(text, last_ - text);
+    cur_ = last_;
+  }
+
+  // Goes on with what the last chunk ended in. True when `token` holds
+  // the word this completes; otherwise partial_ is still set when this
+  // chunk ends in it too.
+  bool resume(DbLispToken& token) {
+    const char* end = last_;
+    switch (partial_) {
+      case PARTIAL_COMMENT:
+        end = DbLispScanner::findChar(cur_, last_, '\n');
+        cur_ = end + (end != last_);
+        if (end != last_ || finished_) {
+          partial_ = PARTIAL_NONE;
+        }
+        return false;
+      case PARTIAL_WORD:
+        end = DbLispScanner::findWordEnd(cur_, last_);
+        carry_.append(cur_, end - cur_);
+        cur_ = end;
+        if (end == last_ && !finished_) {
+          return false;
+        }
+        setCarried(token, VARIABLE);
+        return true;
+      case PARTIAL_STRING:
+        end = stringEnd(cur_, carry_.empty() ? '"' : carry_.back(),
+                        carryEscaped_);
+        carry_.append(cur_, end - cur_);
+        if (end == last_) {
+          cur_ = last_;
+          quotNotClose_ = finished_;
+          return false;
+        }
+        cur_ = end + 1;
+        setCarried(token, STRING_VALUE);
+        token.escaped_ = carryEscaped_;
+        return true;
+      default:;
+    }
+    return false;
+  }
+
+  void setCarried(DbLispToken& token, WordType wordType) {
+    partial_ = PARTIAL_NONE;
+    token.wordType_ = wordType;
+    token.text_ = carry_;
+    token.escaped_ = false;
+    token.offset_ = carryOffset_;
+  }
+
+  // Moves the line and column on to the end of the exhausted chunk.
+  bool endChunk() {
+    if (first_ != nullptr) {
+      chunkLineColumn_ = lineColumnAt(last_ - first_);
+      chunkOffset_ += last_ - first_;
+      feed(nullptr, 0);
+    }
+    return false;
+  }
+
+  // Line and column `size` bytes into the chunk. Goes on from the last
+  // position asked for when it is not past `size`, so asking in stream
+  // order reads every byte of the chunk once.
+  std::pair<size_t, size_t> lineColumnAt(size_t size) const {
+    if (size < markSize_) {
+      markSize_ = 0;
+      markLineColumn_ = chunkLineColumn_;
+    }
+    auto lineColumn = markLineColumn_;
+    const char* pos = first_ + markSize_;
+    const char* end = first_ + size;
+    for (;;) {
+      const char* newline = DbLispScanner::findChar(pos, end, '\n');
+      if (newline == end) {
+        break;
+      }
+      lineColumn.first += 1;
+      lineColumn.second = 0;
+      pos = newline + 1;
+    }
+    lineColumn.second += end - pos;
+    markSize_ = size;
+    markLineColumn_ = lineColumn;
+    return lineColumn;
+  }
+
+  void setToken(DbLispToken& token, WordType wordType, const char* start,
+                const char* end) const {
+    token.wordType_ = wordType;
+    token.text_ = std::string_view(start, end - start);
+    token.escaped_ = false;
+    token.offset_ = chunkOffset_ + (start - first_);
+  }
+
+ private:
+  const char* first_ = nullptr;
+  const char* cur_ = nullptr;
+  const char* last_ = nullptr;
+  // Offset, line and column where the current chunk starts.
+  size_t chunkOffset_ = 0;
+  std::pair<size_t, size_t> chunkLineColumn_{0, 0};
+  // The last position lineColumnAt reached in the current chunk.
+  mutable size_t markSize_ = 0;
+  mutable std::pair<size_t, size_t> markLineColumn_{0, 0};
+  Partial partial_ = PARTIAL_NONE;
+  std::string carry_;
+  size_t carryOffset_ = 0;
+  std::pair<size_t, size_t> carryLineColumn_{0, 0};
+  bool carryEscaped_ = false;
+  bool finished_ = false;
+  bool quotNotClose_ = false;
+};
+
+#ifdef _DBLISP_COROUTINES_
+// The words of a document read chunk by chunk, lexed only as they are
+// asked for, see lispTokens. Needs C++20.
+class DbLispTokenStream {
+ public:
+  struct promise_type {
+    DbLispTokenStream get_return_object() {
+      return DbLispTokenStream(
+          std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    std::suspend_always final_suspend() noexcept { return {}; }
+
+    std::suspend_always yield_value(const DbLispToken& token) noexcept {
+      this->token = token;
+      return {};
+    }
+
+    void return_void() {}
+
+    void unhandled_exception() { exception = std::current_exception(); }
+
+    DbLispToken token;
+    std::exception_ptr exception;
+  };
+
+  class iterator {
+    friend class DbLispTokenStream;
+
+   public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef DbLispToken value_type;
+    typedef const DbLispToken& reference;
+    typedef const DbLispToken* pointer;
+    typedef ptrdiff_t difference_type;
+
+    reference operator*() const { return handle_.promise().token; }
+
+    pointer operator->() const { return &handle_.promise().token; }
+
+    iterator& operator++() {
+      resume(handle_);
+      return *this;
+    }
+
+    void operator++(int) { ++*this; }
+
+    bool operator==(std::default_sentinel_t) const { return handle_.done(); }
+
+   private:
+    explicit iterator(std::coroutine_handle<promise_type> handle)
+        : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+  };
+
+  DbLispTokenStream(const DbLispTokenStream&) = delete;
+
+  DbLispTokenStream& operator=(const DbLispTokenStream&) = delete;
+
+  DbLispTokenStream(DbLispTokenStream&& x) noexcept
+      : handle_(std::exchange(x.handle_, nullptr)) {}
+
+  DbLispTokenStream& operator=(DbLispTokenStream&& x) noexcept {
+    std::swap(handle_, x.handle_);
+    return *this;
+  }
+
+  ~DbLispTokenStream() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  // Lexes up to the first word, so begin can be called once.
+  iterator begin() {
+    resume(handle_);
+    return iterator(handle_);
+  }
+
+  std::default_sentinel_t end() const { return {}; }
+
+ private:
+  explicit DbLispTokenStream(std::coroutine_handle<promise_type> handle)
+      : handle_(handle) {}
+
+  // Lexes up to the next word, rethrows what reading a chunk threw.
+  static void resume(std::coroutine_handle<promise_type> handle) {
+    handle.resume();
+    if (handle.promise().exception) {
+      std::rethrow_exception(handle.promise().exception);
+    }
+  }
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+// Yields the words of the chunks `read` returns, a std::string_view each,
+// until it returns an empty one. The next chunk is only read once every
+// word of the last one was taken, so lexing overlaps with reading. A
+// chunk must stay valid until `read` is called again. `lexer` tells about
+// a string left open once the stream ends.
+template <typename Read>
+DbLispTokenStream lispTokens(Read read, DbLispChunkLexer& lexer) {
+  DbLispToken token;
+  for (;;) {
+    std::string_view chunk = read();
+    if (chunk.empty()) {
+      lexer.finish();
+    } else {
+      lexer.feed(chunk.data(), chunk.size());
+    }
+    while (lexer.next(token)) {
+      co_yield token;
+    }
+    if (chunk.empty()) {
+      co_return;
+    }
+  }
+}
+#endif
+
+}  // namespace dblisp
+
+#endif
@@ -1,77 +1,1564 @@
 #ifndef _DBLISP_DBLISP_PARSER_H_
 #define _DBLISP_DBLISP_PARSER_H_
-#include <fstream>
-#include <stack>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
+#include "borrowed-tree.h"
+#include "dblisp-file.h"
+#include "dblisp-lexer.h"
 #include "recursive-map.h"
 
 namespace dblisp {
 
-enum WordType { LEFT_PARENTHESIS, RIGHT_PARENTHESIS, STRING_VALUE, VARIABLE };
+class DbLispParser;
+class LazyTree;
+
+class DbLispWord {
+  friend class DbLispParser;
+  friend std::ostream& operator<<(std::ostream& outStream,
+                                  const DbLispWord& word);
+
+ public:
+  DbLispWord(std::string&& value, WordType wordType)
+      : value_(std::move(value)), wordType_(wordType) {}
+
+ private:
+  std::string value_;
+  WordType wordType_;
+};
+
+// std::ostream& operator<<(std::ostream& outStream, const DbLispWord& word) {
+//   outStream << word.value_;
+//   return outStream;
+// }
+
+// The key paths a projected parse builds, e.g. "set/editor.*". A path is
+// split at every `/` and a `*` in a segment matches any run of bytes, so
+// a key holding `/` cannot be named. A node is built when its own path
+// matches the start of a key path, and with all of its subtree when it
+// matches a whole one.
+class DbLispProjection {
+ public:
+  DbLispProjection() = default;
+
+  explicit DbLispProjection(const std::vector<std::string>& keyPaths) {
+    for (const auto& keyPath : keyPaths) {
+      std::vector<std::string> segments;
+      for (size_t first = 0;;) {
+        size_t slash = keyPath.find('/', first);
+        segments.push_back(keyPath.substr(first, slash - first));
+        if (slash == std::string::npos) break;
+        first = slash + 1;
+      }
+      paths_.push_back(std::move(segments));
+    }
+  }
+
+  // No key path, everything is built.
+  bool empty() const { return paths_.empty(); }
+
+  // Starts over at the root, where every key path is still open.
+  void reset() {
+    levels_.resize(1);
+    levels_[0].all = false;
+    levels_[0].open.clear();
+    for (size_t index = 0; index != paths_.size(); ++index) {
+      levels_[0].open.push_back(static_cast<uint32_t>(index));
+    }
+  }
+
+  // Whether the node `key` opened below a node at `depth`, 1 being the
+  // root, is built. The nodes above it must have been opened already.
+  bool open(size_t depth, std::string_view key) {
+    if (levels_.size() <= depth) {
+      levels_.resize(depth + 1);
+    }
+    const Level& parent = levels_[depth - 1];
+    Level& level = levels_[depth];
+    level.all = parent.all;
+    level.open.clear();
+    if (level.all) {
+      return true;
+    }
+    for (uint32_t index : parent.open) {
+      const auto& segments = paths_[index];
+      if (!globMatch(segments[depth - 1], key)) {
+        continue;
+      }
+      if (segments.size() == depth) {
+        level.all = true;
+        level.open.clear();
+        return true;
+      }
+      level.open.push_back(index);
+    }
+    return !level.open.empty();
+  }
+
+  // `*` matches any run of bytes, every other byte itself.
+  static bool globMatch(std::string_view pattern, std::string_view text) {
+    size_t pos = 0, textPos = 0;
+    size_t star = std::string_view::npos, starText = 0;
+    while (textPos != text.size()) {
+      if (pos != pattern.size() && pattern[pos] == '*') {
+        star = pos++;
+        starText = textPos;
+      } else if (pos != pattern.size() && pattern[pos] == text[textPos]) {
+        ++pos;
+        ++textPos;
+      } else if (star != std::string_view::npos) {
+        pos = star + 1;
+        textPos = ++starText;
+      } else {
+        return false;
+      }
+    }
+    for (; pos != pattern.size() && pattern[pos] == '*'; ++pos) {
+    }
+    return pos == pattern.size();
+  }
+
+ private:
+  // `open` lists the key paths whose leading segments match the node,
+  // `all` is set once one matched whole.
+  struct Level {
+    bool all = false;
+    std::vector<uint32_t> open;
+  };
+
+  std::vector<std::vector<std::string>> paths_;
+  std::vector<Level> levels_;
+};
+
+// What DbLispParser::lispReparse keeps between two parses of one file:
+// the text it parsed last, and the key, place, hash and variables of every
+// top level definition in it. A definition counts as unchanged only when
+// its bytes compare equal, the hash merely skips most of the comparisons.
+// Empty until the first reparse, or after a parse it could not index.
+class DbLispFormIndex {
+  friend class DbLispParser;
+
+ public:
+  bool empty() const { return forms_.empty(); }
+
+  // Number of top level definitions.
+  size_t size() const { return forms_.size(); }
+
+  void clear() {
+    forms_.clear();
+    byKey_.clear();
+    text_.clear();
+  }
+
+ private:
+  struct Form {
+    std::string key;
+    size_t offset;
+    size_t size;
+    size_t hash;
+    std::vector<std::string> variables;
+  };
+
+  std::vector<Form> forms_;
+  std::unordered_map<std::string, size_t> byKey_;
+  std::string text_;
+};
+
+// Why a parse failed, as DbLispParser::lastError returns it. `line` and
+// `column` count from 1; both are 0 when the parser names no position,
+// e.g. for a file that does not open.
+struct DbLispError {
+  std::string file;
+  size_t line = 0;
+  size_t column = 0;
+  std::string message;
+
+  bool empty() const { return message.empty(); }
+
+  void clear() {
+    file.clear();
+    line = 0;
+    column = 0;
+    message.clear();
+  }
+
+  // The line the parser logs, without the newline.
+  std::string toString() const {
+    std::string ret = "dblisp: parser: error: " + file + ":";
+    if (line != 0) {
+      ret += std::to_string(line) + ":" + std::to_string(column) + ":";
+    }
+    return ret + message;
+  }
+};
+
+// What the parser does after an event of a DbLispHandler.
+enum DbLispAction { ACTION_CONTINUE, ACTION_SKIP, ACTION_STOP };
+
+// Receives the events of DbLispParser::lispToEvents, in file order. A
+// handler derives from this class and hides the events it wants; they are
+// called on the derived type, nothing is virtual. The payloads are
+// unescaped and only valid during the call: they point into the buffer,
+// or into a scratch string when the word holds an escape.
+//
+// Every event returns what happens next. ACTION_SKIP passes the rest of
+// the innermost open form, which gets no onClose: after onOpen that is
+// the form just opened, after onClose the one around it. Skipped words
+// are only scanned for parentheses, strings and comments. Outside any
+// form ACTION_SKIP stops like ACTION_STOP.
+class DbLispHandler {
+ public:
+  // `("key"`.
+  DbLispAction onOpen(std::string_view /*key*/) { return ACTION_CONTINUE; }
+
+  // `(var`, a form that starts as a copy of the definition `var`.
+  DbLispAction onOpenVariable(std::string_view /*name*/) {
+    return ACTION_CONTINUE;
+  }
+
+  DbLispAction onValue(std::string_view /*value*/) { return ACTION_CONTINUE; }
+
+  // A variable used for the values of the definition it names.
+  DbLispAction onVariable(std::string_view /*name*/) {
+    return ACTION_CONTINUE;
+  }
+
+  // The `)` of the innermost open form.
+  DbLispAction onClose() { return ACTION_CONTINUE; }
+};
+
+class DbLispParser {
+  friend class LazyTree;
+  friend class DbLispPushParser;
+  enum map_type { MAP_INIT, MAP_MAP, MAP_VALUE };
+  enum var_type { VAR_UNDEFINED, VAR_INIT, VAR_VALUE, VAR_TREE };
+  using link_type = recursive_map::link_type;
+
+  // A top level definition found by a scan, [first, last) runs from its
+  // `(` to its `)`. Once parsed `root` holds a tree whose only child is
+  // the definition.
+  struct Definition {
+    std::string key;
+    size_t first;
+    size_t last;
+    std::unique_ptr<recursive_map> root;
+    bool failed = false;
+  };
+
+  // States of a definition in parseParallel.
+  enum : uint8_t { kPending, kParsed, kFailed };
+
+ public:
+  // PARSE_TOKEN_VECTOR lexes the whole file into a word vector before the
+  // tree is built; PARSE_FUSED feeds every word straight into the tree
+  // builder while scanning, so no word vector is ever held in memory.
+  // PARSE_PARALLEL finds where every top level definition ends with one
+  // scan and parses the definitions fused on threadCount() threads, see
+  // parseParallel.
+  enum ParseMode { PARSE_TOKEN_VECTOR, PARSE_FUSED, PARSE_PARALLEL };
+
+  void setParseMode(ParseMode parseMode) { parseMode_ = parseMode; }
+
+  ParseMode parseMode() const { return parseMode_; }
+
+  // Threads of PARSE_PARALLEL, 0 means one per hardware thread.
+  void setThreadCount(size_t threadCount) { threadCount_ = threadCount; }
+
+  size_t threadCount() const {
+    return threadCount_ != 0
+               ? threadCount_
+               : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  }
+
+  // When set, every value vector of a parsed recursive_map whose values
+  // are all numbers is stored as a number column, see
+  // RecTree::packNumbers. Off by default since reading such a node through
+  // value() or valueVector() turns it back into values.
+  void setPackNumbers(bool packNumbers) { packNumbers_ = packNumbers; }
+
+  bool packNumbers() const { return packNumbers_; }
+
+  // Restricts lispToRecMap and lispBufToRecMap to the subtrees named by
+  // `keyPaths`, see DbLispProjection; no key path builds everything. Any
+  // other form is skipped by a scan for parentheses, strings and comments
+  // without building or checking it, so a projection of a large file
+  // costs little more than reading it. A variable may still name a
+  // skipped top level definition, which is then parsed on its own.
+  void setKeyPaths(const std::vector<std::string>& keyPaths) {
+    keyPaths_ = keyPaths;
+    projection_ = DbLispProjection(keyPaths);
+  }
+
+  const std::vector<std::string>& keyPaths() const { return keyPaths_; }
+
+  // Errors are logged to std::cerr unless this is cleared; lastError
+  // holds them either way.
+  void setLogErrors(bool logErrors) { logErrors_ = logErrors; }
+
+  bool logErrors() const { return logErrors_; }
+
+  // The error of the last parse, empty when it succeeded.
+  const DbLispError& lastError() const { return error_; }
+
+  bool lispToRecMap(const std::string& lispFile, recursive_map& rmap) {
+    beginParse(lispFile);
+    DbLispFile file;
+    if (!file.open(lispFile)) {
+      return openErrorLog(lispFile);
+    }
+    return bufToRecMap(file.view(), rmap);
+  }
+
+  // Parses only the subtrees named by `keyPaths`, whatever setKeyPaths
+  // holds.
+  bool lispToRecMap(const std::string& lispFile, recursive_map& rmap,
+                    const std::vector<std::string>& keyPaths) {
+    std::vector<std::string> savedKeyPaths = keyPaths_;
+    setKeyPaths(keyPaths);
+    bool ret = lispToRecMap(lispFile, rmap);
+    setKeyPaths(savedKeyPaths);
+    return ret;
+  }
+
+  // Parses an in-memory buffer, e.g. a config blob received over IPC.
+  // `bufName` only names the buffer in error messages.
+  bool lispBufToRecMap(std::string_view lispBuf, recursive_map& rmap,
+                       const std::string& bufName = "<buffer>") {
+    beginParse(bufName);
+    return bufToRecMap(lispBuf, rmap);
+  }
+
+  bool lispBufToRecMap(const char* data, size_t size, recursive_map& rmap,
+                       const std::string& bufName = "<buffer>") {
+    return lispBufToRecMap(std::string_view(data, size), rmap, bufName);
+  }
+
+  // Streams the file to `handler`, a DbLispHandler, without building
+  // anything. Only the syntax is checked: the parentheses, the strings and
+  // that every form has a key. Variables are passed on unresolved and keys
+  // may repeat. Key paths are ignored. Returns true when the file ends or
+  // `handler` stops the parse, false on a syntax error.
+  template <typename Handler>
+  bool lispToEvents(const std::string& lispFile, Handler& handler) {
+    beginParse(lispFile);
+    DbLispFile file;
+    if (!file.open(lispFile)) {
+      return openErrorLog(lispFile);
+    }
+    return bufToEvents(file.view(), handler);
+  }
+
+  template <typename Handler>
+  bool lispBufToEvents(std::string_view lispBuf, Handler& handler,
+                       const std::string& bufName = "<buffer>") {
+    beginParse(bufName);
+    return bufToEvents(lispBuf, handler);
+  }
+
+  // Builds a read-only tree whose keys and values point into the mapped
+  // file, which the tree keeps alive.
+  bool lispToBorrowedTree(const std::string& lispFile, BorrowedTree& tree) {
+    beginParse(lispFile);
+    auto file = std::make_shared<DbLispFile>();
+    if (!file->open(lispFile)) {
+      return openErrorLog(lispFile);
+    }
+    std::string_view lispBuf = file->view();
+    return bufToBorrowedTree(lispBuf, std::move(file), tree);
+  }
+
+  bool lispBufToBorrowedTree(std::shared_ptr<const std::string> lispBuf,
+                             BorrowedTree& tree,
+                             const std::string& bufName = "<buffer>") {
+    beginParse(bufName);
+    std::string_view lispView = *lispBuf;
+    return bufToBorrowedTree(lispView, std::move(lispBuf), tree);
+  }
+
+  bool lispBufToBorrowedTree(std::string&& lispBuf, BorrowedTree& tree,
+                             const std::string& bufName = "<buffer>") {
+    return lispBufToBorrowedTree(
+        std::make_shared<const std::string>(std::move(lispBuf)), tree,
+        bufName);
+  }
+
+  // Parses `lispFile` into `rmap`, which must hold the unchanged result of
+  // the last reparse with `index`, or of none when `index` is empty. Only
+  // the top level definitions whose text changed, or that use a variable
+  // whose definition changed, are built again; every other one keeps its
+  // subtree. The file is still scanned and hashed whole, but that runs
+  // at memory speed. The result is the same as lispToRecMap's, key paths
+  // are ignored. On error both `rmap` and `index` are left alone.
+  bool lispReparse(const std::string& lispFile, recursive_map& rmap,
+                   DbLispFormIndex& index) {
+    beginParse(lispFile);
+    DbLispFile file;
+    if (!file.open(lispFile)) {
+      return openErrorLog(lispFile);
+    }
+    return bufReparse(file.view(), rmap, index);
+  }
+
+  bool lispBufReparse(std::string_view lispBuf, recursive_map& rmap,
+                      DbLispFormIndex& index,
+                      const std::string& bufName = "<buffer>") {
+    beginParse(bufName);
+    return bufReparse(lispBuf, rmap, index);
+  }
+
+  // Only finds the byte range of every top level definition, each one is
+  // parsed the first time it is reached through the LazyTree. Defined in
+  // lazy-tree.h.
+  inline bool lispToLazyTree(const std::string& lispFile, LazyTree& tree);
+
+  inline bool lispBufToLazyTree(std::shared_ptr<const std::string> lispBuf,
+                                LazyTree& tree,
+                                const std::string& bufName = "<buffer>");
+
+ private:
+  // Builds a recursive_map, a TreeHandler drives it. Like
+  // BorrowedTreeBuilder it keeps every finished node in childStk_ until its
+  // parent closes, then the parent adopts all of them with one sort.
+  class RecMapBuilder {
+    struct Level {
+      link_type tree;
+      map_type mapType;
+      size_t childBegin;
+    };
+
+   public:
+    using KeyMap = std::pmr::unordered_map<std::string_view, link_type>;
+
+    // The stacks of a builder, which a parser keeps between parses so a
+    // warm parser does not allocate them again. The key maps take their
+    // nodes from `resource`, which keeps the freed ones.
+    class Scratch {
+      friend class RecMapBuilder;
+
+      std::unique_ptr<std::pmr::unsynchronized_pool_resource> resource;
+      std::vector<Level> mapStk;
+      std::vector<link_type> childStk;
+      std::vector<KeyMap> levelKeyStk;
+      std::string word;
+    };
+
+    // `scratch` lends its stacks to the builder until it dies.
+    RecMapBuilder(recursive_map& rmap, bool packNumbers,
+                  Scratch* scratch = nullptr)
+        : rmap_(rmap),
+          packNumbers_(packNumbers),
+          scratch_(scratch),
+          keyResource_(std::pmr::get_default_resource()) {
+      if (scratch_ != nullptr) {
+        if (scratch_->resource == nullptr) {
+          scratch_->resource =
+              std::make_unique<std::pmr::unsynchronized_pool_resource>();
+        }
+        keyResource_ = scratch_->resource.get();
+        mapStk.swap(scratch_->mapStk);
+        childStk_.swap(scratch_->childStk);
+        levelKeyStk_.swap(scratch_->levelKeyStk);
+        word_.swap(scratch_->word);
+      }
+      openLevel(&rmap, MAP_MAP);
+    }
+
+    ~RecMapBuilder() {
+      for (link_type child : childStk_) {
+        child->freeTree(child);
+      }
+      for (size_t index = 1; index < mapStk.size(); ++index) {
+        mapStk[index].tree->freeTree(mapStk[index].tree);
+      }
+      if (scratch_ != nullptr) {
+        mapStk.clear();
+        childStk_.clear();
+        for (auto& levelKeys : levelKeyStk_) {
+          levelKeys.clear();
+        }
+        mapStk.swap(scratch_->mapStk);
+        childStk_.swap(scratch_->childStk);
+        levelKeyStk_.swap(scratch_->levelKeyStk);
+        word_.swap(scratch_->word);
+      }
+    }
+
+    size_t depth() const { return mapStk.size(); }
+
+    map_type& topType() { return mapStk.back().mapType; }
+
+    map_type parentType() const {
+      return mapStk[mapStk.size() - 2].mapType;
+    }
+
+    std::string topKey() const {
+      return std::string(mapStk.back().tree->refRealKey());
+    }
+
+    void openKey(const DbLispToken& token) {
+      std::string_view key = token.text();
+      if (token.escaped()) {
+        token.valueTo(word_);
+        key = word_;
+      }
+      link_type parent = mapStk.back().tree;
+      openLevel(parent->createChild(parent->makeKey(key)), MAP_INIT);
+    }
+
+    bool openVariable(std::string_view name) {
+      link_type var = findVariable(name);
+      if (var == nullptr) {
+        return false;
+      }
+      map_type mapType = MAP_INIT;
+      switch (var->valueStatus_) {
+        case recursive_map::VALUE_TYPE::VALUE:
+        case recursive_map::VALUE_TYPE::VALUE_VECTOR:
+        case recursive_map::VALUE_TYPE::INT64_VECTOR:
+        case recursive_map::VALUE_TYPE::DOUBLE_VECTOR:
+          mapType = map_type::MAP_VALUE;
+          break;
+        case recursive_map::VALUE_TYPE::RECTREE:
+          mapType = map_type::MAP_MAP;
+          break;
+        case recursive_map::VALUE_TYPE::INITAL:
+          mapType = map_type::MAP_INIT;
+          break;
+        default:;
+      }
+      openLevel(rmap_.createTree(*var, recursive_map::ShareTag()), mapType);
+      return true;
+    }
+
+    void pushValue(const DbLispToken& token) {
+      if (!token.escaped()) {
+        mapStk.back().tree->pushValue(token.text());
+        return;
+      }
+      token.valueTo(word_);
+      mapStk.back().tree->pushValue(word_);
+    }
+
+    var_type pushVariable(std::string_view name) {
+      link_type var = findVariable(name);
+      if (var == nullptr) {
+        return VAR_UNDEFINED;
+      }
+      if (var->isValue()) {
+        link_type top = mapStk.back().tree;
+        var->visitValues([top](std::string_view val) { top->pushValue(val); });
+        return VAR_VALUE;
+      }
+      return var->isTree() ? VAR_TREE : VAR_INIT;
+    }
+
+    void discardTop() {
+      for (size_t index = mapStk.back().childBegin; index != childStk_.size();
+           ++index) {
+        childStk_[index]->freeTree(childStk_[index]);
+      }
+      childStk_.resize(mapStk.back().childBegin);
+      link_type top = mapStk.back().tree;
+      mapStk.pop_back();
+      top->freeTree(top);
+    }
+
+    bool close(std::string& duplicateKey) {
+      link_type top = finishTop();
+      if (packNumbers_) {
+        top->packNumbers();
+      }
+      link_type parent = mapStk.back().tree;
+      std::string_view key = top->refRealKey();
+      if (levelKeys().count(key) != 0 ||
+          (parent->isTree() &&
+           parent->find(std::string(key)) != parent->end())) {
+        duplicateKey.assign(key.data(), key.size());
+        top->freeTree(top);
+        return false;
+      }
+      // A recursive_map drops its values when it gets a child.
+      if (parent->isValue()) {
+        parent->clearNodeValue();
+      }
+      levelKeys().emplace(key, top);
+      childStk_.push_back(top);
+      return true;
+    }
+
+    void finish() { finishTop(); }
+
+    // Resolves the variables that are not defined in the parsed buffer,
+    // LazyTree parses one top level definition at a time.
+    void setOuterVariables(std::function<link_type(std::string_view)> find) {
+      outerVariables_ = std::move(find);
+    }
+
+    // Hands over the top level definition of a parse that has not been
+    // finished, the builder can then parse the next one. nullptr when the
+    // parse did not close exactly one definition.
+    link_type releaseDefinition() {
+      if (mapStk.size() != 1 || childStk_.size() != 1) {
+        return nullptr;
+      }
+      link_type tree = childStk_.back();
+      childStk_.clear();
+      levelKeys().clear();
+      return tree;
+    }
+
+    // The top level definition `name` if it is closed already.
+    link_type findDefinition(std::string_view name) {
+      auto& rootKeys = levelKeyStk_.front();
+      auto iter = rootKeys.find(name);
+      return iter == rootKeys.end() ? nullptr : iter->second;
+    }
+
+   private:
+    void openLevel(link_type tree, map_type mapType) {
+      mapStk.push_back(Level{tree, mapType, childStk_.size()});
+      if (levelKeyStk_.size() < mapStk.size()) {
+        levelKeyStk_.emplace_back(keyResource_);
+      }
+      levelKeys().clear();
+    }
+
+    // Pops the innermost open node after handing it its children.
+    link_type finishTop() {
+      Level top = mapStk.back();
+      mapStk.pop_back();
+      top.tree->adoptChildren(childStk_.begin() + top.childBegin,
+                              childStk_.end());
+      childStk_.resize(top.childBegin);
+      return top.tree;
+    }
+
+    // Variables are the top level definitions parsed so far.
+    link_type findVariable(std::string_view name) {
+      link_type var = findDefinition(name);
+      if (var != nullptr || !outerVariables_) {
+        return var;
+      }
+      return outerVariables_(name);
+    }
+
+    KeyMap& levelKeys() {
+      return levelKeyStk_[mapStk.size() - 1];
+    }
+
+   private:
+    recursive_map& rmap_;
+    const bool packNumbers_;
+    std::vector<Level> mapStk;
+    std::vector<link_type> childStk_;
+    std::vector<KeyMap> levelKeyStk_;
+    std::function<link_type(std::string_view)> outerVariables_;
+    std::string word_;
+    Scratch* scratch_;
+    std::pmr::memory_resource* keyResource_;
+  };
+
+  // Builds a BorrowedTree. Every finished node is kept in childStk_ until
+  // its parent closes, then the siblings are sorted and moved to the tree
+  // as one contiguous range.
+  class BorrowedTreeBuilder {
+    using NodeRec = BorrowedTree::NodeRec;
+    using StrRef = BorrowedTree::StrRef;
+
+   public:
+    explicit BorrowedTreeBuilder(BorrowedTree& tree) : tree_(tree) {
+      tree_.nodes_.clear();
+      openNode(tree_.rootKey_, MAP_MAP);
+    }
+
+    size_t depth() const { return openStk_.size(); }
+
+    map_type& topType() { return openStk_.back().mapType; }
+
+    map_type parentType() const {
+      return openStk_[openStk_.size() - 2].mapType;
+    }
+
+    std::string topKey() const {
+      return std::string(tree_.str(openStk_.back().node.key_));
+    }
+
+    void openKey(const DbLispToken& token) {
+      openNode(keyRef(token), MAP_INIT);
+    }
+
+    bool openVariable(std::string_view name) {
+      const NodeRec* var = findVariable(name);
+      if (var == nullptr) {
+        return false;
+      }
+      map_type mapType = MAP_INIT;
+      switch (var->status_) {
+        case recursive_map::VALUE_TYPE::VALUE:
+        case recursive_map::VALUE_TYPE::VALUE_VECTOR:
+          mapType = map_type::MAP_VALUE;
+          break;
+        case recursive_map::VALUE_TYPE::RECTREE:
+          mapType = map_type::MAP_MAP;
+          break;
+        default:;
+      }
+      NodeRec varNode = *var;
+      openNode(varNode.key_, mapType);
+      if (varNode.status_ == recursive_map::VALUE_TYPE::RECTREE) {
+        for (uint32_t index = 0; index != varNode.count_; ++index) {
+          const NodeRec& child = tree_.nodes_[varNode.first_ + index];
+          childStk_.push_back(child);
+          levelKeys().emplace(tree_.str(child.key_), childStk_.size() - 1);
+        }
+      } else {
+        pushVariableValues(varNode);
+      }
+      return true;
+    }
+
+    void pushValue(const DbLispToken& token) {
+      StrRef value{token.text().data(),
+                   static_cast<uint32_t>(token.text().size()),
+                   BorrowedTree::kNoCache};
+      if (token.escaped()) {
+        value.cacheIndex_ = tree_.unescapedSize_++;
+      }
+      valStk_.push_back(value);
+    }
+
+    var_type pushVariable(std::string_view name) {
+      const NodeRec* var = findVariable(name);
+      if (var == nullptr) {
+        return VAR_UNDEFINED;
+      }
+      switch (var->status_) {
+        case recursive_map::VALUE_TYPE::VALUE:
+        case recursive_map::VALUE_TYPE::VALUE_VECTOR:
+          pushVariableValues(NodeRec(*var));
+          return VAR_VALUE;
+        case recursive_map::VALUE_TYPE::RECTREE:
+          return VAR_TREE;
+        default:
+          return VAR_INIT;
+      }
+    }
+
+    void discardTop() {
+      childStk_.resize(openStk_.back().childBegin);
+      valStk_.resize(openStk_.back().valBegin);
+      openStk_.pop_back();
+    }
+
+    bool close(std::string& duplicateKey) {
+      NodeRec node = finishTop();
+      std::string_view key = tree_.str(node.key_);
+      // A recursive_map parent drops its values when it gets a child.
+      valStk_.resize(openStk_.back().valBegin);
+      if (!levelKeys().emplace(key, childStk_.size()).second) {
+        duplicateKey.assign(key.data(), key.size());
+        return false;
+      }
+      childStk_.push_back(node);
+      return true;
+    }
+
+    void finish() {
+      NodeRec root = finishTop();
+      tree_.rootIndex_ = tree_.nodes_.size();
+      tree_.nodes_.push_back(root);
+      tree_.buildIndex();
+      tree_.unescaped_.reset(
+          new std::atomic<std::string*>[tree_.unescapedSize_]());
+    }
+
+   private:
+    struct OpenNode {
+      NodeRec node;
+      map_type mapType;
+      size_t childBegin;
+      size_t valBegin;
+    };
+
+    void openNode(StrRef key, map_type mapType) {
+      openStk_.push_back(OpenNode{NodeRec{key, 0, 0, recursive_map::INITAL},
+                                  mapType, childStk_.size(), valStk_.size()});
+      if (levelKeyStk_.size() < openStk_.size()) {
+        levelKeyStk_.emplace_back();
+      }
+      levelKeys().clear();
+    }
+
+    // Pops the innermost open node and moves its children or values into
+    // the tree.
+    NodeRec finishTop() {
+      OpenNode top = openStk_.back();
+      openStk_.pop_back();
+      NodeRec node = top.node;
+      if (childStk_.size() != top.childBegin) {
+        auto first = childStk_.begin() + top.childBegin;
+        std::sort(first, childStk_.end(),
+                  [this](const NodeRec& left, const NodeRec& right) {
+                    return tree_.str(left.key_) < tree_.str(right.key_);
+                  });
+        node.status_ = recursive_map::VALUE_TYPE::RECTREE;
+        node.first_ = tree_.nodes_.size();
+        node.count_ = childStk_.end() - first;
+        tree_.nodes_.insert(tree_.nodes_.end(), first, childStk_.end());
+        childStk_.resize(top.childBegin);
+      } else if (valStk_.size() != top.valBegin) {
+        auto first = valStk_.begin() + top.valBegin;
+        node.count_ = valStk_.end() - first;
+        node.status_ = node.count_ == 1
+                           ? recursive_map::VALUE_TYPE::VALUE
+                           : recursive_map::VALUE_TYPE::VALUE_VECTOR;
+        node.first_ = tree_.values_.size();
+        tree_.values_.insert(tree_.values_.end(), first, valStk_.end());
+        valStk_.resize(top.valBegin);
+      }
+      return node;
+    }
+
+    void pushVariableValues(const NodeRec& var) {
+      for (uint32_t index = 0; index != var.count_; ++index) {
+        valStk_.push_back(tree_.values_[var.first_ + index]);
+      }
+    }
+
+    const NodeRec* findVariable(std::string_view name) {
+      auto& rootKeys = levelKeyStk_.front();
+      auto iter = rootKeys.find(name);
+      return iter == rootKeys.end() ? nullptr : &childStk_[iter->second];
+    }
+
+    std::unordered_map<std::string_view, size_t>& levelKeys() {
+      return levelKeyStk_[openStk_.size() - 1];
+    }
+
+    // Keys are unescaped eagerly since they are sorted and looked up.
+    StrRef keyRef(const DbLispToken& token) {
+      std::string_view key = token.text();
+      if (token.escaped()) {
+        tree_.ownedKeys_.emplace_back();
+        token.valueTo(tree_.ownedKeys_.back());
+        key = tree_.ownedKeys_.back();
+      }
+      return StrRef{key.data(), static_cast<uint32_t>(key.size()),
+                    BorrowedTree::kNoCache};
+    }
+
+   private:
+    BorrowedTree& tree_;
+    std::vector<OpenNode> openStk_;
+    std::vector<NodeRec> childStk_;
+    std::vector<StrRef> valStk_;
+    std::vector<std::unordered_map<std::string_view, size_t>> levelKeyStk_;
+  };
+
+  // Builds a tree with a RecMapBuilder or a BorrowedTreeBuilder from the
+  // words pushWord checked. Errors stop the parse.
+  template <typename TreeBuilder>
+  class TreeHandler {
+   public:
+    TreeHandler(DbLispParser& parser, TreeBuilder& builder)
+        : parser_(parser), builder_(builder) {}
+
+    DbLispAction openKey(const DbLispToken& token) {
+      builder_.openKey(token);
+      return ACTION_CONTINUE;
+    }
+
+    DbLispAction openVariable(const DbLispToken& token) {
+      if (!builder_.openVariable(token.text())) {
+        return parser_.stopWith("Variable `(" + token.value() +
+                                ")` is Undefined");
+      }
+      return ACTION_CONTINUE;
+    }
+
+    DbLispAction pushValue(const DbLispToken& token) {
+      if (!valueExpected()) {
+        return ambiguous();
+      }
+      builder_.pushValue(token);
+      builder_.topType() = MAP_VALUE;
+      return ACTION_CONTINUE;
+    }
+
+    DbLispAction pushVariable(const DbLispToken& token) {
+      if (!valueExpected()) {
+        return ambiguous();
+      }
+      switch (builder_.pushVariable(token.text())) {
+        case VAR_UNDEFINED:
+          return parser_.stopWith("Variable `" + token.value() +
+                                  "` is Undefined");
+        case VAR_TREE:
+          return parser_.stopWith("Variable `" + token.value() +
+                                  "` can not converted into values");
+        default:;
+      }
+      return ACTION_CONTINUE;
+    }
+
+    // A variable outside any form, which the tree builder has always
+    // reported as an ambiguous definition of the root.
+    DbLispAction pushTopVariable(const DbLispToken&) { return ambiguous(); }
+
+    DbLispAction close() {
+      if (builder_.parentType() != MAP_MAP &&
+          builder_.parentType() != MAP_INIT) {
+        builder_.discardTop();
+        return ambiguous();
+      }
+      std::string duplicateKey;
+      if (!builder_.close(duplicateKey)) {
+        return parser_.stopWith("duplicate key `" + duplicateKey + "`");
+      }
+      builder_.topType() = MAP_MAP;
+      return ACTION_CONTINUE;
+    }
+
+   private:
+    bool valueExpected() {
+      return builder_.topType() == MAP_VALUE || builder_.topType() == MAP_INIT;
+    }
+
+    DbLispAction ambiguous() {
+      return parser_.stopWith("The definition of `" + builder_.topKey() +
+                              "` is ambiguous");
+    }
+
+    DbLispParser& parser_;
+    TreeBuilder& builder_;
+  };
+
+  // Hands the words pushWord checked to a DbLispHandler, unescaped.
+  template <typename Handler>
+  class EventAdapter {
+   public:
+    EventAdapter(DbLispParser& parser, Handler& handler)
+        : parser_(parser), handler_(handler) {}
+
+    DbLispAction openKey(const DbLispToken& token) {
+      return handler_.onOpen(text(token));
+    }
+
+    DbLispAction openVariable(const DbLispToken& token) {
+      return handler_.onOpenVariable(token.text());
+    }
+
+    DbLispAction pushValue(const DbLispToken& token) {
+      return handler_.onValue(text(token));
+    }
+
+    DbLispAction pushVariable(const DbLispToken& token) {
+      return handler_.onVariable(token.text());
+    }
+
+    DbLispAction pushTopVariable(const DbLispToken& token) {
+      return parser_.stopWith("`" + token.value() + "` is invalid syntax");
+    }
+
+    DbLispAction close() { return handler_.onClose(); }
+
+   private:
+    std::string_view text(const DbLispToken& token) {
+      if (!token.escaped()) {
+        return token.text();
+      }
+      token.valueTo(word_);
+      return word_;
+    }
+
+    DbLispParser& parser_;
+    Handler& handler_;
+    std::string word_;
+  };
+
+  // Syntax errors name their line and column. A form the handler skips is
+  // passed by DbLispLexer::skipForm.
+  template <typename Handler>
+  bool bufToEvents(std::string_view lispBuf, Handler& handler) {
+    EventAdapter<Handler> adapter(*this, handler);
+    DbLispLexer lexer(lispBuf);
+    DbLispToken token;
+    std::string syntaxError;
+    keyExpected_ = false;
+    depth_ = 0;
+    pendingError_ = &syntaxError;
+    for (; lexer.next(token);) {
+      DbLispAction action = pushWord(token, adapter);
+      if (action == ACTION_CONTINUE) {
+        continue;
+      }
+      if (action == ACTION_SKIP && depth_ != 0) {
+        if (!lexer.skipForm()) {
+          pendingError_ = nullptr;
+          return quotCloseCheck(lexer) && notCloseLog(lexer, true);
+        }
+        depth_ -= 1;
+        continue;
+      }
+      if (syntaxError.empty()) {
+        pendingError_ = nullptr;
+        return true;
+      }
+      break;
+    }
+    return endTokens(lexer, token, syntaxError, true);
+  }
+
+  bool bufToRecMap(std::string_view lispBuf, recursive_map& rmap) {
+    recursive_map rmapTemp(rmap.key(), rmap.resource(), rmap.keyPool());
+    rmapTemp.setChildPolicy(rmap.childPolicy());
+    if (parseMode_ == PARSE_PARALLEL && projection_.empty() &&
+        parseParallel(lispBuf, rmapTemp)) {
+      rmap.swap(rmapTemp);
+      return true;
+    }
+    {
+      RecMapBuilder builder(rmapTemp, packNumbers_, &scratch_);
+      bool parsed = !projection_.empty() ? parseProjected(lispBuf, builder)
+                    : parseMode_ == PARSE_TOKEN_VECTOR
+                        ? parseWordVector(lispBuf, builder)
+                        : parseFused(lispBuf, builder);
+      skipped_.clear();
+      skippedIndex_.clear();
+      if (!parsed) {
+        return false;
+      }
+      builder.finish();
+    }
+    rmap.swap(rmapTemp);
+    return true;
+  }
+
+  // Parses every top level definition on its own, on threadCount()
+  // threads, into trees that `rmap` then adopts at once. A variable waits
+  // for the earlier definition it names. Workers take definitions in file
+  // order, so the one they wait for is always taken already.
+  //
+  // Nothing is logged: returns false and leaves `rmap` alone when the
+  // buffer holds anything but definitions with distinct string keys,
+  // when a definition does not parse, or when `rmap` allocates from a
+  // key pool or from a resource other than new/delete, neither of which
+  // is thread safe. The fused parse then gives the result, and the error,
+  // of a serial parse.
+  bool parseParallel(std::string_view lispBuf, recursive_map& rmap) {
+    const size_t threadCount = this->threadCount();
+    if (threadCount < 2 || rmap.keyPool() != nullptr ||
+        !rmap.resource()->is_equal(*std::pmr::new_delete_resource())) {
+      return false;
+    }
+    std::vector<Definition> definitions;
+    if (!scanDefinitions(lispBuf, definitions) || definitions.size() < 2) {
+      return false;
+    }
+    std::unordered_map<std::string_view, size_t> indexes;
+    for (size_t index = 0; index != definitions.size(); ++index) {
+      if (!indexes.emplace(definitions[index].key, index).second) {
+        return false;
+      }
+    }
+    const size_t count = definitions.size();
+    std::vector<link_type> trees(count, nullptr);
+    std::vector<std::atomic<uint8_t>> states(count);
+    std::atomic<size_t> next{0}, waiters{0};
+    std::atomic<bool> failed{false};
+    std::mutex mutex;
+    std::condition_variable parsed;
+    // Small batches keep the threads busy until the end, large ones keep
+    // them off `next`.
+    const size_t batch =
+        std::clamp<size_t>(count / (threadCount * 16), 1, 256);
+    auto finish = [&](size_t index, link_type tree) {
+      trees[index] = tree;
+      states[index].store(tree != nullptr ? kParsed : kFailed);
+      if (tree == nullptr) {
+        failed.store(true);
+      }
+      if (waiters.load() != 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        parsed.notify_all();
+      }
+    };
+    auto work = [&]() {
+      DbLispParser parser;
+      parser.lispFile_ = lispFile_;
+      parser.packNumbers_ = packNumbers_;
+      parser.silent_ = true;
+      recursive_map root(std::string(), rmap.resource());
+      root.setChildPolicy(rmap.childPolicy());
+      size_t current = 0;
+      auto variables = [&](std::string_view name) -> link_type {
+        auto iter = indexes.find(name);
+        if (iter == indexes.end() || iter->second >= current) {
+          return nullptr;
+        }
+        auto& state = states[iter->second];
+        if (state.load() == kPending) {
+          std::unique_lock<std::mutex> lock(mutex);
+          waiters.fetch_add(1);
+          parsed.wait(lock, [&state] { return state.load() != kPending; });
+          waiters.fetch_sub(1);
+        }
+        return state.load() == kParsed ? trees[iter->second] : nullptr;
+      };
+      std::optional<RecMapBuilder> builder;
+      for (;;) {
+        size_t first = next.fetch_add(batch);
+        if (first >= count) {
+          break;
+        }
+        for (current = first; current != std::min(first + batch, count);
+             ++current) {
+          link_type tree = nullptr;
+          if (!failed.load()) {
+            try {
+              if (!builder) {
+                builder.emplace(root, packNumbers_);
+                builder->setOuterVariables(variables);
+              }
+              const Definition& definition = definitions[current];
+              DbLispLexer lexer(lispBuf, definition.first, definition.last);
+              if (parser.parseTokens(lexer, *builder, false)) {
+                tree = builder->releaseDefinition();
+              }
+            } catch (...) {
+            }
+            if (tree == nullptr) {
+              builder.reset();
+            }
+          }
+          finish(current, tree);
+        }
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t index = 1; index < std::min(threadCount, count); ++index) {
+      threads.emplace_back(work);
+    }
+    work();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    if (failed.load()) {
+      for (link_type tree : trees) {
+        if (tree != nullptr) {
+          rmap.freeTree(tree);
+        }
+      }
+      return false;
+    }
+    rmap.adoptChildren(trees.begin(), trees.end());
+    return true;
+  }
 
-class DbLispParser;
+  // The range and key of every top level definition, found by
+  // DbLispLexer::skipForm. False when the buffer holds anything else at
+  // the top level or a definition is not closed.
+  bool scanDefinitions(std::string_view lispBuf,
+                       std::vector<Definition>& definitions) {
+    DbLispLexer lexer(lispBuf);
+    DbLispToken token;
+    std::string key;
+    for (; lexer.next(token);) {
+      size_t first = token.offset();
+      if (token.wordType() != LEFT_PARENTHESIS || !lexer.next(token) ||
+          token.wordType() != STRING_VALUE) {
+        return false;
+      }
+      token.valueTo(key);
+      if (!lexer.skipForm()) {
+        return false;
+      }
+      definitions.push_back(Definition{key, first, lexer.offset(), nullptr});
+    }
+    return !lexer.quotNotClose();
+  }
 
-class DbLispWord {
-  friend class DbLispParser;
-  friend std::ostream& operator<<(std::ostream& outStream,
-                                  const DbLispWord& word);
+  // Beyond this many changed definitions, and one in 64, reparse moves
+  // every child out of the root and adopts them again with one sort
+  // instead of replacing them one by one.
+  static constexpr size_t kReparseInPlace = 64;
 
- public:
-  DbLispWord(std::string&& value, WordType wordType)
-      : value_(std::move(value)), wordType_(wordType) {}
+  bool bufReparse(std::string_view lispBuf, recursive_map& rmap,
+                  DbLispFormIndex& index) {
+    std::vector<Definition> definitions;
+    if (!scanDefinitions(lispBuf, definitions) || definitions.empty() ||
+        rmap.keyPool() != nullptr) {
+      return reparseAll(lispBuf, rmap, index);
+    }
+    // Mostly the keys are those of the last parse in the same order, the
+    // index then already maps every key to its position.
+    const size_t count = definitions.size();
+    bool sameKeys = count == index.forms_.size();
+    for (size_t pos = 0; sameKeys && pos != count; ++pos) {
+      sameKeys = definitions[pos].key == index.forms_[pos].key;
+    }
+    std::unordered_map<std::string, size_t> byKey;
+    if (!sameKeys) {
+      byKey.reserve(count);
+      for (size_t pos = 0; pos != count; ++pos) {
+        if (!byKey.emplace(definitions[pos].key, pos).second) {
+          return reparseAll(lispBuf, rmap, index);
+        }
+      }
+    }
+    const auto& positions = sameKeys ? index.byKey_ : byKey;
+    auto position = [&positions, count](const std::string& key) {
+      auto pos = positions.find(key);
+      return pos == positions.end() ? count : pos->second;
+    };
+    // A definition is kept when its text is unchanged and every variable
+    // it uses names a kept definition above it.
+    std::vector<DbLispFormIndex::Form> forms(count);
+    std::vector<link_type> trees(count, nullptr);
+    std::vector<bool> kept(count, false);
+    size_t changed = 0;
+    for (size_t pos = 0; pos != count; ++pos) {
+      const Definition& definition = definitions[pos];
+      DbLispFormIndex::Form& form = forms[pos];
+      form.key = definition.key;
+      form.offset = definition.first;
+      form.size = definition.last - definition.first;
+      std::string_view text = lispBuf.substr(form.offset, form.size);
+      form.hash = std::hash<std::string_view>()(text);
+      const DbLispFormIndex::Form* old = nullptr;
+      if (sameKeys) {
+        old = &index.forms_[pos];
+      } else if (index.byKey_.count(form.key) != 0) {
+        old = &index.forms_[index.byKey_.at(form.key)];
+      }
+      // A kept tree is adopted again as it is, even when a copy of `rmap`
+      // shares it.
+      link_type tree = rmap.isTree() ? rmap.findChild(form.key) : nullptr;
+      if (old != nullptr && old->size == form.size &&
+          old->hash == form.hash && tree != nullptr &&
+          std::string_view(index.text_).substr(old->offset, old->size) ==
+              text) {
+        form.variables = old->variables;
+        kept[pos] = std::all_of(form.variables.begin(), form.variables.end(),
+                                [&](const std::string& name) {
+                                  size_t var = position(name);
+                                  return var < pos && kept[var];
+                                });
+      }
+      if (kept[pos]) {
+        trees[pos] = tree;
+      } else {
+        changed += 1;
+      }
+    }
+    if (!parseChanged(lispBuf, rmap, definitions, position, kept, forms,
+                      trees)) {
+      // The fused parse logs the error as lispToRecMap would.
+      return reparseAll(lispBuf, rmap, index);
+    }
+    if (index.empty() || !rmap.isTree() ||
+        changed > std::max(kReparseInPlace, count / 64)) {
+      std::vector<link_type> oldTrees;
+      if (rmap.isTree()) {
+        for (const auto& child : rmap.ownChildren()) {
+          oldTrees.push_back(child.second);
+        }
+        rmap.refChildren().clear();
+      }
+      std::sort(oldTrees.begin(), oldTrees.end());
+      std::vector<link_type> keptTrees;
+      for (size_t pos = 0; pos != count; ++pos) {
+        if (kept[pos]) {
+          keptTrees.push_back(trees[pos]);
+        }
+      }
+      std::sort(keptTrees.begin(), keptTrees.end());
+      for (link_type tree : oldTrees) {
+        if (!std::binary_search(keptTrees.begin(), keptTrees.end(), tree)) {
+          rmap.freeTree(tree);
+        }
+      }
+      if (!rmap.isTree()) {
+        rmap.clear();
+      }
+      rmap.adoptChildren(trees.begin(), trees.end());
+    } else {
+      if (!sameKeys) {
+        std::vector<std::string> removed;
+        for (const auto& child : std::as_const(rmap)) {
+          std::string key = child.key().toString();
+          if (position(key) == count) {
+            removed.push_back(std::move(key));
+          }
+        }
+        for (const auto& key : removed) {
+          rmap.erase(key);
+        }
+      }
+      for (size_t pos = 0; pos != count; ++pos) {
+        if (!kept[pos]) {
+          rmap.erase(forms[pos].key);
+          rmap.emplaceTree(trees[pos]);
+        }
+      }
+    }
+    index.forms_.swap(forms);
+    if (!sameKeys) {
+      index.byKey_.swap(byKey);
+    }
+    index.text_.assign(lispBuf.data(), lispBuf.size());
+    return true;
+  }
 
- private:
-  std::string value_;
-  WordType wordType_;
-};
+  // A plain fused parse, the result of which is not indexed.
+  bool reparseAll(std::string_view lispBuf, recursive_map& rmap,
+                  DbLispFormIndex& index) {
+    recursive_map rmapTemp(rmap.key(), rmap.resource(), rmap.keyPool());
+    rmapTemp.setChildPolicy(rmap.childPolicy());
+    {
+      RecMapBuilder builder(rmapTemp, packNumbers_, &scratch_);
+      if (!parseFused(lispBuf, builder)) {
+        return false;
+      }
+      builder.finish();
+    }
+    rmap.swap(rmapTemp);
+    index.clear();
+    return true;
+  }
 
-// std::ostream& operator<<(std::ostream& outStream, const DbLispWord& word) {
-//   outStream << word.value_;
-//   return outStream;
-// }
+  // Builds every definition that is not kept, in file order, into
+  // `trees`, and records the variables it uses in `forms`. On failure
+  // nothing is logged and the trees built so far are freed.
+  template <typename Position>
+  bool parseChanged(std::string_view lispBuf, recursive_map& rmap,
+                    const std::vector<Definition>& definitions,
+                    const Position& position, const std::vector<bool>& kept,
+                    std::vector<DbLispFormIndex::Form>& forms,
+                    std::vector<link_type>& trees) {
+    DbLispParser parser;
+    parser.lispFile_ = lispFile_;
+    parser.packNumbers_ = packNumbers_;
+    parser.silent_ = true;
+    recursive_map root(std::string(), rmap.resource());
+    root.setChildPolicy(rmap.childPolicy());
+    RecMapBuilder builder(root, packNumbers_);
+    size_t current = 0;
+    builder.setOuterVariables([&](std::string_view name) -> link_type {
+      size_t var = position(std::string(name));
+      if (var >= current) {
+        return nullptr;
+      }
+      forms[current].variables.emplace_back(name);
+      return trees[var];
+    });
+    for (; current != definitions.size(); ++current) {
+      if (kept[current]) {
+        continue;
+      }
+      const Definition& definition = definitions[current];
+      DbLispLexer lexer(lispBuf, definition.first, definition.last);
+      if (parser.parseTokens(lexer, builder, false)) {
+        trees[current] = builder.releaseDefinition();
+      }
+      if (trees[current] == nullptr) {
+        for (size_t pos = 0; pos != current; ++pos) {
+          if (!kept[pos]) {
+            rmap.freeTree(trees[pos]);
+          }
+        }
+        return false;
+      }
+    }
+    return true;
+  }
 
-class DbLispParser {
-  enum map_type { MAP_INIT, MAP_MAP, MAP_VALUE };
-  using link_type = recursive_map::link_type;
+  // Borrowed trees point into the buffer, so they are always built fused.
+  bool bufToBorrowedTree(std::string_view lispBuf,
+                         std::shared_ptr<const void> source,
+                         BorrowedTree& tree) {
+    BorrowedTree treeTemp(std::string(tree.key()));
+    treeTemp.source_ = std::move(source);
+    BorrowedTreeBuilder builder(treeTemp);
+    if (!parseFused(lispBuf, builder)) {
+      return false;
+    }
+    builder.finish();
+    tree.swap(treeTemp);
+    return true;
+  }
 
- public:
-  ~DbLispParser() { clearMapStk(); }
+  template <typename TreeBuilder>
+  bool parseFused(std::string_view lispBuf, TreeBuilder& builder) {
+    DbLispLexer lexer(lispBuf);
+    return parseTokens(lexer, builder, false);
+  }
 
-  bool lispToRecMap(const std::string& lispFile, recursive_map& rmap) {
-    lispFile_ = lispFile;
-    std::vector<std::string> lispFileVec;
-    if (!copyToFile(lispFile, lispFileVec)) {
-      return false;
+  // A tree error gets the line and column of the word that caused it,
+  // only logged with `tokenPosition`.
+  template <typename TreeBuilder>
+  bool parseTokens(DbLispLexer& lexer, TreeBuilder& builder,
+                   bool tokenPosition) {
+    DbLispToken token;
+    std::string treeError;
+    TreeHandler<TreeBuilder> handler(*this, builder);
+    keyExpected_ = false;
+    depth_ = 0;
+    pendingError_ = &treeError;
+    for (; lexer.next(token);) {
+      if (pushWord(token, handler) != ACTION_CONTINUE) {
+        break;
+      }
     }
-    recursive_map rmapTemp(rmap.key());
-    clearMapStk();
-    mapStk.push(std::make_pair(&rmapTemp, MAP_MAP));
-    if (!lispToRecMap(lispFileVec, rmapTemp)) {
-      clearMapStk();
-      return false;
+    return endTokens(lexer, token, treeError, tokenPosition);
+  }
+
+  // Like parseTokens, but a form whose key path projection_ does not want
+  // is passed by DbLispLexer::skipForm. Skipped top level definitions are
+  // kept in skipped_ for skippedVariable.
+  bool parseProjected(std::string_view lispBuf, RecMapBuilder& builder) {
+    DbLispLexer lexer(lispBuf);
+    DbLispToken token;
+    std::string treeError, key;
+    size_t formOffset = 0;
+    projection_.reset();
+    builder.setOuterVariables([this, lispBuf, &builder](std::string_view name) {
+      return skippedVariable(lispBuf, name, SIZE_MAX, builder);
+    });
+    TreeHandler<RecMapBuilder> handler(*this, builder);
+    keyExpected_ = false;
+    depth_ = 0;
+    pendingError_ = &treeError;
+    for (; lexer.next(token);) {
+      if (token.wordType() == LEFT_PARENTHESIS) {
+        formOffset = token.offset();
+      } else if (keyExpected_ && token.wordType() != RIGHT_PARENTHESIS) {
+        std::string_view keyText = token.text();
+        if (token.escaped()) {
+          token.valueTo(key);
+          keyText = key;
+        }
+        if (!projection_.open(builder.depth(), keyText)) {
+          keyExpected_ = false;
+          if (!lexer.skipForm()) {
+            pendingError_ = nullptr;
+            return quotCloseCheck(lexer) && notCloseLog(lexer, false);
+          }
+          if (builder.depth() == 1) {
+            skipped_.push_back(Definition{std::string(keyText), formOffset,
+                                          lexer.offset(), nullptr});
+          }
+          continue;
+        }
+      }
+      if (pushWord(token, handler) != ACTION_CONTINUE) {
+        break;
+      }
     }
-    rmap.swap(rmapTemp);
-    clearMapStk();
+    return endTokens(lexer, token, treeError, false);
+  }
+
+  // Parses `definition`, a range of `lispBuf` holding one top level
+  // definition, into a tree of its own. Errors name their line and column
+  // in `lispBuf`.
+  bool parseDefinition(std::string_view lispBuf, Definition& definition,
+                       std::function<link_type(std::string_view)> outer) {
+    auto root = std::make_unique<recursive_map>();
+    {
+      RecMapBuilder builder(*root, packNumbers_);
+      builder.setOuterVariables(std::move(outer));
+      DbLispLexer lexer(lispBuf, definition.first, definition.last);
+      if (!parseTokens(lexer, builder, true)) {
+        definition.failed = true;
+        return false;
+      }
+      builder.finish();
+    }
+    definition.root = std::move(root);
     return true;
   }
 
- private:
-  void clearMapStk() {
-    if (mapStk.empty()) {
-      return;
+  // The skipped top level definition `name` if it starts before `before`,
+  // parsed on first use. Its own variables name skipped definitions above
+  // it or definitions `builder` has built.
+  link_type skippedVariable(std::string_view lispBuf, std::string_view name,
+                            size_t before, RecMapBuilder& builder) {
+    for (size_t index = skippedIndex_.size(); index != skipped_.size();
+         ++index) {
+      skippedIndex_.emplace(skipped_[index].key, index);
     }
-    for (; mapStk.size() != 1;) {
-      mapStk.top().first->clear();
-      mapStk.top().first->freeTree(mapStk.top().first);
-      mapStk.pop();
+    auto iter = skippedIndex_.find(std::string(name));
+    if (iter == skippedIndex_.end() || skipped_[iter->second].first >= before) {
+      return nullptr;
     }
-    mapStk.pop();
+    Definition& definition = skipped_[iter->second];
+    if (definition.root == nullptr && !definition.failed) {
+      DbLispParser parser;
+      parser.lispFile_ = lispFile_;
+      parser.packNumbers_ = packNumbers_;
+      size_t first = definition.first;
+      parser.parseDefinition(
+          lispBuf, definition,
+          [this, lispBuf, first, &builder](std::string_view name) {
+            link_type var = skippedVariable(lispBuf, name, first, builder);
+            return var != nullptr ? var : builder.findDefinition(name);
+          });
+    }
+    return definition.root == nullptr
+               ? nullptr
+               : &definition.root->at(definition.key);
+  }
+
+  // Ends a parse that stopped after `token`, `treeError` holds the tree
+  // error that stopped it, if any. Errors are logged with their line and
+  // column only with `tokenPosition`.
+  bool endTokens(DbLispLexer& lexer, DbLispToken& token,
+                 const std::string& treeError, bool tokenPosition) {
+    pendingError_ = nullptr;
+    if (!treeError.empty()) {
+      size_t errorOffset = token.offset();
+      // The word vector path lexes the whole buffer before building, so
+      // an unclosed string further on is reported instead.
+      for (; lexer.next(token);) {
+      }
+      if (!quotCloseCheck(lexer)) {
+        return false;
+      }
+      auto lineColumn = lexer.lineColumn(errorOffset);
+      return errorIndexLog(lineColumn.first, lineColumn.second, treeError,
+                           tokenPosition);
+    }
+    if (!quotCloseCheck(lexer)) {
+      return false;
+    }
+    return depth_ == 0 && !keyExpected_ ? true
+                                        : notCloseLog(lexer, tokenPosition);
   }
 
-  bool lispToRecMap(std::vector<std::string>& lispFileVec,
-                    recursive_map& rmap) {
+  // `(` not close, at the top level form that is still open.
+  bool notCloseLog(const DbLispLexer& lexer, bool logPosition) {
+    auto lineColumn = lexer.lineColumn(formOffset_);
+    return errorIndexLog(lineColumn.first, lineColumn.second, "`(` not close",
+                         logPosition);
+  }
+
+  template <typename TreeBuilder>
+  bool parseWordVector(std::string_view lispBuf, TreeBuilder& builder) {
     std::vector<DbLispWord> wordVec;
-    if (!lispWords(lispFileVec, wordVec)) {
+    if (!lispWords(lispBuf, wordVec)) {
       return false;
     }
 #ifdef _DBLISP_TEST_DEBUG_
@@ -81,290 +1568,419 @@ class DbLispParser {
     }
     std::cout << "\n----------------end----------------------" << std::endl;
 #endif
-    return wordToRecMap(wordVec, rmap);
+    return wordToRecMap(wordVec, builder);
+  }
+
+  template <typename TreeBuilder>
+  bool wordToRecMap(std::vector<DbLispWord>& wordVec, TreeBuilder& builder) {
+    TreeHandler<TreeBuilder> handler(*this, builder);
+    keyExpected_ = false;
+    depth_ = 0;
+    for (auto& word : wordVec) {
+      if (pushWord(DbLispToken(word.wordType_, word.value_), handler) !=
+          ACTION_CONTINUE) {
+        return false;
+      }
+    }
+    return finishWords();
+  }
+
+  bool finishWords() {
+    return depth_ == 0 && !keyExpected_ ? true : errorLog("`(` not close");
   }
 
-  bool wordToRecMap(std::vector<DbLispWord>& wordVec, recursive_map& rmap) {
-    recursive_map::iterator iter;
-    std::pair<link_type, map_type> top;
-    std::pair<recursive_map::iterator, bool> prIB;
-    map_type mapType;
-    for (size_t index = 0; index != wordVec.size();) {
-      switch (wordVec[index].wordType_) {
+  // Checks the syntax of one word and hands it to `handler`, a
+  // TreeHandler or an EventAdapter. A `(` only sets keyExpected_, the word
+  // after it opens the form. A syntax error stops the parse.
+  template <typename Handler>
+  DbLispAction pushWord(const DbLispToken& token, Handler& handler) {
+    if (keyExpected_) {
+      keyExpected_ = false;
+      switch (token.wordType()) {
         case LEFT_PARENTHESIS:
-          index += 1;
-          if (index == wordVec.size()) {
-            return errorLog("`(` not close");
-          }
-          switch (wordVec[index].wordType_) {
-            case LEFT_PARENTHESIS:
-              return errorLog("`(` must have a key");
-              break;
-            case RIGHT_PARENTHESIS:
-              return errorLog("`()` is invalid syntax");
-              break;
-            case STRING_VALUE:
-              mapStk.push(std::make_pair(
-                  rmap.createTree(std::move(wordVec[index].value_)), MAP_INIT));
-              index += 1;
-              break;
-            case VARIABLE:
-              if (rmap.empty() ||
-                  (iter = rmap.find(wordVec[index].value_)) == rmap.end()) {
-                return errorLog("Variable `(" + wordVec[index].value_ +
-                                ")` is Undefined");
-              }
-              switch (iter->valueStatus_) {
-                case recursive_map::VALUE_TYPE::VALUE:
-                case recursive_map::VALUE_TYPE::VALUE_VECTOR:
-                  mapType = map_type::MAP_VALUE;
-                  break;
-                case recursive_map::VALUE_TYPE::RECTREE:
-                  mapType = map_type::MAP_MAP;
-                  break;
-                case recursive_map::VALUE_TYPE::INITAL:
-                  mapType = map_type::MAP_INIT;
-                  break;
-                default:;
-              }
-              mapStk.push(std::make_pair(rmap.createTree(*iter), mapType));
-              index += 1;
-              break;
-            default:;
-          }
-          break;
+          return stopWith("`(` must have a key");
         case RIGHT_PARENTHESIS:
-          if (mapStk.size() == 1) {
-            return errorLog("`) not close");
-          }
-          top = mapStk.top();
-          mapStk.pop();
-          if (mapStk.top().second != MAP_MAP &&
-              mapStk.top().second != MAP_INIT) {
-            top.first->freeTree(top.first);
-            return errorLog("The definition of `" +
-                            mapStk.top().first->refRealKey() +
-                            "` is ambiguous");
-          }
-          prIB = mapStk.top().first->emplace(std::move(*top.first));
-          top.first->freeTree(top.first);
-          if (!prIB.second) {
-            return errorLog("duplicate key `" + prIB.first->refRealKey() + "`");
-          }
-          mapStk.top().second = MAP_MAP;
-          index += 1;
-          break;
+          return stopWith("`()` is invalid syntax");
         case STRING_VALUE:
-          if (mapStk.size() == 1) {
-            return errorLog("`\"" + wordVec[index].value_ +
-                            "\" is invalid syntax");
-          }
-          if (mapStk.top().second != MAP_VALUE &&
-              mapStk.top().second != MAP_INIT) {
-            return errorLog("The definition of `" +
-                            mapStk.top().first->refRealKey() +
-                            "` is ambiguous");
-          }
-          mapStk.top().first->pushValue(wordVec[index].value_);
-          mapStk.top().second = MAP_VALUE;
-          index += 1;
-          break;
+          depth_ += 1;
+          return handler.openKey(token);
         case VARIABLE:
-          if (mapStk.top().second != MAP_VALUE &&
-              mapStk.top().second != MAP_INIT) {
-            return errorLog("The definition of `" +
-                            mapStk.top().first->refRealKey() +
-                            "` is ambiguous");
-          }
-          if (rmap.empty() ||
-              (iter = rmap.find(wordVec[index].value_)) == rmap.end()) {
-            return errorLog("Variable `" + wordVec[index].value_ +
-                            "` is Undefined");
-          }
-          if (iter->isValue()) {
-            if (iter->isSingleValue()) {
-              mapStk.top().first->pushValue(iter->refRealVal());
-            } else {
-              for (const auto& val : iter->refValVector()) {
-                mapStk.top().first->pushValue(val);
-              }
-            }
-          } else if (iter->isTree()) {
-            return errorLog("Variable `" + wordVec[index].value_ +
-                            "` can not converted into values");
-          } else {
-          }
-          index += 1;
-          break;
+          depth_ += 1;
+          return handler.openVariable(token);
         default:;
       }
+      return ACTION_CONTINUE;
     }
-    return mapStk.size() == 1 ? true : errorLog("`(` not close");
-  }
-
-  bool lispWords(const std::vector<std::string>& lispFileVec,
-                 std::vector<DbLispWord>& wordVec) {
-    size_t lineIndex = 0, index = 0;
-    size_t openLineIndex = 0, openIndex = 0, closeIndex = 0;
-    bool quotClose = true;
-    std::string strValue;
-    std::vector<DbLispWord> wordVecTemp;
-    for (;;) {
-      if (lineIndex >= lispFileVec.size()) {
-        if (!quotClose) {
-          return errorIndexLog(openLineIndex, openIndex, "`\" not close");
+    switch (token.wordType()) {
+      case LEFT_PARENTHESIS:
+        if (depth_ == 0) {
+          formOffset_ = token.offset();
         }
-        wordVec.swap(wordVecTemp);
-        return true;
-      }
-      if (index >= lispFileVec[lineIndex].size()) {
-        index = 0;
-        lineIndex += 1;
-        if (!quotClose) {
-          strValue.push_back('\n');
+        keyExpected_ = true;
+        break;
+      case RIGHT_PARENTHESIS:
+        if (depth_ == 0) {
+          return stopWith("`) not close");
         }
-      } else {
-        if (!quotClose) {
-          if (lispFileVec[lineIndex][index] == '"') {
-            quotClose = true;
-            wordVecTemp.emplace_back(std::move(strValue), STRING_VALUE);
-            strValue.clear();
-            index += 1;
-          } else {
-            strValue.push_back(lispFileVec[lineIndex][index]);
-            closeIndex = index + 1;
-            for (; closeIndex != lispFileVec[lineIndex].size(); ++closeIndex) {
-              strValue.push_back(lispFileVec[lineIndex][closeIndex]);
-              if (lispFileVec[lineIndex][closeIndex] == '"') {
-                if (lispFileVec[lineIndex][closeIndex - 1] == '\\') {
-                  strValue.pop_back();
-                  strValue.back() = '"';
-                } else {
-                  quotClose = true;
-                  strValue.pop_back();
-                  wordVecTemp.emplace_back(std::move(strValue), STRING_VALUE);
-                  strValue.clear();
-                  break;
-                }
-              }
-            }
-            index = closeIndex + 1;
-          }
-        } else {
-          const char c = lispFileVec[lineIndex][index];
-          switch (c) {
-            case '(':
-              wordVecTemp.emplace_back("(", LEFT_PARENTHESIS);
-              index += 1;
-              break;
-            case ')':
-              wordVecTemp.emplace_back(")", RIGHT_PARENTHESIS);
-              index += 1;
-              break;
-            case ';':
-              lineIndex += 1;
-              index = 0;
-              break;
-            case '"':
-              quotClose = false;
-              openLineIndex = lineIndex;
-              openIndex = index;
-              closeIndex = index + 1;
-              for (; closeIndex != lispFileVec[lineIndex].size();
-                   ++closeIndex) {
-                strValue.push_back(lispFileVec[lineIndex][closeIndex]);
-                if (lispFileVec[lineIndex][closeIndex] == '"') {
-                  if (lispFileVec[lineIndex][closeIndex - 1] == '\\') {
-                    strValue.pop_back();
-                    strValue.back() = '"';
-                  } else {
-                    quotClose = true;
-                    strValue.pop_back();
-                    wordVecTemp.emplace_back(std::move(strValue), STRING_VALUE);
-                    strValue.clear();
-                    break;
-                  }
-                }
-              }
-              index = closeIndex + 1;
-              break;
-            default:
-              if (!isspace(c)) {
-                for (size_t startIndex = index;; ++index) {
-                  if (index == lispFileVec[lineIndex].size()) {
-                    wordVecTemp.emplace_back(
-                        lispFileVec[lineIndex].substr(startIndex), VARIABLE);
-                    break;
-                  }
-                  if (lispFileVec[lineIndex][index] == ')') {
-                    wordVecTemp.emplace_back(
-                        lispFileVec[lineIndex].substr(startIndex,
-                                                      index - startIndex),
-                        VARIABLE);
-                    wordVecTemp.emplace_back(")", RIGHT_PARENTHESIS);
-                    break;
-                  } else if (isspace(lispFileVec[lineIndex][index])) {
-                    wordVecTemp.emplace_back(
-                        lispFileVec[lineIndex].substr(startIndex,
-                                                      index - startIndex),
-                        VARIABLE);
-                    break;
-                  }
-                }
-              }
-              index += 1;
-              break;
-          }
+        depth_ -= 1;
+        return handler.close();
+      case STRING_VALUE:
+        if (depth_ == 0) {
+          return stopWith("`\"" + token.value() + "\" is invalid syntax");
+        }
+        return handler.pushValue(token);
+      case VARIABLE:
+        if (depth_ == 0) {
+          return handler.pushTopVariable(token);
         }
+        return handler.pushVariable(token);
+      default:;
+    }
+    return ACTION_CONTINUE;
+  }
+
+  DbLispAction stopWith(const std::string& logInfo) {
+    errorLog(logInfo);
+    return ACTION_STOP;
+  }
+
+  bool lispWords(std::string_view lispBuf, std::vector<DbLispWord>& wordVec) {
+    std::vector<DbLispWord> wordVecTemp;
+    DbLispLexer lexer(lispBuf);
+    DbLispToken token;
+    for (; lexer.next(token);) {
+      switch (token.wordType()) {
+        case LEFT_PARENTHESIS:
+          wordVecTemp.emplace_back("(", LEFT_PARENTHESIS);
+          break;
+        case RIGHT_PARENTHESIS:
+          wordVecTemp.emplace_back(")", RIGHT_PARENTHESIS);
+          break;
+        default:
+          wordVecTemp.emplace_back(token.value(), token.wordType());
       }
     }
+    if (!quotCloseCheck(lexer)) {
+      return false;
+    }
+    wordVec.swap(wordVecTemp);
     return true;
   }
 
- private:
-  bool copyToFile(const std::string& inputFile,
-                  std::vector<std::string>& lispFileVec) {
-    std::ifstream inf(inputFile);
-    if (!inf.is_open()) return openErrorLog(inputFile);
-    std::string buf;
-    buf.reserve(100);
-    std::vector<std::string> lispFileVecImple;
-    for (; getline(inf, buf);) {
-      lispFileVecImple.emplace_back(std::move(buf));
-    }
-    inf.close();
-    lispFileVec.swap(lispFileVecImple);
-    return true;
+  // Defined in lazy-tree.h.
+  inline bool bufToLazyTree(std::string_view lispBuf,
+                            std::shared_ptr<const void> source,
+                            LazyTree& tree);
+
+  bool quotCloseCheck(const DbLispLexer& lexer) {
+    if (!lexer.quotNotClose()) {
+      return true;
+    }
+    auto lineColumn = lexer.lineColumn(lexer.errorOffset());
+    return errorIndexLog(lineColumn.first, lineColumn.second, "`\" not close");
   }
 
  private:
-  std::ostream& errorLog(std::ostream& ostream) const {
-    ostream << "dblisp: parser: error: " << lispFile_ << ":";
-    return ostream;
+  // Starts a public parse of `fileName`, which names it in errors.
+  void beginParse(const std::string& fileName) {
+    lispFile_ = fileName;
+    error_.clear();
   }
 
-  bool errorLog(const std::string& logInfo) const {
-    errorLog(std::cerr) << logInfo << std::endl;
-    return false;
+  bool errorLog(const std::string& logInfo) {
+    if (pendingError_ != nullptr) {
+      *pendingError_ = logInfo;
+      return false;
+    }
+    return setError(0, 0, logInfo);
   }
 
   bool errorIndexLog(const size_t lineIndex, const size_t index,
-                     const std::string& logInfo) {
-    errorLog(std::cerr) << lineIndex + 1 << ":" << index + 1 << ':' << logInfo
-                        << std::endl;
-    return false;
+                     const std::string& logInfo, bool logPosition = true) {
+    return setError(lineIndex + 1, index + 1, logInfo, logPosition);
   }
 
-  bool openErrorLog(const std::string& fileName) const {
-    errorLog(std::cerr) << "open error: " << fileName << std::endl;
+  bool openErrorLog(const std::string& fileName) {
+    return setError(0, 0, "open error: " + fileName);
+  }
+
+  // Without `logPosition` the logged line leaves out the line and column,
+  // lastError() still has them.
+  bool setError(size_t line, size_t column, const std::string& message,
+                bool logPosition = true) {
+    error_.file = lispFile_;
+    error_.line = line;
+    error_.column = column;
+    error_.message = message;
+    if (logErrors_ && !silent_) {
+      const DbLispError logged{lispFile_, 0, 0, message};
+      std::cerr << (logPosition ? error_ : logged).toString() << std::endl;
+    }
     return false;
   }
 
  private:
   std::string lispFile_;
-  std::stack<std::pair<link_type, map_type>> mapStk;
+  ParseMode parseMode_ = PARSE_FUSED;
+  size_t threadCount_ = 0;
+  bool packNumbers_ = false;
+  // Set on the workers of parseParallel, whose errors are found again by
+  // a serial parse.
+  bool silent_ = false;
+  std::vector<std::string> keyPaths_;
+  DbLispProjection projection_;
+  std::vector<Definition> skipped_;
+  std::unordered_map<std::string, size_t> skippedIndex_;
+  bool keyExpected_ = false;
+  // Forms open in the current parse, and where the top level one starts.
+  size_t depth_ = 0;
+  size_t formOffset_ = 0;
+  std::string* pendingError_ = nullptr;
+  bool logErrors_ = true;
+  DbLispError error_;
+  RecMapBuilder::Scratch scratch_;
  };
 
+// Parsers for threads that parse many small buffers at once, e.g. config
+// fragments received over IPC. A DbLispParser must not be used by two
+// threads at a time, so every parse leases a parser no other thread holds
+// and gives it back after. A parser keeps its scratch stacks between
+// parses and an idle one stays in the pool, so a warm pool allocates
+// little beyond the trees it builds.
+//
+// Pooled parsers do not log, a failed parse hands back its error instead.
+class DbLispParserPool {
+ public:
+  // A parser taken from the pool, given back when the lease dies.
+  class Lease {
+    friend class DbLispParserPool;
+
+   public:
+    Lease(const Lease&) = delete;
+
+    Lease& operator=(const Lease&) = delete;
+
+    Lease(Lease&& x) noexcept { swap(x); }
+
+    Lease& operator=(Lease&& x) noexcept {
+      Lease temp(std::move(x));
+      swap(temp);
+      return *this;
+    }
+
+    ~Lease() {
+      if (parser_ != nullptr) {
+        pool_->release(std::move(parser_));
+      }
+    }
+
+    void swap(Lease& x) noexcept {
+      std::swap(pool_, x.pool_);
+      parser_.swap(x.parser_);
+    }
+
+    DbLispParser& operator*() const { return *parser_; }
+
+    DbLispParser* operator->() const { return parser_.get(); }
+
+   private:
+    Lease(DbLispParserPool* pool, std::unique_ptr<DbLispParser> parser)
+        : pool_(pool), parser_(std::move(parser)) {}
+
+    DbLispParserPool* pool_ = nullptr;
+    std::unique_ptr<DbLispParser> parser_;
+  };
+
+  // `configure`, if any, sets up every parser the pool makes, e.g. its
+  // parse mode or key paths.
+  explicit DbLispParserPool(
+      std::function<void(DbLispParser&)> configure = nullptr)
+      : configure_(std::move(configure)) {}
+
+  DbLispParserPool(const DbLispParserPool&) = delete;
+
+  DbLispParserPool& operator=(const DbLispParserPool&) = delete;
+
+  // An idle parser, or a new one when every parser is leased. Every lease
+  // must die before the pool.
+  Lease acquire() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!idle_.empty()) {
+        std::unique_ptr<DbLispParser> parser = std::move(idle_.back());
+        idle_.pop_back();
+        return Lease(this, std::move(parser));
+      }
+    }
+    auto parser = std::make_unique<DbLispParser>();
+    if (configure_) {
+      configure_(*parser);
+    }
+    parser->setLogErrors(false);
+    return Lease(this, std::move(parser));
+  }
+
+  // Like DbLispParser::lispToRecMap on a leased parser. `error`, if any,
+  // receives the error, which is empty when the parse succeeds.
+  bool lispToRecMap(const std::string& lispFile, recursive_map& rmap,
+                    DbLispError* error = nullptr) {
+    return parse(error, [&lispFile, &rmap](DbLispParser& parser) {
+      return parser.lispToRecMap(lispFile, rmap);
+    });
+  }
+
+  bool lispBufToRecMap(std::string_view lispBuf, recursive_map& rmap,
+                       DbLispError* error = nullptr,
+                       const std::string& bufName = "<buffer>") {
+    return parse(error, [lispBuf, &rmap, &bufName](DbLispParser& parser) {
+      return parser.lispBufToRecMap(lispBuf, rmap, bufName);
+    });
+  }
+
+  // Parsers not leased right now.
+  size_t idleSize() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return idle_.size();
+  }
+
+ private:
+  template <typename Parse>
+  bool parse(DbLispError* error, Parse parse) {
+    Lease parser = acquire();
+    bool ret = parse(*parser);
+    if (error != nullptr) {
+      *error = parser->lastError();
+    }
+    return ret;
+  }
+
+  void release(std::unique_ptr<DbLispParser> parser) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_.push_back(std::move(parser));
+  }
+
+ private:
+  std::function<void(DbLispParser&)> configure_;
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<DbLispParser>> idle_;
+};
+
+// Parses a document that arrives in chunks into a recursive_map, e.g. a
+// config update read from a pipe or a socket, without holding it whole.
+// Each chunk is parsed as it is fed, with the checks and the tree builder
+// of DbLispParser::lispToRecMap; a DbLispChunkLexer keeps the word a
+// chunk ends in. The tree replaces `rmap` once finish succeeds, on error
+// `rmap` is left alone.
+//
+// Errors name the line and column of the word that caused them, an
+// unclosed `(` that of the top level form it opens. A chunk is checked as
+// it arrives, so when a document has several errors the first one in the
+// stream is reported, where lispToRecMap, which sees the whole document,
+// reports an unclosed string ahead of any other error. After an error, or
+// after finish, feed and finish return false.
+class DbLispPushParser {
+ public:
+  // `streamName` only names the stream in error messages.
+  explicit DbLispPushParser(recursive_map& rmap,
+                            const std::string& streamName = "<stream>")
+      : rmap_(rmap),
+        rmapTemp_(rmap.key().toString(), rmap.resource(), rmap.keyPool()) {
+    rmapTemp_.setChildPolicy(rmap.childPolicy());
+    parser_.beginParse(streamName);
+  }
+
+  DbLispPushParser(const DbLispPushParser&) = delete;
+
+  DbLispPushParser& operator=(const DbLispPushParser&) = delete;
+
+  // See DbLispParser::setPackNumbers, only before the first feed.
+  void setPackNumbers(bool packNumbers) { parser_.packNumbers_ = packNumbers; }
+
+  void setLogErrors(bool logErrors) { parser_.setLogErrors(logErrors); }
+
+  const DbLispError& lastError() const { return parser_.lastError(); }
+
+  // Parses what `data` completes. The chunk may be freed on return.
+  bool feed(const char* data, size_t size) {
+    if (done_) {
+      return false;
+    }
+    lexer_.feed(data, size);
+    return pushTokens();
+  }
+
+  bool feed(std::string_view chunk) { return feed(chunk.data(), chunk.size()); }
+
+  // Ends the document and hands the tree to `rmap`.
+  bool finish() {
+    if (done_) {
+      return false;
+    }
+    lexer_.finish();
+    if (!pushTokens()) {
+      return false;
+    }
+    done_ = true;
+    if (lexer_.quotNotClose()) {
+      auto lineColumn = lexer_.lineColumn(lexer_.errorOffset());
+      builder_.reset();
+      return parser_.errorIndexLog(lineColumn.first, lineColumn.second,
+                                   "`\" not close");
+    }
+    if (parser_.depth_ != 0 || parser_.keyExpected_) {
+      builder_.reset();
+      return parser_.errorIndexLog(formLineColumn_.first,
+                                   formLineColumn_.second, "`(` not close");
+    }
+    builder_->finish();
+    builder_.reset();
+    rmap_.swap(rmapTemp_);
+    return true;
+  }
+
+ private:
+  using RecMapBuilder = DbLispParser::RecMapBuilder;
+
+  bool pushTokens() {
+    if (!builder_) {
+      builder_.emplace(rmapTemp_, parser_.packNumbers_, &parser_.scratch_);
+    }
+    DbLispParser::TreeHandler<RecMapBuilder> handler(parser_, *builder_);
+    DbLispToken token;
+    std::string treeError;
+    parser_.pendingError_ = &treeError;
+    for (; lexer_.next(token);) {
+      // The chunk of a form may be gone by the time finish finds it open.
+      if (token.wordType() == LEFT_PARENTHESIS && parser_.depth_ == 0 &&
+          !parser_.keyExpected_) {
+        formLineColumn_ = lexer_.lineColumn(token.offset());
+      }
+      if (parser_.pushWord(token, handler) != ACTION_CONTINUE) {
+        break;
+      }
+    }
+    parser_.pendingError_ = nullptr;
+    if (treeError.empty()) {
+      return true;
+    }
+    done_ = true;
+    builder_.reset();
+    auto lineColumn = lexer_.lineColumn(token.offset());
+    return parser_.errorIndexLog(lineColumn.first, lineColumn.second,
+                                 treeError);
+  }
+
+ private:
+  recursive_map& rmap_;
+  recursive_map rmapTemp_;
+  DbLispParser parser_;
+  DbLispChunkLexer lexer_;
+  std::optional<RecMapBuilder> builder_;
+  // Where the last top level form starts.
+  std::pair<size_t, size_t> formLineColumn_{0, 0};
+  bool done_ = false;
+};
+
 }  // namespace dblisp
 
 #endif
\ No newline at end of file
@@ -0,0 +1,365 @@
+#ifndef _DBLISP_DBLISP_SCAN_H_
+#define _DBLISP_DBLISP_SCAN_H_
+
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define _DBLISP_SCAN_X86_
+#endif
+
+namespace dblisp {
+
+// Bulk byte scanning used by DbLispLexer to skip whitespace, comment
+// bodies, string bodies and whole forms, and by RecTree::packNumbers to
+// parse integers.
+// On x86-64 the SSE2 or AVX2 kernel is chosen at runtime, every other
+// target uses the scalar kernel.
+class DbLispScanner {
+ public:
+  enum ScanKernel { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+
+  // First byte in [first, last) that is not whitespace, or `last`.
+  static const char* skipSpace(const char* first, const char* last) {
+    for (const char* end = shortRunEnd(first, last); first != end; ++first) {
+      if (!isSpace(*first)) return first;
+    }
+    return first == last ? last : kernels().skipSpace(first, last);
+  }
+
+  // First `c` in [first, last), or `last`.
+  static const char* findChar(const char* first, const char* last,
+                              const char c) {
+    for (const char* end = shortRunEnd(first, last); first != end; ++first) {
+      if (*first == c) return first;
+    }
+    return first == last ? last : kernels().findChar(first, last, c);
+  }
+
+  // First byte that ends a variable word (whitespace or `)`), or `last`.
+  static const char* findWordEnd(const char* first, const char* last) {
+    for (const char* end = shortRunEnd(first, last); first != end; ++first) {
+      if (*first == ')' || isSpace(*first)) return first;
+    }
+    return first == last ? last : kernels().findWordEnd(first, last);
+  }
+
+  // First `(`, `)`, `"` or `;` in [first, last), or `last`.
+  static const char* findSyntax(const char* first, const char* last) {
+    for (const char* end = shortRunEnd(first, last); first != end; ++first) {
+      if (isSyntax(*first)) return first;
+    }
+    return first == last ? last : kernels().findSyntax(first, last);
+  }
+
+  // Parses [first, last) as an int64 written the way std::to_chars writes
+  // it: an optional '-', then digits without leading zeros, and no "-0".
+  static bool parseInt64(const char* first, const char* last,
+                         int64_t& value) {
+    const bool negative = first != last && *first == '-';
+    const char* digits = first + negative;
+    const ptrdiff_t size = last - digits;
+    if (size == 0 || (*digits == '0' && (size > 1 || negative))) {
+      return false;
+    }
+    if (size > kDigitRun) {
+      auto result = std::from_chars(first, last, value);
+      return result.ec == std::errc() && result.ptr == last;
+    }
+    uint64_t magnitude;
+    if (!kernels().parseDigits(digits, size, magnitude)) {
+      return false;
+    }
+    value = negative ? -static_cast<int64_t>(magnitude)
+                     : static_cast<int64_t>(magnitude);
+    return true;
+  }
+
+  static bool isSpace(const char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+  }
+
+  static bool isSyntax(const char c) {
+    return c == '(' || c == ')' || c == '"' || c == ';';
+  }
+
+  static ScanKernel kernel() { return kernels().kernel; }
+
+  // Falls back to the best supported kernel when `kernel` is not
+  // supported by the running CPU, returns the kernel in use. Not thread
+  // safe, call it before any parsing starts.
+  static ScanKernel setKernel(ScanKernel kernel) {
+    kernels() = selectKernels(kernel);
+    return kernels().kernel;
+  }
+
+ private:
+  // Most runs in a config are a few bytes long, so the first kShortRun
+  // bytes are tested inline and only longer runs go to the kernels.
+  static constexpr ptrdiff_t kShortRun = 16;
+
+  // Up to kDigitRun digits go to the digit kernels, they cannot overflow.
+  static constexpr ptrdiff_t kDigitRun = 16;
+
+  static const char* shortRunEnd(const char* first, const char* last) {
+    return last - first > kShortRun ? first + kShortRun : last;
+  }
+
+  struct Kernels {
+    ScanKernel kernel;
+    const char* (*skipSpace)(const char*, const char*);
+    const char* (*findChar)(const char*, const char*, char);
+    const char* (*findWordEnd)(const char*, const char*);
+    const char* (*findSyntax)(const char*, const char*);
+    bool (*parseDigits)(const char*, ptrdiff_t, uint64_t&);
+  };
+
+  static Kernels& kernels() {
+    static Kernels activeKernels = selectKernels(SCAN_AVX2);
+    return activeKernels;
+  }
+
+  static Kernels selectKernels(ScanKernel kernel) {
+#ifdef _DBLISP_SCAN_X86_
+    if (kernel == SCAN_AVX2 && __builtin_cpu_supports("avx2")) {
+      return {SCAN_AVX2, skipSpaceAvx2, findCharAvx2, findWordEndAvx2,
+              findSyntaxAvx2, parseDigitsSse2};
+    }
+    if (kernel != SCAN_SCALAR) {
+      return {SCAN_SSE2, skipSpaceSse2, findCharSse2, findWordEndSse2,
+              findSyntaxSse2, parseDigitsSse2};
+    }
+#endif
+    return {SCAN_SCALAR, skipSpaceScalar, findCharScalar, findWordEndScalar,
+            findSyntaxScalar, parseDigitsScalar};
+  }
+
+  static const char* skipSpaceScalar(const char* first, const char* last) {
+    for (; first != last && isSpace(*first); ++first) {
+    }
+    return first;
+  }
+
+  static const char* findCharScalar(const char* first, const char* last,
+                                    const char c) {
+    const char* pos =
+        static_cast<const char*>(std::memchr(first, c, last - first));
+    return pos == nullptr ? last : pos;
+  }
+
+  static const char* findWordEndScalar(const char* first, const char* last) {
+    for (; first != last && *first != ')' && !isSpace(*first); ++first) {
+    }
+    return first;
+  }
+
+  static const char* findSyntaxScalar(const char* first, const char* last) {
+    for (; first != last && !isSyntax(*first); ++first) {
+    }
+    return first;
+  }
+
+  // `size` digits, 1 to kDigitRun of them.
+  static bool parseDigitsScalar(const char* digits, ptrdiff_t size,
+                                uint64_t& value) {
+    value = 0;
+    for (const char* last = digits + size; digits != last; ++digits) {
+      const unsigned digit = static_cast<unsigned char>(*digits - '0');
+      if (digit > 9) return false;
+      value = value * 10 + digit;
+    }
+    return true;
+  }
+
+#ifdef _DBLISP_SCAN_X86_
+  // A byte is whitespace when it is ' ' or in ['\t', '\r'], the latter is
+  // tested as max(b - '\t', 4) == 4 in unsigned arithmetic.
+  static __m128i spaceMaskSse2(__m128i bytes) {
+    const __m128i four = _mm_set1_epi8(4);
+    __m128i control = _mm_sub_epi8(bytes, _mm_set1_epi8('\t'));
+    return _mm_or_si128(
+        _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')),
+        _mm_cmpeq_epi8(_mm_max_epu8(control, four), four));
+  }
+
+  // The digits are right aligned in a '0' padded block of 16, checked with
+  // max(b - '0', 9) == 9, and folded into two halves of 8 digits by three
+  // multiply-adds of adjacent lanes: by 10, by 100 and by 10000.
+  static bool parseDigitsSse2(const char* digits, ptrdiff_t size,
+                              uint64_t& value) {
+    char block[16];
+    std::memset(block, '0', sizeof(block));
+    std::memcpy(block + sizeof(block) - size, digits, size);
+    const __m128i nine = _mm_set1_epi8(9);
+    __m128i bytes = _mm_sub_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(block)),
+        _mm_set1_epi8('0'));
+    if (_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_max_epu8(bytes, nine), nine)) != 0xFFFF) {
+      return false;
+    }
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i tens = _mm_set_epi16(1, 10, 1, 10, 1, 10, 1, 10);
+    __m128i pairs = _mm_packs_epi32(
+        _mm_madd_epi16(_mm_unpacklo_epi8(bytes, zero), tens),
+        _mm_madd_epi16(_mm_unpackhi_epi8(bytes, zero), tens));
+    const __m128i hundreds = _mm_set_epi16(1, 100, 1, 100, 1, 100, 1, 100);
+    __m128i quads = _mm_madd_epi16(pairs, hundreds);
+    quads = _mm_packs_epi32(quads, quads);
+    const __m128i tenThousands =
+        _mm_set_epi16(1, 10000, 1, 10000, 1, 10000, 1, 10000);
+    __m128i halves = _mm_madd_epi16(quads, tenThousands);
+    value = static_cast<uint64_t>(_mm_cvtsi128_si32(halves)) * 100000000 +
+            static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(halves, 4)));
+    return true;
+  }
+
+  static const char* skipSpaceSse2(const char* first, const char* last) {
+    for (; last - first >= 16; first += 16) {
+      __m128i bytes =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+      unsigned mask = _mm_movemask_epi8(spaceMaskSse2(bytes)) ^ 0xFFFF;
+      if (mask != 0) {
+        return first + __builtin_ctz(mask);
+      }
+    }
+    return skipSpaceScalar(first, last);
+  }
+
+  static const char* findCharSse2(const char* first, const char* last,
+                                  const char c) {
+    const __m128i target = _mm_set1_epi8(c);
+    for (; last - first >= 16; first += 16) {
+      __m128i bytes =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+      unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, target));
+      if (mask != 0) {
+        return first + __builtin_ctz(mask);
+      }
+    }
+    return findCharScalar(first, last, c);
+  }
+
+  static const char* findWordEndSse2(const char* first, const char* last) {
+    const __m128i close = _mm_set1_epi8(')');
+    for (; last - first >= 16; first += 16) {
+      __m128i bytes =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+      unsigned mask = _mm_movemask_epi8(_mm_or_si128(
+          spaceMaskSse2(bytes), _mm_cmpeq_epi8(bytes, close)));
+      if (mask != 0) {
+        return first + __builtin_ctz(mask);
+      }
+    }
+    return findWordEndScalar(first, last);
+  }
+
+  // `(` and `)` differ only in the low bit, so one compare of b | 1
+  // finds both.
+  static const char* findSyntaxSse2(const char* first, const char* last) {
+    const __m128i paren = _mm_set1_epi8(')');
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i semicolon = _mm_set1_epi8(';');
+    const __m128i one = _mm_set1_epi8(1);
+    for (; last - first >= 16; first += 16) {
+      __m128i bytes =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+      unsigned mask = _mm_movemask_epi8(_mm_or_si128(
+          _mm_cmpeq_epi8(_mm_or_si128(bytes, one), paren),
+          _mm_or_si128(_mm_cmpeq_epi8(bytes, quote),
+                       _mm_cmpeq_epi8(bytes, semicolon))));
+      if (mask != 0) {
+        return first + __builtin_ctz(mask);
+      }
+    }
+    return findSyntaxScalar(first, last);
+  }
+
+  __attribute__((target("avx2"))) static __m256i spaceMaskAvx2(
+      __m256i bytes) {
+    const __m256i four = _mm256_set1_epi8(4);
+    __m256i control = _mm256_sub_epi8(bytes, _mm256_set1_epi8('\t'));
+    return _mm256_or_si256(
+        _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')),
+        _mm256_cmpeq_epi8(_mm256_max_epu8(control, four), four));
+  }
+
+  __attribute__((target("avx2"))) static const char* skipSpaceAvx2(
+      const char* first, const char* last) {
+    for (; last - first >= 32; first += 32) {
+      __m256i bytes =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first));
+      unsigned mask = ~static_cast<unsigned>(
+          _mm256_movemask_epi8(spaceMaskAvx2(bytes)));
+      if (mask != 0) {
+        return first + __builtin_ctz(mask);
+      }
+    }
+    return skipSpaceSse2(first, last);
+  }
+
+  // Strings and comments can be long, e.g. embedded certificates, so
+  // findChar tests 64 bytes per iteration.
+  __attribute__((target("avx2"))) static const char* findCharAvx2(
+      const char* first, const char* last, const char c) {
+    const __m256i target = _mm256_set1_epi8(c);
+    for (; last - first >= 64; first += 64) {
+      __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first));
+      __m256i high =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first + 32));
+      unsigned long long mask =
+          static_cast<unsigned>(
+              _mm256_movemask_epi8(_mm256_cmpeq_epi8(low, target))) |
+          static_cast<unsigned long long>(static_cast<unsigned>(
+              _mm256_movemask_epi8(_mm256_cmpeq_epi8(high, target))))
+              << 32;
+      if (mask != 0) {
+        return first + __builtin_ctzll(mask);
+      }
+    }
+    return findCharSse2(first, last, c);
+  }
+
+  __attribute__((target("avx2"))) static const char* findWordEndAvx2(
+      const char* first, const char* last) {
+    const __m256i close = _mm256_set1_epi8(')');
+    for (; last - first >= 32; first += 32) {
+      __m256i bytes =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first));
+      unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(
+          spaceMaskAvx2(bytes), _mm256_cmpeq_epi8(bytes, close)));
+      if (mask != 0) {
+        return first + __builtin_ctz(mask);
+      }
+    }
+    return findWordEndSse2(first, last);
+  }
+
+  __attribute__((target("avx2"))) static const char* findSyntaxAvx2(
+      const char* first, const char* last) {
+    const __m256i paren = _mm256_set1_epi8(')');
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i semicolon = _mm256_set1_epi8(';');
+    const __m256i one = _mm256_set1_epi8(1);
+    for (; last - first >= 32; first += 32) {
+      __m256i bytes =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first));
+      unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(
+          _mm256_cmpeq_epi8(_mm256_or_si256(bytes, one), paren),
+          _mm256_or_si256(_mm256_cmpeq_epi8(bytes, quote),
+                          _mm256_cmpeq_epi8(bytes, semicolon))));
+      if (mask != 0) {
+        return first + __builtin_ctz(mask);
+      }
+    }
+    return findSyntaxSse2(first, last);
+  }
+#endif
+};
+
+}  // namespace dblisp
+
+#endif
@@ -0,0 +1,251 @@
+#ifndef _DBLISP_DBLISP_WRITER_H_
+#define _DBLISP_DBLISP_WRITER_H_
+
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#define _DBLISP_HAS_FD_
+#else
+#include <cstdio>
+#include <fstream>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#endif
+
+#include "dblisp-scan.h"
+
+namespace dblisp {
+
+// Buffered output for formatLisp. Bytes are collected in one chunk of
+// kChunkSize and handed to the sink whenever it fills up, so writing a
+// tree never holds more than a chunk of text. After the sink fails every
+// later write is dropped and good() stays false.
+class DbLispWriter {
+ public:
+  // FORMAT_INDENTED puts every child of a map with several children on
+  // its own line, aligned under the first one. FORMAT_COMPACT separates
+  // children with one space and writes no newlines at all.
+  enum FormatMode { FORMAT_INDENTED, FORMAT_COMPACT };
+
+  // Consumes `size` bytes, returns false on error.
+  using Sink = std::function<bool(const char*, size_t)>;
+
+  static constexpr size_t kChunkSize = 64 << 10;
+
+  explicit DbLispWriter(Sink sink, FormatMode mode = FORMAT_INDENTED)
+      : sink_(std::move(sink)), mode_(mode), chunk_(new char[kChunkSize]) {}
+
+  explicit DbLispWriter(std::ostream& outStream,
+                        FormatMode mode = FORMAT_INDENTED)
+      : DbLispWriter(
+            [&outStream](const char* data, size_t size) {
+              return static_cast<bool>(outStream.write(data, size));
+            },
+            mode) {}
+
+  // Appends to `str`.
+  explicit DbLispWriter(std::string& str, FormatMode mode = FORMAT_INDENTED)
+      : DbLispWriter(
+            [&str](const char* data, size_t size) {
+              str.append(data, size);
+              return true;
+            },
+            mode) {}
+
+#ifdef _DBLISP_HAS_FD_
+  // Writes to `fd`, which stays open.
+  explicit DbLispWriter(int fd, FormatMode mode = FORMAT_INDENTED)
+      : DbLispWriter([fd](const char* data,
+                          size_t size) { return writeFd(fd, data, size); },
+                     mode) {}
+#endif
+
+  DbLispWriter(const DbLispWriter&) = delete;
+
+  DbLispWriter& operator=(const DbLispWriter&) = delete;
+
+  ~DbLispWriter() { flush(); }
+
+  FormatMode mode() const { return mode_; }
+
+  bool compact() const { return mode_ == FORMAT_COMPACT; }
+
+  bool good() const { return good_; }
+
+  // Hands the buffered bytes to the sink, returns good().
+  bool flush() {
+    if (good_ && used_ != 0) {
+      good_ = sink_(chunk_.get(), used_);
+    }
+    used_ = 0;
+    return good_;
+  }
+
+  void put(const char c) {
+    if (used_ == kChunkSize) flush();
+    chunk_[used_++] = c;
+  }
+
+  void write(std::string_view str) {
+    while (!str.empty()) {
+      if (used_ == kChunkSize) flush();
+      size_t size = std::min(str.size(), kChunkSize - used_);
+      std::memcpy(chunk_.get() + used_, str.data(), size);
+      used_ += size;
+      str.remove_prefix(size);
+    }
+  }
+
+  // A newline and `indent` spaces.
+  void newline(size_t indent) {
+    put('\n');
+    while (indent != 0) {
+      if (used_ == kChunkSize) flush();
+      size_t size = std::min(indent, kChunkSize - used_);
+      std::memset(chunk_.get() + used_, ' ', size);
+      used_ += size;
+      indent -= size;
+    }
+  }
+
+  // Writes `str` as a lisp string, with every '"' escaped as \", and
+  // returns the number of bytes written. Runs without a quote are copied
+  // whole.
+  size_t writeQuoted(std::string_view str) {
+    size_t written = str.size() + 2;
+    put('"');
+    const char* first = str.data();
+    const char* last = first + str.size();
+    for (;;) {
+      const char* quote = DbLispScanner::findChar(first, last, '"');
+      write(std::string_view(first, quote - first));
+      if (quote == last) break;
+      write("\\\"");
+      written += 1;
+      first = quote + 1;
+    }
+    put('"');
+    return written;
+  }
+
+  // Writes `fileName` through a writer on a temporary file next to it,
+  // which replaces `fileName` with one rename once `write` returned true
+  // and everything reached the disk. Readers see either the old or the
+  // new file, never a partial one, and the rename itself is synced through
+  // the parent directory. A new file gets 0666 minus the umask, like one
+  // made by open(2); an existing one keeps its mode. When anything fails
+  // `fileName` is left untouched.
+  static bool saveToFile(const std::string& fileName, FormatMode mode,
+                         const std::function<bool(DbLispWriter&)>& write) {
+#ifdef _DBLISP_HAS_FD_
+    std::string tempName = fileName + ".XXXXXX";
+    int fd = ::mkstemp(&tempName[0]);
+    if (fd == -1) {
+      return false;
+    }
+    struct stat fileStat;
+    mode_t fileMode;
+    if (::stat(fileName.c_str(), &fileStat) == 0) {
+      fileMode = fileStat.st_mode;
+    } else {
+      // umask can only be read by setting it, so put it straight back.
+      mode_t mask = ::umask(0);
+      ::umask(mask);
+      fileMode = 0666 & ~mask;
+    }
+    bool ret = ::fchmod(fd, fileMode & 07777) == 0;
+    if (ret) {
+      DbLispWriter writer(fd, mode);
+      ret = write(writer) && writer.flush();
+    }
+    ret = ret && ::fsync(fd) == 0;
+    ret = ::close(fd) == 0 && ret;
+    ret = ret && std::rename(tempName.c_str(), fileName.c_str()) == 0;
+    if (!ret) {
+      ::unlink(tempName.c_str());
+      return false;
+    }
+    return syncDirectory(fileName);
+#else
+    std::string tempName = fileName + ".tmp";
+    bool ret;
+    {
+      std::ofstream outStream(tempName, std::ios::binary | std::ios::trunc);
+      DbLispWriter writer(outStream, mode);
+      ret = outStream.is_open() && write(writer) && writer.flush() &&
+            outStream.flush();
+    }
+#ifdef _WIN32
+    ret = ret && ::MoveFileExA(tempName.c_str(), fileName.c_str(),
+                               MOVEFILE_REPLACE_EXISTING |
+                                   MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    // std::rename may refuse to replace an existing file here, so the old
+    // one goes first, but only once the new one is complete.
+    if (ret) {
+      std::remove(fileName.c_str());
+      ret = std::rename(tempName.c_str(), fileName.c_str()) == 0;
+    }
+#endif
+    if (!ret) {
+      std::remove(tempName.c_str());
+    }
+    return ret;
+#endif
+  }
+
+ private:
+#ifdef _DBLISP_HAS_FD_
+  // Flushes the directory entry of `fileName` so a rename survives a crash.
+  static bool syncDirectory(const std::string& fileName) {
+    size_t slash = fileName.rfind('/');
+    std::string dirName = slash == std::string::npos ? std::string(".")
+                          : slash == 0 ? std::string("/")
+                                       : fileName.substr(0, slash);
+    int fd = ::open(dirName.c_str(), O_RDONLY);
+    if (fd == -1) {
+      return false;
+    }
+    // Some file systems cannot sync a directory and say so with EINVAL.
+    bool ret = ::fsync(fd) == 0 || errno == EINVAL;
+    ret = ::close(fd) == 0 && ret;
+    return ret;
+  }
+
+  static bool writeFd(int fd, const char* data, size_t size) {
+    while (size != 0) {
+      ssize_t n = ::write(fd, data, size);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      data += n;
+      size -= n;
+    }
+    return true;
+  }
+#endif
+
+ private:
+  Sink sink_;
+  FormatMode mode_;
+  std::unique_ptr<char[]> chunk_;
+  size_t used_ = 0;
+  bool good_ = true;
+};
+
+}  // namespace dblisp
+
+#endif
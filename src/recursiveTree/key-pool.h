@@ -0,0 +1,93 @@
+#ifndef _DBLISP_KEY_POOL_H_
+#define _DBLISP_KEY_POOL_H_
+
+#include <cstring>
+#include <memory_resource>
+#include <string_view>
+#include <unordered_set>
+
+namespace dblisp {
+
+// Interning table for RecTree keys. Every distinct key is stored once and
+// lives as long as the pool, so the pool must outlive every tree and
+// KeyType that uses it. One pool can be shared by several trees, but it is
+// not thread safe.
+//
+// Each stored key is preceded by a pointer to its pool, so a key knows its
+// pool without keeping it, see owner.
+class KeyPool {
+ public:
+  explicit KeyPool(std::pmr::memory_resource* resource =
+                       std::pmr::get_default_resource())
+      : resource_(resource), index_(resource) {}
+
+  KeyPool(const KeyPool&) = delete;
+
+  KeyPool& operator=(const KeyPool&) = delete;
+
+  ~KeyPool() {
+    for (std::string_view key : index_) {
+      resource_->deallocate(const_cast<char*>(key.data()) - sizeof(KeyPool*),
+                            sizeof(KeyPool*) + key.size(), alignof(KeyPool*));
+    }
+  }
+
+  // Returns the bytes of the one stored copy of `key`, adding it when it
+  // is new.
+  const char* intern(std::string_view key) {
+    lookups_ += 1;
+    auto iter = index_.find(key);
+    if (iter != index_.end()) {
+      hits_ += 1;
+      bytesSaved_ += keyBytes(key);
+      return iter->data();
+    }
+    char* block = static_cast<char*>(resource_->allocate(
+        sizeof(KeyPool*) + key.size(), alignof(KeyPool*)));
+    KeyPool* self = this;
+    std::memcpy(block, &self, sizeof(self));
+    char* data = block + sizeof(KeyPool*);
+    std::memcpy(data, key.data(), key.size());
+    index_.emplace(data, key.size());
+    return data;
+  }
+
+  // The pool that returned `data` from intern.
+  static KeyPool* owner(const char* data) {
+    KeyPool* pool;
+    std::memcpy(&pool, data - sizeof(KeyPool*), sizeof(pool));
+    return pool;
+  }
+
+  // Number of distinct keys.
+  size_t size() const { return index_.size(); }
+
+  size_t lookups() const { return lookups_; }
+
+  size_t hits() const { return hits_; }
+
+  double hitRate() const {
+    return lookups_ == 0 ? 0 : static_cast<double>(hits_) / lookups_;
+  }
+
+  // What the hits would have cost as separately allocated keys: the bytes
+  // behind a reference count and a resource pointer each.
+  size_t bytesSaved() const { return bytesSaved_; }
+
+ private:
+  static size_t keyBytes(std::string_view key) {
+    return 2 * sizeof(void*) + key.size();
+  }
+
+ private:
+  std::pmr::memory_resource* resource_;
+  // Views of the stored bytes, which never move.
+  std::pmr::unordered_set<std::string_view> index_;
+  size_t lookups_ = 0;
+  size_t hits_ = 0;
+  size_t bytesSaved_ = 0;
+};
+
+}  // namespace dblisp
+
+#endif
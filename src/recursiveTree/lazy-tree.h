@@ -0,0 +1,304 @@
+#ifndef _DBLISP_LAZY_TREE_H_
+#define _DBLISP_LAZY_TREE_H_
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dblisp-file.h"
+#include "dblisp-lexer.h"
+#include "dblisp-parser.h"
+#include "recursive-map.h"
+
+namespace dblisp {
+
+// The top level definitions of a lisp file, each one parsed into a
+// recursive_map the first time find, at or an iterator reaches it. Loading
+// only lexes the file to find where every definition starts and ends, so
+// a process that reads a few sections of a large file never builds the
+// rest. The source stays mapped for as long as the tree lives.
+//
+// Loading checks the parentheses, the strings and the top level keys,
+// everything inside a definition is checked when it is parsed. Such an
+// error is logged like any parser error, with the line and column in the
+// file, and find and at throw std::runtime_error. A variable may name any
+// definition above the one that uses it, which is then parsed as well.
+//
+// Parsing changes the tree, so it must not be shared between threads
+// without a lock even when they only read.
+class LazyTree {
+  friend class DbLispParser;
+  using link_type = recursive_map::link_type;
+
+ public:
+  class iterator {
+    friend class LazyTree;
+
+   public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef recursive_map value_type;
+    typedef recursive_map& reference;
+    typedef recursive_map* pointer;
+    typedef ptrdiff_t difference_type;
+
+    iterator() = default;
+
+    // The key of the definition, which is not parsed for it.
+    const std::string& key() const { return tree_->sections_[index_].key; }
+
+    // Parses the definition if needed, throws std::runtime_error when it
+    // does not parse.
+    reference operator*() const { return tree_->materialize(index_); }
+
+    pointer operator->() const { return &**this; }
+
+    iterator& operator++() {
+      ++index_;
+      return *this;
+    }
+
+    iterator operator++(int) {
+      iterator ret = *this;
+      ++index_;
+      return ret;
+    }
+
+    bool operator==(const iterator& x) const { return index_ == x.index_; }
+
+    bool operator!=(const iterator& x) const { return !(*this == x); }
+
+   private:
+    iterator(LazyTree* tree, size_t index) : tree_(tree), index_(index) {}
+
+    LazyTree* tree_ = nullptr;
+    size_t index_ = 0;
+  };
+
+  LazyTree() = default;
+
+  LazyTree(const LazyTree&) = delete;
+
+  LazyTree& operator=(const LazyTree&) = delete;
+
+  LazyTree(LazyTree&& x) noexcept { swap(x); }
+
+  LazyTree& operator=(LazyTree&& x) noexcept {
+    LazyTree temp(std::move(x));
+    swap(temp);
+    return *this;
+  }
+
+  void swap(LazyTree& x) noexcept {
+    source_.swap(x.source_);
+    std::swap(buf_, x.buf_);
+    fileName_.swap(x.fileName_);
+    std::swap(packNumbers_, x.packNumbers_);
+    sections_.swap(x.sections_);
+  }
+
+  // Number of top level definitions.
+  size_t size() const { return sections_.size(); }
+
+  bool empty() const { return sections_.empty(); }
+
+  // Number of definitions parsed so far.
+  size_t parsedSize() const {
+    return std::count_if(
+        sections_.begin(), sections_.end(),
+        [](const Section& section) { return section.root != nullptr; });
+  }
+
+  // Definitions in key order.
+  iterator begin() { return iterator(this, 0); }
+
+  iterator end() { return iterator(this, sections_.size()); }
+
+  // nullptr when there is no definition named `key`.
+  recursive_map* find(const std::string& key) {
+    size_t index = lookup(key);
+    return index == sections_.size() ? nullptr : &materialize(index);
+  }
+
+  recursive_map& at(const std::string& key) {
+    size_t index = lookup(key);
+    if (index == sections_.size()) {
+      throw std::out_of_range("dblisp: lazy tree: no key `" + key + "`");
+    }
+    return materialize(index);
+  }
+
+  // Parses every definition into one recursive_map, returns false when
+  // one does not parse.
+  bool toRecTree(recursive_map& rmap) {
+    recursive_map rmapTemp(rmap.key().toString(), rmap.resource(),
+                           rmap.keyPool());
+    rmapTemp.setChildPolicy(rmap.childPolicy());
+    for (size_t index = 0; index != sections_.size(); ++index) {
+      if (!parse(index)) {
+        return false;
+      }
+      rmapTemp.insert(sectionTree(index));
+    }
+    rmap.swap(rmapTemp);
+    return true;
+  }
+
+ private:
+  using Section = DbLispParser::Definition;
+
+  size_t lookup(std::string_view key) const {
+    auto pos = std::lower_bound(
+        sections_.begin(), sections_.end(), key,
+        [](const Section& section, std::string_view key) {
+          return std::string_view(section.key) < key;
+        });
+    return pos != sections_.end() && pos->key == key
+               ? static_cast<size_t>(pos - sections_.begin())
+               : sections_.size();
+  }
+
+  recursive_map& sectionTree(size_t index) const {
+    const Section& section = sections_[index];
+    return section.root->at(section.key);
+  }
+
+  recursive_map& materialize(size_t index) {
+    if (!parse(index)) {
+      throw std::runtime_error("dblisp: lazy tree: error: " + fileName_ +
+                               ": `" + sections_[index].key +
+                               "` does not parse");
+    }
+    return sectionTree(index);
+  }
+
+  // Parses one definition on its own, its variables are looked up among
+  // the definitions above it. A definition that failed is not parsed
+  // again, so its error is logged once.
+  bool parse(size_t index) {
+    Section& section = sections_[index];
+    if (section.root != nullptr || section.failed) {
+      return !section.failed;
+    }
+    DbLispParser parser;
+    parser.lispFile_ = fileName_;
+    parser.packNumbers_ = packNumbers_;
+    return parser.parseDefinition(
+        buf_, section, [this, index](std::string_view name) {
+          size_t var = lookup(name);
+          if (var == sections_.size() ||
+              sections_[var].first >= sections_[index].first || !parse(var)) {
+            return static_cast<link_type>(nullptr);
+          }
+          return &sectionTree(var);
+        });
+  }
+
+ private:
+  std::shared_ptr<const void> source_;
+  std::string_view buf_;
+  std::string fileName_;
+  bool packNumbers_ = false;
+  std::vector<Section> sections_;
+};
+
+inline bool DbLispParser::lispToLazyTree(const std::string& lispFile,
+                                         LazyTree& tree) {
+  beginParse(lispFile);
+  auto file = std::make_shared<DbLispFile>();
+  if (!file->open(lispFile)) {
+    return openErrorLog(lispFile);
+  }
+  std::string_view lispBuf = file->view();
+  return bufToLazyTree(lispBuf, std::move(file), tree);
+}
+
+inline bool DbLispParser::lispBufToLazyTree(
+    std::shared_ptr<const std::string> lispBuf, LazyTree& tree,
+    const std::string& bufName) {
+  beginParse(bufName);
+  std::string_view lispView = *lispBuf;
+  return bufToLazyTree(lispView, std::move(lispBuf), tree);
+}
+
+// Lexes the buffer once and keeps the range of every top level definition.
+// Only the top level is checked here, nested words are just counted.
+inline bool DbLispParser::bufToLazyTree(std::string_view lispBuf,
+                                        std::shared_ptr<const void> source,
+                                        LazyTree& tree) {
+  LazyTree treeTemp;
+  treeTemp.source_ = std::move(source);
+  treeTemp.buf_ = lispBuf;
+  treeTemp.fileName_ = lispFile_;
+  treeTemp.packNumbers_ = packNumbers_;
+  DbLispLexer lexer(lispBuf);
+  DbLispToken token;
+  std::string key, error;
+  size_t errorOffset = 0, depth = 0, first = 0;
+  bool keyExpected = false;
+  for (; error.empty() && lexer.next(token);) {
+    errorOffset = token.offset();
+    switch (token.wordType()) {
+      case LEFT_PARENTHESIS:
+        if (keyExpected) {
+          error = "`(` must have a key";
+        } else if (depth == 0) {
+          first = token.offset();
+          keyExpected = true;
+        }
+        depth += 1;
+        break;
+      case RIGHT_PARENTHESIS:
+        if (keyExpected) {
+          error = "`()` is invalid syntax";
+        } else if (depth == 0) {
+          error = "`) not close";
+        } else if (--depth == 0) {
+          treeTemp.sections_.push_back(
+              LazyTree::Section{key, first, token.offset() + 1, nullptr});
+        }
+        break;
+      case STRING_VALUE:
+      case VARIABLE:
+        if (keyExpected) {
+          keyExpected = false;
+          token.valueTo(key);
+        } else if (depth == 0) {
+          error = "`" + token.value() + "` is invalid syntax";
+        }
+        break;
+      default:;
+    }
+  }
+  if (!quotCloseCheck(lexer)) {
+    return false;
+  }
+  if (error.empty() && depth != 0) {
+    error = "`(` not close";
+    errorOffset = first;
+  }
+  auto& sections = treeTemp.sections_;
+  std::stable_sort(sections.begin(), sections.end(),
+                   [](const LazyTree::Section& x, const LazyTree::Section& y) {
+                     return x.key < y.key;
+                   });
+  for (size_t index = 1; error.empty() && index < sections.size(); ++index) {
+    if (sections[index].key == sections[index - 1].key) {
+      error = "duplicate key `" + sections[index].key + "`";
+      errorOffset = sections[index].first;
+    }
+  }
+  if (!error.empty()) {
+    auto lineColumn = lexer.lineColumn(errorOffset);
+    return errorIndexLog(lineColumn.first, lineColumn.second, error);
+  }
+  tree.swap(treeTemp);
+  return true;
+}
+
+}  // namespace dblisp
+
+#endif
@@ -0,0 +1,483 @@
+#ifndef _DBLISP_MAPPED_TREE_H_
+#define _DBLISP_MAPPED_TREE_H_
+
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "dblisp-binary.h"
+#include "dblisp-file.h"
+#include "recursive-map.h"
+
+namespace dblisp {
+
+class MappedNode;
+class MappedNode_const_iterator;
+
+// Read-only tree over a file written by DbLispBinary::saveBinary. Nothing
+// is built: every MappedNode decodes its node in place from the mapping,
+// so mapping takes the same time for any file size and processes that map
+// one file share its pages. Offsets and sizes are checked as they are
+// read, a corrupt node throws std::runtime_error. A child must come
+// before its map in the file, so even a corrupt file cannot make a walk
+// loop.
+class MappedTree {
+  friend class DbLispBinary;
+  friend class MappedNode;
+  friend class MappedNode_const_iterator;
+  friend class MappedValues;
+  using NodeHeader = DbLispBinary::NodeHeader;
+  using Reader = DbLispBinary::Reader;
+
+ public:
+  MappedTree() = default;
+
+  MappedTree(const MappedTree&) = delete;
+
+  MappedTree& operator=(const MappedTree&) = delete;
+
+  MappedTree(MappedTree&& x) noexcept { swap(x); }
+
+  MappedTree& operator=(MappedTree&& x) noexcept {
+    MappedTree temp(std::move(x));
+    swap(temp);
+    return *this;
+  }
+
+  void swap(MappedTree& x) noexcept {
+    file_.swap(x.file_);
+    std::swap(body_, x.body_);
+    std::swap(keyTable_, x.keyTable_);
+    std::swap(rootOffset_, x.rootOffset_);
+  }
+
+  // Only valid after DbLispBinary::mapBinary returned true.
+  inline MappedNode root() const;
+
+  inline std::string_view key() const;
+
+  bool isMapped() const { return file_.isMapped(); }
+
+ private:
+  [[noreturn]] static void corrupt() {
+    throw std::runtime_error("MappedTree: corrupt node");
+  }
+
+  uint64_t keyCount() const {
+    return keyTable_.size() / DbLispBinary::kNarrow;
+  }
+
+  NodeHeader header(uint64_t offset) const {
+    Reader reader(body_);
+    NodeHeader header;
+    if (!reader.seek(offset) || !DbLispBinary::readHeader(reader, header) ||
+        header.keyIndex >= keyCount()) {
+      corrupt();
+    }
+    return header;
+  }
+
+  // The length-prefixed string at `offset`.
+  std::string_view string(uint64_t offset) const {
+    Reader reader(body_);
+    std::string_view str;
+    if (!reader.seek(offset) || !reader.readString(str)) {
+      corrupt();
+    }
+    return str;
+  }
+
+  std::string_view key(uint64_t keyIndex) const {
+    return string(DbLispBinary::tableEntry(keyTable_, DbLispBinary::kNarrow,
+                                           keyIndex));
+  }
+
+  // The key of the node at `offset`, without decoding its payload.
+  std::string_view nodeKey(uint64_t offset) const {
+    Reader reader(body_);
+    uint8_t kind;
+    uint64_t keyIndex;
+    if (!reader.seek(offset) || !reader.readByte(kind) ||
+        !reader.readVarint(keyIndex) || keyIndex >= keyCount()) {
+      corrupt();
+    }
+    return key(keyIndex);
+  }
+
+ private:
+  DbLispFile file_;
+  // The file without its root offset.
+  std::string_view body_;
+  std::string_view keyTable_;
+  uint64_t rootOffset_ = 0;
+};
+
+// The text values of a MappedNode, each one a std::string_view into the
+// mapping.
+class MappedValues {
+  friend class MappedNode;
+
+ public:
+  class const_iterator {
+    friend class MappedValues;
+
+   public:
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef std::string_view value_type;
+    typedef std::string_view reference;
+    typedef const std::string_view* pointer;
+    typedef ptrdiff_t difference_type;
+
+    const_iterator() = default;
+
+    reference operator*() const { return values_->operator[](index_); }
+
+    const_iterator& operator++() {
+      ++index_;
+      return *this;
+    }
+
+    const_iterator operator++(int) {
+      auto temp = *this;
+      ++index_;
+      return temp;
+    }
+
+    bool operator==(const const_iterator& x) const {
+      return index_ == x.index_;
+    }
+
+    bool operator!=(const const_iterator& x) const { return !(*this == x); }
+
+   private:
+    const_iterator(const MappedValues* values, size_t index)
+        : values_(values), index_(index) {}
+
+   private:
+    const MappedValues* values_ = nullptr;
+    size_t index_ = 0;
+  };
+
+  size_t size() const { return count_; }
+
+  bool empty() const { return count_ == 0; }
+
+  std::string_view operator[](const size_t index) const {
+    if (table_.empty()) {
+      return value_;
+    }
+    return tree_->string(DbLispBinary::tableEntry(table_, width_, index));
+  }
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+
+  const_iterator end() const { return const_iterator(this, count_); }
+
+ private:
+  MappedValues(const MappedTree* tree, std::string_view value,
+               std::string_view table, size_t width, size_t count)
+      : tree_(tree),
+        value_(value),
+        table_(table),
+        width_(width),
+        count_(count) {}
+
+ private:
+  const MappedTree* tree_;
+  // The single value of a NODE_VALUE, otherwise the offset table.
+  std::string_view value_;
+  std::string_view table_;
+  size_t width_;
+  size_t count_;
+};
+
+// A node of a MappedTree, cheap to copy. It stays valid as long as the
+// tree it came from.
+class MappedNode {
+  friend class MappedTree;
+  friend class MappedNode_const_iterator;
+  using NodeHeader = DbLispBinary::NodeHeader;
+
+ public:
+  typedef MappedNode_const_iterator const_iterator;
+  typedef const_iterator iterator;
+
+  MappedNode() = default;
+
+  std::string_view key() const { return tree_->key(header_.keyIndex); }
+
+  bool isValue() const {
+    return header_.kind != DbLispBinary::NODE_INIT && !isMap();
+  }
+
+  bool isMap() const { return header_.kind == DbLispBinary::NODE_MAP; }
+
+  bool isNumberVector() const {
+    return header_.kind == DbLispBinary::NODE_INT64S ||
+           header_.kind == DbLispBinary::NODE_DOUBLES;
+  }
+
+  size_t size() const { return isMap() ? header_.count : 0; }
+
+  bool empty() const { return size() == 0; }
+
+  inline const_iterator begin() const;
+
+  inline const_iterator end() const;
+
+  inline const_iterator cbegin() const;
+
+  inline const_iterator cend() const;
+
+  inline const_iterator find(std::string_view key) const;
+
+  inline MappedNode at(std::string_view key) const;
+
+  // Text values only, number columns are read with asInt64Span and
+  // asDoubleSpan.
+  std::string_view value(const size_t index = 0) const {
+    if (index >= valueVector().size()) {
+      throw std::out_of_range("MappedNode::value");
+    }
+    return valueVector()[index];
+  }
+
+  MappedValues valueVector() const {
+    switch (header_.kind) {
+      case DbLispBinary::NODE_VALUE:
+        return MappedValues(tree_, header_.bytes, std::string_view(),
+                            header_.width, 1);
+      case DbLispBinary::NODE_VALUES:
+        return MappedValues(tree_, std::string_view(), header_.bytes,
+                            header_.width, header_.count);
+      default:
+        return MappedValues(tree_, std::string_view(), std::string_view(),
+                            header_.width, 0);
+    }
+  }
+
+  // The column points into the mapping, where it is 8-byte aligned.
+  NumberSpan<int64_t> asInt64Span() const {
+    return numberSpan<int64_t>(DbLispBinary::NODE_INT64S);
+  }
+
+  NumberSpan<double> asDoubleSpan() const {
+    return numberSpan<double>(DbLispBinary::NODE_DOUBLES);
+  }
+
+  inline size_t count() const;
+
+ private:
+  // `offset` must be below `bound`, the offset of the parent map.
+  MappedNode(const MappedTree* tree, uint64_t offset, uint64_t bound)
+      : tree_(tree), offset_(offset) {
+    if (offset >= bound) {
+      MappedTree::corrupt();
+    }
+    header_ = tree->header(offset);
+  }
+
+  template <typename Number>
+  NumberSpan<Number> numberSpan(uint8_t kind) const {
+    if (header_.kind != kind) {
+      return NumberSpan<Number>();
+    }
+    return NumberSpan<Number>(
+        reinterpret_cast<const Number*>(header_.bytes.data()), header_.count);
+  }
+
+  std::string_view childTable() const {
+    return isMap() ? header_.bytes : std::string_view();
+  }
+
+  std::string_view childKey(size_t index) const {
+    return tree_->nodeKey(
+        DbLispBinary::tableEntry(header_.bytes, header_.width, index));
+  }
+
+ private:
+  const MappedTree* tree_ = nullptr;
+  uint64_t offset_ = 0;
+  NodeHeader header_;
+};
+
+class MappedNode_const_iterator {
+  friend class MappedNode;
+
+ public:
+  // Children are decoded on dereference and returned by value, so the
+  // iterator cannot hand out references. Before C++20 that only makes it an
+  // input iterator; C++20 algorithms and std::reverse_iterator still see
+  // the bidirectional traversal through iterator_concept.
+  typedef std::input_iterator_tag iterator_category;
+  typedef std::bidirectional_iterator_tag iterator_concept;
+  typedef MappedNode value_type;
+  typedef MappedNode reference;
+  typedef ptrdiff_t difference_type;
+
+  // Keeps the decoded child alive for the duration of a `->` expression.
+  class pointer {
+   public:
+    explicit pointer(MappedNode node) : node_(node) {}
+    const MappedNode* operator->() const { return &node_; }
+
+   private:
+    MappedNode node_;
+  };
+
+  typedef MappedNode_const_iterator self;
+
+  MappedNode_const_iterator() = default;
+
+  // Decodes the child on every dereference.
+  reference operator*() const {
+    return MappedNode(tree_, DbLispBinary::tableEntry(table_, width_, index_),
+                      parent_);
+  }
+
+  pointer operator->() const { return pointer(operator*()); }
+
+  self& operator++() {
+    ++index_;
+    return *this;
+  }
+
+  self operator++(int) {
+    auto temp = *this;
+    ++index_;
+    return temp;
+  }
+
+  self& operator--() {
+    --index_;
+    return *this;
+  }
+
+  self operator--(int) {
+    auto temp = *this;
+    --index_;
+    return temp;
+  }
+
+  bool operator==(const self& x) const {
+    return table_.data() == x.table_.data() && index_ == x.index_;
+  }
+
+  bool operator!=(const self& x) const { return !(*this == x); }
+
+ private:
+  MappedNode_const_iterator(const MappedTree* tree, uint64_t parent,
+                            std::string_view table, size_t width,
+                            size_t index)
+      : tree_(tree),
+        parent_(parent),
+        table_(table),
+        width_(width),
+        index_(index) {}
+
+ private:
+  const MappedTree* tree_ = nullptr;
+  uint64_t parent_ = 0;
+  std::string_view table_;
+  size_t width_ = DbLispBinary::kNarrow;
+  size_t index_ = 0;
+};
+
+inline MappedNode::const_iterator MappedNode::begin() const {
+  return const_iterator(tree_, offset_, childTable(), header_.width, 0);
+}
+
+inline MappedNode::const_iterator MappedNode::end() const {
+  return const_iterator(tree_, offset_, childTable(), header_.width, size());
+}
+
+inline MappedNode::const_iterator MappedNode::cbegin() const {
+  return begin();
+}
+
+inline MappedNode::const_iterator MappedNode::cend() const { return end(); }
+
+// Binary search over the child offsets, decoding only the probed keys.
+inline MappedNode::const_iterator MappedNode::find(
+    std::string_view key) const {
+  size_t first = 0;
+  size_t last = size();
+  while (first != last) {
+    size_t middle = first + (last - first) / 2;
+    if (childKey(middle) < key) {
+      first = middle + 1;
+    } else {
+      last = middle;
+    }
+  }
+  if (first != size() && childKey(first) != key) {
+    first = size();
+  }
+  return const_iterator(tree_, offset_, childTable(), header_.width, first);
+}
+
+inline MappedNode MappedNode::at(std::string_view key) const {
+  const_iterator iter = find(key);
+  if (iter == end()) {
+    throw std::out_of_range("MappedNode::at");
+  }
+  return *iter;
+}
+
+inline size_t MappedNode::count() const {
+  size_t ret = 1;
+  for (const auto& child : *this) {
+    ret += child.count();
+  }
+  return ret;
+}
+
+inline MappedNode MappedTree::root() const {
+  return MappedNode(this, rootOffset_, body_.size());
+}
+
+inline std::string_view MappedTree::key() const { return root().key(); }
+
+inline bool DbLispBinary::mapBinary(const std::string& fileName,
+                                    MappedTree& tree) {
+  fileName_ = fileName;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  MappedTree treeTemp;
+  if (!treeTemp.file_.open(fileName)) {
+    return errorLog("open error: " + fileName);
+  }
+  std::string_view buf = treeTemp.file_.view();
+  uint64_t keyCount;
+  if (!readFrame(buf, keyCount, treeTemp.rootOffset_)) {
+    return false;
+  }
+  treeTemp.body_ = buf.substr(0, buf.size() - 8);
+  Reader reader(treeTemp.body_);
+  if (!reader.seek(kHeaderSize) ||
+      !reader.readTable(keyCount, kNarrow, treeTemp.keyTable_)) {
+    return errorLog("corrupt key table");
+  }
+  NodeHeader header;
+  if (!reader.seek(treeTemp.rootOffset_) || !readHeader(reader, header) ||
+      header.keyIndex >= keyCount) {
+    return errorLog("corrupt node at offset " +
+                    std::to_string(treeTemp.rootOffset_));
+  }
+#ifdef _DBLISP_HAS_MMAP_
+  // DbLispFile asks for sequential readahead, lookups jump around.
+  if (treeTemp.file_.isMapped()) {
+    ::madvise(const_cast<char*>(buf.data()), buf.size(), MADV_NORMAL);
+  }
+#endif
+  tree.swap(treeTemp);
+  return true;
+#else
+  return errorLog("mapping needs a little-endian host");
+#endif
+}
+
+}  // namespace dblisp
+
+#endif
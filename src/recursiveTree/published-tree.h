@@ -0,0 +1,243 @@
+#ifndef _DBLISP_PUBLISHED_TREE_H_
+#define _DBLISP_PUBLISHED_TREE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "recursive-map.h"
+
+namespace dblisp {
+
+// The current version of a tree that reader threads share while a writer
+// replaces it, read-copy-update style. A reader takes a Snapshot without
+// locking: it claims a slot, usually the one its thread hashes to, and
+// publishes in it the version it loaded, like a hazard pointer. A writer
+// swaps in the new version under a lock only writers take, and frees a
+// replaced one once no slot holds it.
+//
+// A snapshot is a const RecTree, which const functions never change. A
+// writer that only edits a few nodes can copy the snapshot with
+// RecTree::ShareTag, which shares every subtree, change the copy and
+// publish it. Each edit then copies the child maps along its path, see
+// RecTree.
+//
+// Readers never wait: slots come in blocks of kSlotCount, and a reader
+// that finds every slot claimed appends another block, which lives as
+// long as the PublishedTree. A writer checks the slots of every block.
+// Every snapshot must be released before the PublishedTree dies.
+class PublishedTree {
+  struct Version {
+    Version(RecTree&& tree, uint64_t generation)
+        : tree(std::move(tree)), generation(generation) {}
+
+    RecTree tree;
+    uint64_t generation;
+  };
+
+  // One cache line each, so readers on different slots do not share one.
+  struct alignas(64) Slot {
+    std::atomic<bool> claimed{false};
+    std::atomic<const Version*> version{nullptr};
+  };
+
+ public:
+  static constexpr size_t kSlotCount = 128;
+
+ private:
+  struct SlotBlock {
+    Slot slots[kSlotCount];
+    std::atomic<SlotBlock*> next{nullptr};
+  };
+
+ public:
+
+  class Snapshot {
+    friend class PublishedTree;
+
+   public:
+    Snapshot() = default;
+
+    Snapshot(const Snapshot&) = delete;
+
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    Snapshot(Snapshot&& x) noexcept { swap(x); }
+
+    Snapshot& operator=(Snapshot&& x) noexcept {
+      Snapshot temp(std::move(x));
+      swap(temp);
+      return *this;
+    }
+
+    ~Snapshot() { reset(); }
+
+    void swap(Snapshot& x) noexcept {
+      std::swap(slot_, x.slot_);
+      std::swap(version_, x.version_);
+    }
+
+    // Lets the writer free the version once no other snapshot holds it.
+    void reset() {
+      if (slot_ != nullptr) {
+        slot_->version.store(nullptr, std::memory_order_release);
+        slot_->claimed.store(false, std::memory_order_release);
+      }
+      slot_ = nullptr;
+      version_ = nullptr;
+    }
+
+    // False before anything was published.
+    explicit operator bool() const { return version_ != nullptr; }
+
+    const RecTree& operator*() const { return version_->tree; }
+
+    const RecTree* operator->() const { return &version_->tree; }
+
+    // What publish returned for this version, 0 for an empty snapshot.
+    uint64_t generation() const {
+      return version_ == nullptr ? 0 : version_->generation;
+    }
+
+   private:
+    Snapshot(Slot* slot, const Version* version)
+        : slot_(slot), version_(version) {}
+
+    Slot* slot_ = nullptr;
+    const Version* version_ = nullptr;
+  };
+
+  PublishedTree() : slots_(new SlotBlock) {}
+
+  explicit PublishedTree(RecTree tree) : PublishedTree() {
+    publish(std::move(tree));
+  }
+
+  PublishedTree(const PublishedTree&) = delete;
+
+  PublishedTree& operator=(const PublishedTree&) = delete;
+
+  ~PublishedTree() {
+    delete current_.load(std::memory_order_relaxed);
+    for (const Version* version : retired_) {
+      delete version;
+    }
+    for (SlotBlock* block = slots_->next.load(std::memory_order_relaxed);
+         block != nullptr;) {
+      SlotBlock* next = block->next.load(std::memory_order_relaxed);
+      delete block;
+      block = next;
+    }
+  }
+
+  // The current version, which stays valid until the snapshot is reset
+  // whatever the writer publishes meanwhile.
+  Snapshot snapshot() const {
+    Slot* slot = claimSlot();
+    const Version* version = current_.load(std::memory_order_seq_cst);
+    for (;;) {
+      slot->version.store(version, std::memory_order_seq_cst);
+      // A writer that swapped the version before the store above may not
+      // have seen it, so only a version still current is safe.
+      const Version* again = current_.load(std::memory_order_seq_cst);
+      if (again == version) {
+        return Snapshot(slot, version);
+      }
+      version = again;
+    }
+  }
+
+  // Makes `tree` the current version and returns its generation, which
+  // counts from 1. The version it replaces is freed here or by a later
+  // publish or reclaim, once no snapshot holds it.
+  uint64_t publish(RecTree tree) {
+    std::lock_guard<std::mutex> lock(writerMutex_);
+    auto version = std::make_unique<Version>(std::move(tree), ++generation_);
+    const uint64_t generation = version->generation;
+    const Version* old =
+        current_.exchange(version.release(), std::memory_order_seq_cst);
+    if (old != nullptr) {
+      retired_.push_back(old);
+    }
+    reclaimRetired();
+    return generation;
+  }
+
+  // Frees the replaced versions no snapshot holds any more, returns how
+  // many still wait.
+  size_t reclaim() {
+    std::lock_guard<std::mutex> lock(writerMutex_);
+    return reclaimRetired();
+  }
+
+ private:
+  // The block is appended before the reader publishes a version in it,
+  // so a writer that misses the block swapped the version early enough
+  // for the reader to see the swap and retry.
+  Slot* claimSlot() const {
+    const size_t first =
+        std::hash<std::thread::id>()(std::this_thread::get_id()) % kSlotCount;
+    for (SlotBlock* block = slots_.get();;) {
+      for (size_t count = 0; count != kSlotCount; ++count) {
+        Slot& slot = block->slots[(first + count) % kSlotCount];
+        bool claimed = false;
+        if (!slot.claimed.load(std::memory_order_relaxed) &&
+            slot.claimed.compare_exchange_strong(claimed, true,
+                                                 std::memory_order_acquire)) {
+          return &slot;
+        }
+      }
+      SlotBlock* next = block->next.load(std::memory_order_seq_cst);
+      if (next == nullptr) {
+        auto appended = std::make_unique<SlotBlock>();
+        // On failure `next` is the block another reader appended.
+        if (block->next.compare_exchange_strong(next, appended.get(),
+                                                std::memory_order_seq_cst)) {
+          next = appended.release();
+        }
+      }
+      block = next;
+    }
+  }
+
+  size_t reclaimRetired() {
+    std::vector<const Version*> held;
+    for (const SlotBlock* block = slots_.get(); block != nullptr;
+         block = block->next.load(std::memory_order_seq_cst)) {
+      for (const Slot& slot : block->slots) {
+        const Version* version = slot.version.load(std::memory_order_seq_cst);
+        if (version != nullptr) {
+          held.push_back(version);
+        }
+      }
+    }
+    std::sort(held.begin(), held.end());
+    auto last = std::partition(
+        retired_.begin(), retired_.end(), [&held](const Version* version) {
+          return std::binary_search(held.begin(), held.end(), version);
+        });
+    for (auto pos = last; pos != retired_.end(); ++pos) {
+      delete *pos;
+    }
+    retired_.erase(last, retired_.end());
+    return retired_.size();
+  }
+
+ private:
+  std::atomic<const Version*> current_{nullptr};
+  // The first block, the others hang off it.
+  std::unique_ptr<SlotBlock> slots_;
+  std::mutex writerMutex_;
+  uint64_t generation_ = 0;
+  std::vector<const Version*> retired_;
+};
+
+}  // namespace dblisp
+
+#endif
@@ -1,59 +1,202 @@
 #ifndef _DBLISP_RECURSIVE_MAP_H_
 #define _DBLISP_RECURSIVE_MAP_H_
 
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
-#include <map>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <memory_resource>
+#include <set>
+#include <shared_mutex>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+#include "dblisp-scan.h"
+#include "dblisp-writer.h"
+#include "key-pool.h"
+
 namespace dblisp {
 class RecTree;
 
 using recursive_map = RecTree;
 
+// A key either owns its string or refers to the one copy in a KeyPool.
+// An owned string sits in one block from the resource behind a reference
+// count, copying such a key counts one more reference. Interned keys hold
+// no reference count, copying them copies the pointer, and two keys of the
+// same pool are equal iff they point to the same string. The pool of an
+// interned key is found through its string, see KeyPool::owner.
+//
+// The size and the first kPrefixSize bytes are also kept inline, zero
+// padded, so most comparisons in a std::map descent never dereference the
+// string. A key is 24 bytes.
 class KeyType {
-  using pointer = std::shared_ptr<std::string>;
+  friend class ChildMap;
   friend class RecTree;
   friend std::ostream& operator<<(std::ostream& outStream, const KeyType& key);
   friend bool operator==(const KeyType& left, const KeyType& right);
   friend bool operator<(const KeyType& left, const KeyType& right);
 
  public:
-  KeyType() : keyPtr_(createPointer("")) {}
+  static constexpr size_t kPrefixSize = 11;
+
+  KeyType() : data_("") {}
+
+  explicit KeyType(std::string_view key,
+                   std::pmr::memory_resource* resource =
+                       std::pmr::get_default_resource())
+      : data_(createBlock(key, resource)), storage_(KEY_OWNED) {
+    setPrefix(key);
+  }
+
+  KeyType(std::string_view key, KeyPool* keyPool)
+      : data_(keyPool->intern(key)), storage_(KEY_POOLED) {
+    setPrefix(key);
+  }
+
+  KeyType(const KeyType& x)
+      : data_(x.data_), size_(x.size_), storage_(x.storage_) {
+    std::memcpy(prefix_, x.prefix_, kPrefixSize);
+    if (storage_ == KEY_OWNED) {
+      block()->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
 
-  explicit KeyType(const std::string& key) : keyPtr_(createPointer(key)) {}
+  KeyType(KeyType&& x) noexcept : KeyType() { swap(x); }
 
-  KeyType(const KeyType& x) : keyPtr_(x.keyPtr_) {}
+  void swap(KeyType& x) noexcept {
+    std::swap(data_, x.data_);
+    std::swap(size_, x.size_);
+    std::swap(prefix_, x.prefix_);
+    std::swap(storage_, x.storage_);
+  }
 
-  void swap(KeyType& x) noexcept { std::swap(keyPtr_, x.keyPtr_); }
+  KeyType& operator=(const KeyType& x) {
+    KeyType temp(x);
+    swap(temp);
+    return *this;
+  }
 
-  KeyType& operator=(KeyType x) {
-    swap(x);
+  KeyType& operator=(KeyType&& x) noexcept {
+    KeyType temp(std::move(x));
+    swap(temp);
     return *this;
   }
 
-  ~KeyType() {}
+  ~KeyType() { release(); }
 
-  operator std::string() const { return *keyPtr_; }
+  operator std::string() const { return toString(); }
 
-  std::string toString() const { return *keyPtr_; }
+  std::string toString() const { return std::string(constRefer()); }
 
-  void clear() { freePointer(keyPtr_); }
+  void clear() {
+    release();
+    data_ = nullptr;
+    size_ = 0;
+    std::memset(prefix_, 0, kPrefixSize);
+    storage_ = KEY_BORROWED;
+  }
 
-  bool isNull() const { return keyPtr_.get() == nullptr; }
+  bool isNull() const { return data_ == nullptr; }
+
+  KeyPool* keyPool() const {
+    return storage_ == KEY_POOLED ? KeyPool::owner(data_) : nullptr;
+  }
 
  private:
-  pointer createPointer(const std::string& key) {
-    return std::make_shared<std::string>(key);
+  enum KEY_STORAGE : uint8_t { KEY_BORROWED, KEY_OWNED, KEY_POOLED };
+
+  // What precedes the bytes of an owned key.
+  struct Block {
+    std::atomic<uint32_t> refs;
+    std::pmr::memory_resource* resource;
+  };
+
+  // The tag keeps the borrowing constructor out of the overload set of a
+  // string literal.
+  struct BorrowTag {};
+
+  KeyType(BorrowTag, const char* data) : data_(data) {}
+
+  // A key that only borrows `key`, for lookups.
+  static KeyType borrow(std::string_view key) {
+    KeyType ret(BorrowTag(), key.data());
+    ret.setPrefix(key);
+    return ret;
   }
 
-  void freePointer(pointer ptr) { keyPtr_.reset(); }
+  static const char* createBlock(std::string_view key,
+                                 std::pmr::memory_resource* resource) {
+    void* ptr =
+        resource->allocate(sizeof(Block) + key.size(), alignof(Block));
+    Block* block = ::new (ptr) Block{{1}, resource};
+    char* data = reinterpret_cast<char*>(block + 1);
+    std::memcpy(data, key.data(), key.size());
+    return data;
+  }
 
-  const std::string& constRefer() const { return *keyPtr_; }
+  Block* block() const {
+    return reinterpret_cast<Block*>(reinterpret_cast<uintptr_t>(data_) -
+                                    sizeof(Block));
+  }
+
+  void release() {
+    if (storage_ != KEY_OWNED ||
+        block()->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+      return;
+    }
+    Block* ptr = block();
+    std::pmr::memory_resource* resource = ptr->resource;
+    ptr->~Block();
+    resource->deallocate(ptr, sizeof(Block) + size_, alignof(Block));
+  }
+
+  void setPrefix(std::string_view key) {
+    size_ = static_cast<uint32_t>(key.size());
+    std::memcpy(prefix_, key.data(), std::min(key.size(), kPrefixSize));
+  }
+
+  std::string_view constRefer() const {
+    return std::string_view(data_, size_);
+  }
+
+  bool samePool(const KeyType& x) const {
+    return storage_ == KEY_POOLED && x.storage_ == KEY_POOLED &&
+           keyPool() == x.keyPool();
+  }
+
+  // Negative, zero or positive like std::string::compare.
+  int compare(const KeyType& x) const {
+    int ret = std::memcmp(prefix_, x.prefix_, kPrefixSize);
+    if (ret != 0 || (data_ == x.data_ && size_ == x.size_)) {
+      return ret;
+    }
+    size_t common = std::min(size_, x.size_);
+    if (common > kPrefixSize) {
+      ret = std::memcmp(data_ + kPrefixSize, x.data_ + kPrefixSize,
+                        common - kPrefixSize);
+      if (ret != 0) {
+        return ret;
+      }
+    }
+    return size_ < x.size_ ? -1 : size_ != x.size_;
+  }
 
  private:
-  pointer keyPtr_;
+  const char* data_;
+  uint32_t size_ = 0;
+  char prefix_[kPrefixSize] = {};
+  KEY_STORAGE storage_ = KEY_BORROWED;
 };
 
 inline std::ostream& operator<<(std::ostream& outStream, const KeyType& key) {
@@ -62,7 +205,14 @@ inline std::ostream& operator<<(std::ostream& outStream, const KeyType& key) {
 }
 
 inline bool operator==(const KeyType& left, const KeyType& right) {
-  return left.constRefer() == right.constRefer();
+  if (left.size_ != right.size_ ||
+      std::memcmp(left.prefix_, right.prefix_, KeyType::kPrefixSize) != 0) {
+    return false;
+  }
+  if (left.size_ <= KeyType::kPrefixSize || left.data_ == right.data_) {
+    return true;
+  }
+  return !left.samePool(right) && left.compare(right) == 0;
 }
 
 inline bool operator!=(const KeyType& left, const KeyType& right) {
@@ -70,7 +220,7 @@ inline bool operator!=(const KeyType& left, const KeyType& right) {
 }
 
 inline bool operator<(const KeyType& left, const KeyType& right) {
-  return left.constRefer() < right.constRefer();
+  return left.compare(right) < 0;
 }
 
 inline bool operator>=(const KeyType& left, const KeyType& right) {
@@ -85,6 +235,16 @@ inline bool operator<=(const KeyType& left, const KeyType& right) {
   return (!(left > right));
 }
 
+// A value string. Values of up to kInlineSize bytes are kept in the object
+// itself, longer ones in one exactly sized block from the resource.
+//
+// The first typed read parses the string once with std::from_chars and
+// caches the number or bool next to it, so repeated reads are a load. The
+// tryAs functions accept exactly what from_chars does, plus "true" and
+// "false" for bools, and return an error code instead of throwing. The
+// as functions take the same fast path and fall back to the std::sto*
+// functions, with their leniency and exceptions, on anything else. The
+// cache is atomic, so concurrent reads of one value are safe.
 class ValType {
   friend class RecTree;
 
@@ -92,52 +252,797 @@ class ValType {
                                   const ValType& value);
 
  public:
-  explicit ValType(const std::string& valStr) : valStr_(valStr) {}
+  // Lets std::pmr::vector<ValType> pass its resource on.
+  using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+  static constexpr size_t kInlineSize = 19;
+
+  explicit ValType(std::string_view valStr,
+                   const allocator_type& alloc = allocator_type())
+      : resource_(alloc.resource()) {
+    assign(valStr);
+  }
+
+  ValType(ValType&& x) noexcept : resource_(x.resource_) {
+    steal(x);
+    copyCache(x);
+  }
+
+  ValType(ValType&& x, const allocator_type& alloc)
+      : resource_(alloc.resource()) {
+    if (resource_->is_equal(*x.resource_)) {
+      steal(x);
+    } else {
+      assign(x.asStringView());
+    }
+    copyCache(x);
+  }
 
-  ValType(ValType&& x) : valStr_(std::move(x.valStr_)) {}
+  // Like std::pmr::string, a copy uses the default resource.
+  ValType(const ValType& x) : ValType(x.asStringView()) { copyCache(x); }
+
+  ValType(const ValType& x, const allocator_type& alloc)
+      : ValType(x.asStringView(), alloc) {
+    copyCache(x);
+  }
 
-  ValType(const ValType& x) : valStr_(x.valStr_) {}
+  ~ValType() { freeData(); }
 
-  ValType& operator=(ValType x) {
-    swap(x);
+  // Like std::pmr::string, assignment keeps this value's resource, which
+  // is the resource of the node holding it.
+  ValType& operator=(const ValType& x) {
+    if (this != &x) {
+      freeData();
+      assign(x.asStringView());
+      copyCache(x);
+    }
     return *this;
   }
 
-  void swap(ValType& x) noexcept { valStr_.swap(x.valStr_); }
+  ValType& operator=(ValType&& x) {
+    if (this == &x) {
+      return *this;
+    }
+    freeData();
+    if (resource_->is_equal(*x.resource_)) {
+      steal(x);
+    } else {
+      assign(x.asStringView());
+    }
+    copyCache(x);
+    return *this;
+  }
+
+  void swap(ValType& x) noexcept {
+    std::swap(resource_, x.resource_);
+    std::swap(size_, x.size_);
+    std::swap(data_, x.data_);
+    Cache cache = peekCache();
+    storeCache(x.peekCache());
+    x.storeCache(cache);
+  }
 
   operator std::string() const { return asString(); }
 
-  bool asBool() const { return valStr_ != "false"; }
+  bool asBool() const { return asStringView() != "false"; }
 
-  int asInt() const { return std::stoi(valStr_); }
+  int asInt() const {
+    return asNumber<int>([this] { return std::stoi(asString()); });
+  }
 
-  long int asLInt() const { return std::stol(valStr_); }
+  long int asLInt() const {
+    return asNumber<long int>([this] { return std::stol(asString()); });
+  }
 
-  long long int asLLInt() const { return std::stoll(valStr_); }
+  long long int asLLInt() const {
+    return asNumber<long long int>([this] { return std::stoll(asString()); });
+  }
 
-  unsigned int asUInt() const { return std::stoul(valStr_); }
+  unsigned int asUInt() const {
+    return asNumber<unsigned int>([this] { return std::stoul(asString()); });
+  }
 
-  unsigned long long int asULLInt() const { return std::stoull(valStr_); }
+  unsigned long long int asULLInt() const {
+    return asNumber<unsigned long long int>(
+        [this] { return std::stoull(asString()); });
+  }
+
+  std::string asString() const { return std::string(asStringView()); }
+
+  std::string_view asStringView() const {
+    return std::string_view(data(), size_);
+  }
+
+  char asChar() const { return data()[0]; }
+
+  float asFloat() const {
+    return asNumber<float>([this] { return std::stof(asString()); });
+  }
+
+  double asDouble() const {
+    return asNumber<double>([this] { return std::stod(asString()); });
+  }
+
+  long double asLDouble() const { return std::stold(asString()); }
+
+  std::errc tryAsBool(bool& value) const {
+    Cache cache = loadCache();
+    if (cache.kind != CACHE_BOOL) return std::errc::invalid_argument;
+    value = cache.bits != 0;
+    return std::errc();
+  }
+
+  std::errc tryAsInt(int& value) const { return tryAsInteger(value); }
+
+  std::errc tryAsLInt(long int& value) const { return tryAsInteger(value); }
+
+  std::errc tryAsLLInt(long long int& value) const {
+    return tryAsInteger(value);
+  }
+
+  std::errc tryAsUInt(unsigned int& value) const {
+    return tryAsInteger(value);
+  }
+
+  std::errc tryAsULLInt(unsigned long long int& value) const {
+    return tryAsInteger(value);
+  }
+
+  // Not cached, the string is parsed as a float directly so the result is
+  // rounded once, like std::stof.
+  std::errc tryAsFloat(float& value) const {
+    CACHE_KIND kind = loadCache().kind;
+    if (kind != CACHE_INT && kind != CACHE_UINT && kind != CACHE_DOUBLE) {
+      return std::errc::invalid_argument;
+    }
+    std::string_view str = asStringView();
+    return std::from_chars(str.data(), str.data() + str.size(), value).ec;
+  }
+
+  std::errc tryAsDouble(double& value) const {
+    Cache cache = loadCache();
+    switch (cache.kind) {
+      case CACHE_INT:
+        value = static_cast<double>(static_cast<int64_t>(cache.bits));
+        // "-0" is cached as the integer 0 but reads as the double -0.0.
+        if (cache.bits == 0 && asStringView().front() == '-') {
+          value = -0.0;
+        }
+        return std::errc();
+      case CACHE_UINT:
+        value = static_cast<double>(cache.bits);
+        return std::errc();
+      case CACHE_DOUBLE:
+        std::memcpy(&value, &cache.bits, sizeof(value));
+        return std::errc();
+      default:
+        return std::errc::invalid_argument;
+    }
+  }
+
+ private:
+  // CACHE_UINT only holds values above INT64_MAX.
+  enum CACHE_KIND : uint8_t {
+    CACHE_EMPTY,
+    CACHE_INT,
+    CACHE_UINT,
+    CACHE_DOUBLE,
+    CACHE_BOOL,
+    CACHE_INVALID
+  };
 
-  std::string asString() const { return valStr_; }
+  struct Cache {
+    CACHE_KIND kind;
+    uint64_t bits;
+  };
+
+  Cache loadCache() const {
+    Cache cache = peekCache();
+    return cache.kind == CACHE_EMPTY ? parseCache() : cache;
+  }
+
+  Cache peekCache() const {
+    auto kind =
+        static_cast<CACHE_KIND>(cacheKind_.load(std::memory_order_acquire));
+    return {kind, cacheBits_.load(std::memory_order_relaxed)};
+  }
+
+  void storeCache(Cache cache) const {
+    cacheBits_.store(cache.bits, std::memory_order_relaxed);
+    cacheKind_.store(cache.kind, std::memory_order_release);
+  }
+
+  void copyCache(const ValType& x) { storeCache(x.peekCache()); }
+
+  // Threads racing here compute and store the same cache.
+  Cache parseCache() const {
+    std::string_view str = asStringView();
+    const char* first = str.data();
+    const char* last = first + str.size();
+    Cache cache{CACHE_INVALID, 0};
+    int64_t intValue;
+    uint64_t uintValue;
+    double doubleValue;
+    auto intResult = std::from_chars(first, last, intValue);
+    if (intResult.ec == std::errc() && intResult.ptr == last) {
+      cache = {CACHE_INT, static_cast<uint64_t>(intValue)};
+    } else if (auto result = std::from_chars(first, last, uintValue);
+               intResult.ec == std::errc::result_out_of_range &&
+               result.ec == std::errc() && result.ptr == last) {
+      cache = {CACHE_UINT, uintValue};
+    } else if (auto result = std::from_chars(first, last, doubleValue);
+               result.ec == std::errc() && result.ptr == last) {
+      cache.kind = CACHE_DOUBLE;
+      std::memcpy(&cache.bits, &doubleValue, sizeof(doubleValue));
+    } else if (str == "true" || str == "false") {
+      cache = {CACHE_BOOL, str == "true"};
+    }
+    storeCache(cache);
+    return cache;
+  }
+
+  template <typename T>
+  std::errc tryAsInteger(T& value) const {
+    Cache cache = loadCache();
+    if (cache.kind == CACHE_UINT) {
+      if (cache.bits > std::numeric_limits<T>::max()) {
+        return std::errc::result_out_of_range;
+      }
+      value = static_cast<T>(cache.bits);
+      return std::errc();
+    }
+    if (cache.kind != CACHE_INT) {
+      return std::errc::invalid_argument;
+    }
+    auto intValue = static_cast<int64_t>(cache.bits);
+    if (std::is_unsigned_v<T>
+            ? intValue < 0 || static_cast<uint64_t>(intValue) >
+                                  std::numeric_limits<T>::max()
+            : intValue < static_cast<int64_t>(std::numeric_limits<T>::min()) ||
+                  intValue >
+                      static_cast<int64_t>(std::numeric_limits<T>::max())) {
+      return std::errc::result_out_of_range;
+    }
+    value = static_cast<T>(intValue);
+    return std::errc();
+  }
+
+  template <typename T, typename Fallback>
+  T asNumber(Fallback fallback) const {
+    T value;
+    std::errc ec;
+    if constexpr (std::is_same_v<T, float>) {
+      ec = tryAsFloat(value);
+    } else if constexpr (std::is_same_v<T, double>) {
+      ec = tryAsDouble(value);
+    } else {
+      ec = tryAsInteger(value);
+    }
+    return ec == std::errc() ? value : static_cast<T>(fallback());
+  }
 
-  char asChar() const { return valStr_.front(); }
+  bool isInline() const { return size_ <= kInlineSize; }
 
-  float asFloat() const { return std::stof(valStr_); }
+  // A long value keeps the pointer to its block in data_.
+  char* heapData() const {
+    char* ptr;
+    std::memcpy(&ptr, data_, sizeof(ptr));
+    return ptr;
+  }
 
-  double asDouble() const { return std::stod(valStr_); }
+  const char* data() const { return isInline() ? data_ : heapData(); }
 
-  long double asLDouble() const { return std::stold(valStr_); }
+  void assign(std::string_view valStr) {
+    size_ = static_cast<uint32_t>(valStr.size());
+    if (isInline()) {
+      std::memcpy(data_, valStr.data(), valStr.size());
+      return;
+    }
+    char* ptr = static_cast<char*>(resource_->allocate(size_, 1));
+    std::memcpy(ptr, valStr.data(), size_);
+    std::memcpy(data_, &ptr, sizeof(ptr));
+  }
+
+  void steal(ValType& x) {
+    size_ = x.size_;
+    std::memcpy(data_, x.data_, kInlineSize);
+    x.size_ = 0;
+  }
+
+  void freeData() {
+    if (!isInline()) {
+      resource_->deallocate(heapData(), size_, 1);
+    }
+  }
 
  private:
-  std::string valStr_;
+  std::pmr::memory_resource* resource_;
+  uint32_t size_ = 0;
+  mutable std::atomic<uint8_t> cacheKind_{CACHE_EMPTY};
+  char data_[kInlineSize];
+  mutable std::atomic<uint64_t> cacheBits_{0};
 };
 
 inline std::ostream& operator<<(std::ostream& outStream, const ValType& value) {
-  outStream << value.valStr_;
+  outStream << value.asStringView();
   return outStream;
 }
 
+// How a RecTree node stores its children, always in key order.
+//
+// CHILD_MAP keeps them in a red-black tree like std::map: O(log n) lookups,
+// inserts and erases, and iterators stay valid until their child is
+// erased. CHILD_FLAT keeps them in one sorted vector, which is smaller and
+// faster to iterate and search for small or read-mostly nodes, but
+// inserting in the middle or erasing is O(size) and invalidates iterators.
+// CHILD_HASH is CHILD_MAP plus an open-addressing index over the tree
+// nodes for O(1) lookups of very wide nodes. CHILD_ADAPTIVE is CHILD_FLAT
+// below ChildMap::kHashThreshold children and CHILD_HASH above, switching
+// invalidates iterators.
+enum ChildPolicy : uint8_t {
+  CHILD_MAP,
+  CHILD_FLAT,
+  CHILD_HASH,
+  CHILD_ADAPTIVE
+};
+
+class ChildMap {
+ public:
+  typedef std::pair<KeyType, RecTree*> value_type;
+
+ private:
+  struct EntryLess {
+    using is_transparent = void;
+
+    bool operator()(const value_type& left, const value_type& right) const {
+      return left.first < right.first;
+    }
+
+    bool operator()(const value_type& left, const KeyType& right) const {
+      return left.first < right;
+    }
+
+    bool operator()(const KeyType& left, const value_type& right) const {
+      return left < right.first;
+    }
+  };
+
+  using EntryVector = std::pmr::vector<value_type>;
+  using TreeSet = std::pmr::set<value_type, EntryLess>;
+  using TreeNode = TreeSet::const_iterator;
+
+ public:
+  // Walks either the sorted vector or the tree.
+  template <typename Value>
+  class Iterator {
+    friend class ChildMap;
+    template <typename>
+    friend class Iterator;
+
+   public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef std::remove_const_t<Value> value_type;
+    typedef Value& reference;
+    typedef Value* pointer;
+    typedef ptrdiff_t difference_type;
+
+    Iterator() = default;
+
+    // Also turns an iterator into a const_iterator.
+    Iterator(const Iterator<value_type>& x)
+        : entry_(x.entry_), node_(x.node_), tree_(x.tree_) {}
+
+    Iterator& operator=(const Iterator& x) = default;
+
+    bool operator==(const Iterator& x) const {
+      return tree_ ? node_ == x.node_ : entry_ == x.entry_;
+    }
+
+    bool operator!=(const Iterator& x) const { return !operator==(x); }
+
+    reference operator*() const { return *operator->(); }
+
+    // Only the child, never the key, may be changed through a tree node.
+    pointer operator->() const {
+      return tree_ ? const_cast<pointer>(&*node_) : entry_;
+    }
+
+    Iterator& operator++() {
+      if (tree_) {
+        ++node_;
+      } else {
+        ++entry_;
+      }
+      return *this;
+    }
+
+    Iterator& operator--() {
+      if (tree_) {
+        --node_;
+      } else {
+        --entry_;
+      }
+      return *this;
+    }
+
+    Iterator operator++(int) {
+      Iterator temp = *this;
+      operator++();
+      return temp;
+    }
+
+    Iterator operator--(int) {
+      Iterator temp = *this;
+      operator--();
+      return temp;
+    }
+
+   private:
+    explicit Iterator(pointer entry) : entry_(entry) {}
+
+    explicit Iterator(TreeNode node) : node_(node), tree_(true) {}
+
+    pointer entry_ = nullptr;
+    TreeNode node_{};
+    bool tree_ = false;
+  };
+
+  typedef Iterator<value_type> iterator;
+  typedef Iterator<const value_type> const_iterator;
+
+  static constexpr size_t kHashThreshold = 64;
+
+  // Only the storage the policy wants is built, an adaptive map starts
+  // as a sorted vector.
+  ChildMap(ChildPolicy policy, std::pmr::memory_resource* resource)
+      : policy_(policy),
+        tree_(policy == CHILD_MAP || policy == CHILD_HASH) {
+    if (tree_) {
+      ::new (&nodes_) TreeSet(resource);
+    } else {
+      ::new (&entries_) EntryVector(resource);
+    }
+  }
+
+  // Copies the entries and rebuilds the index, the children are not
+  // copied.
+  ChildMap(const ChildMap& x, std::pmr::memory_resource* resource)
+      : policy_(x.policy_), tree_(x.tree_) {
+    if (tree_) {
+      ::new (&nodes_) TreeSet(x.nodes_, resource);
+    } else {
+      ::new (&entries_) EntryVector(x.entries_, resource);
+    }
+    rebuildIndex();
+  }
+
+  ChildMap(const ChildMap&) = delete;
+
+  ChildMap& operator=(const ChildMap&) = delete;
+
+  ~ChildMap() {
+    freeIndex();
+    if (tree_) {
+      nodes_.~TreeSet();
+    } else {
+      entries_.~EntryVector();
+    }
+  }
+
+  std::pmr::memory_resource* resource() const {
+    return tree_ ? nodes_.get_allocator().resource()
+                 : entries_.get_allocator().resource();
+  }
+
+  // A map is shared by the copies of the node that made it, see
+  // RecTree::ownChildren.
+  bool shared() const { return owners_.load(std::memory_order_acquire) > 1; }
+
+  void share() { owners_.fetch_add(1, std::memory_order_relaxed); }
+
+  // Returns whether the last owner let go.
+  bool release() {
+    return owners_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+  }
+
+  ChildPolicy policy() const { return policy_; }
+
+  void setPolicy(ChildPolicy policy) {
+    policy_ = policy;
+    relayout();
+  }
+
+  size_t size() const { return tree_ ? nodes_.size() : entries_.size(); }
+
+  bool empty() const { return size() == 0; }
+
+  iterator begin() {
+    return tree_ ? iterator(nodes_.begin()) : iterator(entries_.data());
+  }
+
+  const_iterator begin() const {
+    return const_cast<ChildMap*>(this)->begin();
+  }
+
+  iterator end() {
+    return tree_ ? iterator(nodes_.end())
+                 : iterator(entries_.data() + entries_.size());
+  }
+
+  const_iterator end() const { return const_cast<ChildMap*>(this)->end(); }
+
+  iterator lower_bound(const KeyType& key) {
+    if (tree_) {
+      return iterator(nodes_.lower_bound(key));
+    }
+    return iterator(std::lower_bound(
+        entries_.data(), entries_.data() + entries_.size(), key,
+        [](const value_type& entry, const KeyType& key) {
+          return entry.first < key;
+        }));
+  }
+
+  const_iterator find(const KeyType& key) const {
+    return const_cast<ChildMap*>(this)->find(key);
+  }
+
+  iterator find(const KeyType& key) {
+    if (indexed()) {
+      const size_t hash = hashKey(key);
+      for (size_t slot = hash & mask();; slot = (slot + 1) & mask()) {
+        if (!slots_[slot].used) return end();
+        if (slots_[slot].hash == static_cast<uint32_t>(hash) &&
+            slots_[slot].node->first == key) {
+          return iterator(slots_[slot].node);
+        }
+      }
+    }
+    if (tree_) {
+      return iterator(nodes_.find(key));
+    }
+    iterator pos = lower_bound(key);
+    return pos != end() && pos->first == key ? pos : end();
+  }
+
+  RecTree* at(const KeyType& key) const {
+    const_iterator pos = find(key);
+    if (pos == end()) {
+      throw std::out_of_range("ChildMap::at");
+    }
+    return pos->second;
+  }
+
+  // `pos` of another map, e.g. the one this map was copied from, as a
+  // position in this one.
+  iterator rebase(const_iterator pos, const ChildMap& from) {
+    if (&from == this) {
+      iterator ret;
+      ret.entry_ = const_cast<value_type*>(pos.entry_);
+      ret.node_ = pos.node_;
+      ret.tree_ = pos.tree_;
+      return ret;
+    }
+    return pos == from.end() ? end() : find(pos->first);
+  }
+
+  // `pos` must be where `key` keeps the order, e.g. lower_bound.
+  iterator emplace_hint(iterator pos, const KeyType& key, RecTree* tree) {
+    if (tree_) {
+      TreeNode node = nodes_.emplace_hint(pos.node_, key, tree);
+      if (policy_ != CHILD_MAP) {
+        if (nodes_.size() * 2 > slotCount()) {
+          rebuildIndex();
+        } else {
+          insertSlot(node);
+        }
+      }
+      return iterator(node);
+    }
+    const size_t index = pos.entry_ - entries_.data();
+    entries_.emplace(entries_.begin() + index, key, tree);
+    if (wantTree()) {
+      relayout();
+      return find(key);
+    }
+    return iterator(entries_.data() + index);
+  }
+
+  iterator erase(const_iterator pos) { return erase(pos, std::next(pos)); }
+
+  iterator erase(const_iterator first, const_iterator last) {
+    if (!tree_) {
+      const size_t index = first.entry_ - entries_.data();
+      entries_.erase(entries_.begin() + index,
+                     entries_.begin() + (last.entry_ - entries_.data()));
+      return iterator(entries_.data() + index);
+    }
+    if (indexed()) {
+      for (TreeNode node = first.node_; node != last.node_; ++node) {
+        eraseSlot(node);
+      }
+    }
+    iterator next(nodes_.erase(first.node_, last.node_));
+    if (wantTree()) {
+      return next;
+    }
+    // An adaptive map shrank below the threshold.
+    if (next == end()) {
+      relayout();
+      return end();
+    }
+    KeyType key = next->first;
+    relayout();
+    return find(key);
+  }
+
+  void clear() {
+    if (tree_) {
+      nodes_.clear();
+    } else {
+      entries_.clear();
+    }
+    relayout();
+  }
+
+  void reserve(size_t size) {
+    if (!tree_) entries_.reserve(size);
+  }
+
+  // Appends without keeping the order, sortFrom must follow before any
+  // other use.
+  void push_back(const KeyType& key, RecTree* tree) {
+    if (tree_) {
+      nodes_.emplace_hint(nodes_.end(), key, tree);
+    } else {
+      entries_.emplace_back(key, tree);
+    }
+  }
+
+  // Sorts what was appended from `first` on and merges it into the sorted
+  // part. The keys must all be distinct.
+  void sortFrom(size_t first) {
+    if (tree_) {
+      rebuildIndex();
+      return;
+    }
+    auto less = [](const value_type& left, const value_type& right) {
+      return left.first < right.first;
+    };
+    // Already sorted input, e.g. a binary tree, skips both steps.
+    if (!std::is_sorted(entries_.begin() + first, entries_.end(), less)) {
+      std::sort(entries_.begin() + first, entries_.end(), less);
+    }
+    if (first != 0 && first != entries_.size() &&
+        less(entries_[first], entries_[first - 1])) {
+      std::inplace_merge(entries_.begin(), entries_.begin() + first,
+                         entries_.end(), less);
+    }
+    relayout();
+  }
+
+ private:
+  // A slot points at a tree node, which never moves, so inserting or
+  // erasing a child only touches its own slot.
+  struct Slot {
+    TreeNode node;
+    uint32_t hash;
+    bool used;
+  };
+
+  static size_t hashKey(const KeyType& key) {
+    return std::hash<std::string_view>()(key.constRefer());
+  }
+
+  bool indexed() const { return slotShift_ != 0; }
+
+  size_t slotCount() const { return indexed() ? size_t(1) << slotShift_ : 0; }
+
+  size_t mask() const { return slotCount() - 1; }
+
+  bool wantTree() const {
+    switch (policy_) {
+      case CHILD_FLAT:
+        return false;
+      case CHILD_ADAPTIVE:
+        // Hysteresis, so a node at the threshold does not flip on every
+        // insert and erase.
+        return size() >= (tree_ ? kHashThreshold / 2 : kHashThreshold);
+      default:
+        return true;
+    }
+  }
+
+  // Moves the children to the storage the policy wants for the current
+  // size and rebuilds the index.
+  void relayout() {
+    const bool tree = wantTree();
+    if (tree && !tree_) {
+      TreeSet nodes(resource());
+      for (auto& entry : entries_) {
+        nodes.emplace_hint(nodes.end(), std::move(entry));
+      }
+      entries_.~EntryVector();
+      ::new (&nodes_) TreeSet(std::move(nodes));
+    } else if (!tree && tree_) {
+      EntryVector entries(resource());
+      entries.reserve(nodes_.size());
+      entries.assign(nodes_.begin(), nodes_.end());
+      nodes_.~TreeSet();
+      ::new (&entries_) EntryVector(std::move(entries));
+    }
+    tree_ = tree;
+    rebuildIndex();
+  }
+
+  // Sized for a load factor of at most 1/4, so the index grows after
+  // doubling in size, O(1) amortized per insert.
+  void rebuildIndex() {
+    freeIndex();
+    if (!tree_ || policy_ == CHILD_MAP) {
+      return;
+    }
+    uint8_t shift = 4;
+    for (; (size_t(1) << shift) < nodes_.size() * 4; ++shift) {
+    }
+    const size_t capacity = size_t(1) << shift;
+    slots_ = static_cast<Slot*>(
+        resource()->allocate(capacity * sizeof(Slot), alignof(Slot)));
+    std::uninitialized_fill_n(slots_, capacity, Slot{TreeNode(), 0, false});
+    slotShift_ = shift;
+    for (TreeNode node = nodes_.begin(); node != nodes_.end(); ++node) {
+      insertSlot(node);
+    }
+  }
+
+  void freeIndex() {
+    if (indexed()) {
+      resource()->deallocate(slots_, slotCount() * sizeof(Slot),
+                             alignof(Slot));
+      slots_ = nullptr;
+      slotShift_ = 0;
+    }
+  }
+
+  void insertSlot(TreeNode node) {
+    const size_t hash = hashKey(node->first);
+    size_t slot = hash & mask();
+    for (; slots_[slot].used; slot = (slot + 1) & mask()) {
+    }
+    slots_[slot] = Slot{node, static_cast<uint32_t>(hash), true};
+  }
+
+  // Backward shift deletion, so lookups never meet a tombstone.
+  void eraseSlot(TreeNode node) {
+    size_t hole = hashKey(node->first) & mask();
+    for (; !slots_[hole].used || slots_[hole].node != node;
+         hole = (hole + 1) & mask()) {
+    }
+    for (size_t slot = (hole + 1) & mask(); slots_[slot].used;
+         slot = (slot + 1) & mask()) {
+      const size_t home = slots_[slot].hash & mask();
+      // Moves the entry back unless its home lies in (hole, slot].
+      if (((slot - home) & mask()) >= ((slot - hole) & mask())) {
+        slots_[hole] = slots_[slot];
+        hole = slot;
+      }
+    }
+    slots_[hole].used = false;
+  }
+
+ private:
+  // Only one of them is alive, nodes_ when tree_ is set.
+  union {
+    EntryVector entries_;
+    TreeSet nodes_;
+  };
+  // The open-addressing index of a hashed tree, 1 << slotShift_ slots.
+  Slot* slots_ = nullptr;
+  std::atomic<uint32_t> owners_{1};
+  ChildPolicy policy_;
+  bool tree_;
+  uint8_t slotShift_ = 0;
+};
+
 struct RecTree_const_iterator {
   friend class RecTree;
 
@@ -148,7 +1053,7 @@ struct RecTree_const_iterator {
   typedef const value_type* pointer;
   typedef ptrdiff_t difference_type;
 
-  typedef typename std::map<KeyType, RecTree*>::iterator node_type;
+  typedef ChildMap::iterator node_type;
   typedef RecTree_const_iterator self;
 
   RecTree_const_iterator() = default;
@@ -219,7 +1124,8 @@ struct RecTree_iterator : public RecTree_const_iterator {
     return *this;
   }
 
-  reference operator*() const { return (*this->node_->second); }
+  // Clones the child first when a copy of the tree shares it.
+  reference operator*() const;
 
   pointer operator->() const { return (&(operator*())); }
 
@@ -246,86 +1152,357 @@ struct RecTree_iterator : public RecTree_const_iterator {
   }
 };
 
+// A read-only view of a node's number column.
+template <typename T>
+class NumberSpan {
+ public:
+  typedef T value_type;
+  typedef const T* iterator;
+  typedef const T* const_iterator;
+
+  NumberSpan() = default;
+
+  NumberSpan(const T* data, size_t size) : data_(data), size_(size) {}
+
+  const T* data() const { return data_; }
+
+  size_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+  const T& operator[](size_t index) const { return data_[index]; }
+
+  const T* begin() const { return data_; }
+
+  const T* end() const { return data_ + size_; }
+
+ private:
+  const T* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+class BorrowedNode;
+class BorrowedTree;
+class ConcurrentTree;
+class DbLispBinary;
 class DbLispParser;
 
 class RecTree {
+  friend struct RecTree_iterator;
+  friend class BorrowedNode;
+  friend class BorrowedTree;
+  friend class ConcurrentTree;
   friend class DbLispParser;
+  friend class DbLispBinary;
 
  public:
   using key_type = KeyType;
   using link_type = RecTree*;
-  enum VALUE_TYPE { VALUE, VALUE_VECTOR, RECTREE, INITAL };
+  using value_vector = std::pmr::vector<ValType>;
+  using children_map = ChildMap;
+  using int64_vector = std::pmr::vector<int64_t>;
+  using double_vector = std::pmr::vector<double>;
+  // INT64_VECTOR and DOUBLE_VECTOR are value vectors stored as a number
+  // column, see packNumbers.
+  enum VALUE_TYPE : uint8_t {
+    VALUE,
+    VALUE_VECTOR,
+    RECTREE,
+    INITAL,
+    INT64_VECTOR,
+    DOUBLE_VECTOR
+  };
+  // A single value and the header of a value vector live in the node
+  // itself, only a map of children is allocated separately. valueStatus_
+  // says which member is alive. Every member carries the node's resource,
+  // an empty node keeps it in resource_, see RecTree::resource.
   union value_type {
-    ValType* value_;
-    std::vector<ValType>* valueVec_;
-    std::map<key_type, link_type>* children_;
+    explicit value_type(std::pmr::memory_resource* resource =
+                            std::pmr::get_default_resource())
+        : resource_(resource) {}
+    ~value_type() {}
+
+    ValType value_;
+    value_vector valueVec_;
+    int64_vector int64Vec_;
+    double_vector doubleVec_;
+    children_map* children_;
+    std::pmr::memory_resource* resource_;
   };
 
+  // Room reserved when a node gets its second value, enough for most
+  // vectors to never reallocate.
+  static constexpr size_t kSmallVector = 4;
+
  public:
   typedef RecTree_iterator iterator;
   typedef RecTree_const_iterator const_iterator;
 
-  typedef std::map<key_type, link_type>::iterator map_iterator;
-  typedef std::map<key_type, link_type>::const_iterator map_const_iterator;
+  typedef children_map::iterator map_iterator;
+  typedef children_map::const_iterator map_const_iterator;
 
  public:
-  RecTree() : key_(), valueStatus_(INITAL) { nodeValue_.children_ = nullptr; }
+  RecTree() : key_(), valueStatus_(INITAL) {}
 
   ~RecTree() { clear(); }
 
-  explicit RecTree(const std::string& key) : key_(key), valueStatus_(INITAL) {
-    nodeValue_.children_ = nullptr;
-  }
+  // Every node, key, value and child map of the tree is allocated from
+  // `resource`, which must outlive the tree. Like the std::pmr containers,
+  // a copy uses the default resource and a move keeps the source's one.
+  // With a `keyPool` every key of the tree is interned in it instead.
+  //
+  // A copy is independent of its source. A ShareTag copy with the same
+  // resource and key pool shares the key and the map of children of the
+  // source instead, so copying a subtree is O(1). Both trees clone a
+  // shared map, and then a shared child, the first time they reach it
+  // through a non-const function. A clone copies every entry of the map
+  // and counts one more reference on each child, so the first change
+  // along a path costs the sum of the fanouts of the nodes on it, not
+  // just the nodes themselves; later changes there copy nothing. Const
+  // functions never change a node. A reference into the source taken
+  // before a ShareTag copy bypasses the cloning, so it must not be used
+  // to change the source afterwards.
+  explicit RecTree(const std::string& key,
+                   std::pmr::memory_resource* resource =
+                       std::pmr::get_default_resource(),
+                   KeyPool* keyPool = nullptr)
+      : key_(makeKey(key, resource, keyPool)),
+        nodeValue_(resource),
+        valueStatus_(INITAL) {}
 
   RecTree(RecTree&& x)
       : key_(std::move(x.key_)),
-        nodeValue_(x.nodeValue_),
-        valueStatus_(x.valueStatus_) {
-    x.valueStatus_ = INITAL;
-    x.nodeValue_.children_ = nullptr;
+        valueStatus_(INITAL),
+        childPolicy_(x.childPolicy_) {
+    takeNodeValue(x);
   }
 
   RecTree(const RecTree& x) { copy(x); }
 
-  RecTree& operator=(RecTree x) {
-    swap(x);
+  RecTree(const RecTree& x, std::pmr::memory_resource* resource,
+          KeyPool* keyPool = nullptr)
+      : key_(x.sameStorage(resource, keyPool)
+                 ? x.key_
+                 : makeKey(x.refRealKey(), resource, keyPool)),
+        nodeValue_(resource) {
+    copyValue(x, false);
+  }
+
+  // Picks the copy constructors that share the subtrees of the source.
+  struct ShareTag {};
+
+  RecTree(const RecTree& x, ShareTag)
+      : RecTree(x, ShareTag(), x.resource(), x.keyPool()) {}
+
+  // Shares nothing, like a plain copy, unless `x` uses `resource` and
+  // `keyPool`.
+  RecTree(const RecTree& x, ShareTag, std::pmr::memory_resource* resource,
+          KeyPool* keyPool = nullptr)
+      : key_(x.sameStorage(resource, keyPool)
+                 ? x.key_
+                 : makeKey(x.refRealKey(), resource, keyPool)),
+        nodeValue_(resource) {
+    copyValue(x, true);
+  }
+
+  // Steals the contents of `x` when it uses `resource` and `keyPool`,
+  // copies them otherwise.
+  RecTree(RecTree&& x, std::pmr::memory_resource* resource,
+          KeyPool* keyPool = nullptr)
+      : key_(x.sameStorage(resource, keyPool)
+                 ? x.key_
+                 : makeKey(x.refRealKey(), resource, keyPool)),
+        nodeValue_(resource),
+        valueStatus_(INITAL) {
+    if (x.sameStorage(resource, keyPool)) {
+      takeNodeValue(x);
+      std::swap(childPolicy_, x.childPolicy_);
+    } else {
+      copyValue(x, false);
+    }
+  }
+
+  // Assignment keeps this tree's resource and key pool.
+  RecTree& operator=(const RecTree& x) {
+    RecTree temp(x, resource(), keyPool());
+    swap(temp);
     return *this;
   }
 
+  RecTree& operator=(RecTree&& x) {
+    RecTree temp(std::move(x), resource(), keyPool());
+    swap(temp);
+    return *this;
+  }
+
+  // Exchanges the resources and key pools too.
   void swap(RecTree& x) noexcept {
     key_.swap(x.key_);
-    std::swap(nodeValue_, x.nodeValue_);
-    std::swap(valueStatus_, x.valueStatus_);
+    RecTree temp;
+    temp.takeNodeValue(x);
+    x.takeNodeValue(*this);
+    takeNodeValue(temp);
+    std::swap(childPolicy_, x.childPolicy_);
   }
 
-  std::ostream& formatLisp(std::ostream& outStream) const {
-    outStream << formatLisp();
+  // Read from the value or the map the node holds, the node does not
+  // store it apart.
+  std::pmr::memory_resource* resource() const {
+    switch (valueStatus_) {
+      case VALUE:
+        return refValue().resource_;
+      case VALUE_VECTOR:
+        return refValVector().get_allocator().resource();
+      case INT64_VECTOR:
+        return nodeValue_.int64Vec_.get_allocator().resource();
+      case DOUBLE_VECTOR:
+        return nodeValue_.doubleVec_.get_allocator().resource();
+      case RECTREE:
+        return refChildren().resource();
+      default:
+        return nodeValue_.resource_;
+    }
+  }
+
+  KeyPool* keyPool() const { return key_.keyPool(); }
+
+  ChildPolicy childPolicy() const { return childPolicy_; }
+
+  // Applies to the whole subtree and to the nodes later created in it.
+  void setChildPolicy(ChildPolicy policy) {
+    childPolicy_ = policy;
+    if (isTree()) {
+      ownChildren().setPolicy(policy);
+      for (auto pos = refChildren().begin(); pos != refChildren().end();
+           ++pos) {
+        ownChild(pos)->setChildPolicy(policy);
+      }
+    }
+  }
+
+  using FormatMode = DbLispWriter::FormatMode;
+
+  std::ostream& formatLisp(
+      std::ostream& outStream,
+      FormatMode mode = DbLispWriter::FORMAT_INDENTED) const {
+    DbLispWriter writer(outStream, mode);
+    formatLisp(writer);
     return outStream;
   }
 
-  std::string formatLisp() const {
+  std::string formatLisp(
+      FormatMode mode = DbLispWriter::FORMAT_INDENTED) const {
     std::string lispStr;
-    formatLisp(this, 0, lispStr);
+    DbLispWriter writer(lispStr, mode);
+    formatLisp(writer);
     return lispStr;
   }
 
-  const std::vector<ValType>& valueVector() const {
-    if (isSingleValue()) const_cast<link_type>(this)->moveValToVec();
-    return refValVector();
+  // Streams the tree through `writer` and flushes it, returns whether
+  // every byte reached the sink.
+  bool formatLisp(DbLispWriter& writer) const {
+    formatLisp(this, 0, writer);
+    return writer.flush();
   }
 
-  std::vector<ValType>& valueVector() {
+  // Replaces `fileName` atomically, see DbLispWriter::saveToFile.
+  bool saveToFile(const std::string& fileName,
+                  FormatMode mode = DbLispWriter::FORMAT_INDENTED) const {
+    return DbLispWriter::saveToFile(
+        fileName, mode, [this](DbLispWriter& writer) {
+          formatLisp(this, 0, writer);
+          return writer.good();
+        });
+  }
+
+  // A single value or a number column is left as it is, its values are
+  // copied once into a vector kept in a side table, see valueText.
+  const value_vector& valueVector() const {
+    if (!isSingleValue() && !isNumberVector()) return refValVector();
+    return valueText();
+  }
+
+  // Turns a single value or a number column into a vector of values.
+  value_vector& valueVector() {
+    freeValueText();
     if (isSingleValue()) moveValToVec();
+    if (isNumberVector()) unpackNumbers();
     return refValVector();
   }
 
+  // Stores a value vector as an int64 column when every value is an
+  // integer written the way std::to_chars writes it, or else as a double
+  // column when every value is a number std::to_chars writes back
+  // unchanged, so the text can always be recovered. Integers are parsed
+  // by the DbLispScanner number kernel. Returns whether the node holds a
+  // number column now.
+  //
+  // The non-const valueVector() and value() and pushValue() of a text turn
+  // the column back into values, so a number column is best read through
+  // the spans.
+  bool packNumbers() {
+    if (isNumberVector()) {
+      return true;
+    }
+    if (valueStatus_ != VALUE_VECTOR || refValVector().empty()) {
+      return false;
+    }
+    const value_vector& values = refValVector();
+    int64_vector int64Vec(allocator());
+    int64Vec.resize(values.size());
+    size_t index = 0;
+    for (; index != values.size(); ++index) {
+      std::string_view val = values[index].asStringView();
+      if (!DbLispScanner::parseInt64(val.data(), val.data() + val.size(),
+                                     int64Vec[index])) {
+        break;
+      }
+    }
+    if (index == values.size()) {
+      freeValVector();
+      ::new (&nodeValue_.int64Vec_) int64_vector(std::move(int64Vec));
+      valueStatus_ = INT64_VECTOR;
+      return true;
+    }
+    double_vector doubleVec(allocator());
+    doubleVec.reserve(values.size());
+    char text[kNumberText];
+    for (const auto& value : values) {
+      std::string_view val = value.asStringView();
+      double number;
+      auto result =
+          std::from_chars(val.data(), val.data() + val.size(), number);
+      if (result.ec != std::errc() || result.ptr != val.data() + val.size() ||
+          numberText(number, text) != val) {
+        return false;
+      }
+      doubleVec.push_back(number);
+    }
+    freeValVector();
+    ::new (&nodeValue_.doubleVec_) double_vector(std::move(doubleVec));
+    valueStatus_ = DOUBLE_VECTOR;
+    return true;
+  }
+
+  // Empty unless the node holds an int64 column.
+  NumberSpan<int64_t> asInt64Span() const {
+    if (valueStatus_ != INT64_VECTOR) return {};
+    return {nodeValue_.int64Vec_.data(), nodeValue_.int64Vec_.size()};
+  }
+
+  // Empty unless the node holds a double column.
+  NumberSpan<double> asDoubleSpan() const {
+    if (valueStatus_ != DOUBLE_VECTOR) return {};
+    return {nodeValue_.doubleVec_.data(), nodeValue_.doubleVec_.size()};
+  }
+
   key_type key() const { return key_; }
 
-  iterator begin() { return refChildren().begin(); }
+  iterator begin() { return ownChildren().begin(); }
 
   const_iterator begin() const { return refChildren().begin(); }
 
-  iterator end() { return refChildren().end(); }
+  iterator end() { return ownChildren().end(); }
 
   const_iterator end() const { return refChildren().end(); }
 
@@ -333,41 +1510,50 @@ class RecTree {
 
   const_iterator cend() const { return refChildren().end(); }
 
-  iterator erase(const_iterator pos) {
-    freeTree(pos.node_->second);
-    return refChildren().erase(pos.node_);
-  }
+  iterator erase(const_iterator pos) { return erase(pos, std::next(pos)); }
 
   size_t erase(const std::string& key) {
-    iterator pos = find(key);
-    if (pos == end()) return 0;
-    erase(pos);
+    children_map& children = ownChildren();
+    map_iterator pos = children.find(key_type::borrow(key));
+    if (pos == children.end()) return 0;
+    freeTree(pos->second);
+    children.erase(pos);
     return 1;
   }
 
+  // The iterators may come from the map before it was owned.
   iterator erase(const_iterator first, const_iterator last) {
-    for (auto pos = first; pos != last; ++pos) {
-      freeTree(pos.node_->second);
+    const children_map& from = refChildren();
+    children_map& children = ownChildren();
+    map_iterator firstPos = children.rebase(first.node_, from);
+    map_iterator lastPos = children.rebase(last.node_, from);
+    for (map_iterator pos = firstPos; pos != lastPos; ++pos) {
+      freeTree(pos->second);
     }
-    return refChildren().erase(first.node_, last.node_);
+    return children.erase(firstPos, lastPos);
   }
 
   const_iterator find(const std::string& key) const {
-    return refChildren().find(key_type(key));
+    return refChildren().find(key_type::borrow(key));
   }
 
   iterator find(const std::string& key) {
-    return refChildren().find(key_type(key));
+    return ownChildren().find(key_type::borrow(key));
   }
 
   bool empty() const { return size() == 0; }
 
   const RecTree& at(const std::string& key) const {
-    return *refChildren().at(key_type(key));
+    return *refChildren().at(key_type::borrow(key));
   }
 
   RecTree& at(const std::string& key) {
-    return *refChildren().at(key_type(key));
+    children_map& children = ownChildren();
+    map_iterator pos = children.find(key_type::borrow(key));
+    if (pos == children.end()) {
+      throw std::out_of_range("ChildMap::at");
+    }
+    return *ownChild(pos);
   }
 
   size_t count() const { return count(this); }
@@ -394,60 +1580,29 @@ class RecTree {
 
   template <typename... types>
   std::pair<iterator, bool> emplace(const std::string& key, types&&... args) {
-    std::pair<map_iterator, bool> prIB;
-    switch (valueStatus_) {
-      case VALUE:
-        freeValue();
-        break;
-      case VALUE_VECTOR:
-        freeValVector();
-        break;
-      case RECTREE:
-        prIB = refChildren().emplace(key, nullptr);
-        if (prIB.second) {
-          prIB.first->second =
-              createTree(prIB.first->first, std::forward<types>(args)...);
-        }
-        return {prIB.first, prIB.second};
-        break;
-      default:;
+    map_iterator pos;
+    if (prepareChild(key_type::borrow(key), pos)) {
+      return {pos, false};
     }
-    valueStatus_ = RECTREE;
-    nodeValue_.children_ = createChildren();
-    link_type linkTree = createTree(key, std::forward<types>(args)...);
-    prIB = refChildren().emplace(linkTree->key_, linkTree);
-    return {prIB.first, prIB.second};
+    link_type tree = createTree(key, std::forward<types>(args)...);
+    tree->childPolicy_ = childPolicy_;
+    return {emplaceChild(pos, tree), true};
   }
 
   template <typename RecType>
   std::pair<map_iterator, bool> emplace(RecType&& recTree) {
-    std::pair<map_iterator, bool> prIB;
-    switch (valueStatus_) {
-      case VALUE:
-        freeValue();
-        break;
-      case VALUE_VECTOR:
-        freeValVector();
-        break;
-      case RECTREE:
-        prIB = refChildren().emplace(recTree.key_, nullptr);
-        if (prIB.second) {
-          prIB.first->second = createTree(std::forward<RecType>(recTree));
-        }
-        return {prIB.first, prIB.second};
-        break;
-      default:;
+    map_iterator pos;
+    if (prepareChild(recTree.key_, pos)) {
+      return {pos, false};
     }
-    valueStatus_ = RECTREE;
-    nodeValue_.children_ = createChildren();
-    prIB = refChildren().emplace(recTree.key_,
-                                 createTree(std::forward<RecType>(recTree)));
-    return {prIB.first, prIB.second};
+    return {emplaceChild(pos, createTree(std::forward<RecType>(recTree))),
+            true};
   }
 
   RecTree& operator[](const std::string& key) { return *(emplace(key).first); }
 
   void clear() {
+    std::pmr::memory_resource* resource = this->resource();
     switch (valueStatus_) {
       case VALUE:
         this->freeValue();
@@ -455,42 +1610,68 @@ class RecTree {
       case VALUE_VECTOR:
         this->freeValVector();
         break;
+      case INT64_VECTOR:
+      case DOUBLE_VECTOR:
+        this->freeNumberVector();
+        break;
       case RECTREE:
         this->clearChildren();
         break;
       default:;
     }
-    valueStatus_ = INITAL;
+    setInitial(resource);
+  }
+
+  // Forgets the contents without freeing them, which makes dropping a
+  // large tree O(1). Only for trees whose resource frees everything at
+  // once, e.g. a std::pmr::monotonic_buffer_resource released right after.
+  // The value texts built in the subtree below stay in the side table of
+  // valueText until their nodes' addresses are reused.
+  void release() {
+    if (hasText_.load(std::memory_order_relaxed)) {
+      eraseText();
+    }
+    setInitial(resource());
   }
 
  public:
-  ValType& value(const size_t index = 0) const {
-    if (isSingleValue()) {
-      if (index == 0) {
-        return refValue();
-      }
+  const ValType& value(const size_t index = 0) const {
+    if (isSingleValue() && index == 0) {
+      return refValue();
     }
-    return (*nodeValue_.valueVec_)[index];
+    return valueVector()[index];
+  }
+
+  ValType& value(const size_t index = 0) {
+    freeValueText();
+    if (isSingleValue() && index == 0) {
+      return refValue();
+    }
+    return valueVector()[index];
   }
 
   bool isValue() const {
-    return isSingleValue() || valueStatus_ == VALUE_VECTOR;
+    return isSingleValue() || valueStatus_ == VALUE_VECTOR ||
+           isNumberVector();
   }
 
   bool isMap() const { return isTree(); }
 
-  void pushValue(const std::string& val) {
+  void pushValue(std::string_view val) {
     switch (valueStatus_) {
       case VALUE:
         moveValToVec();
       case VALUE_VECTOR:
+      case INT64_VECTOR:
+      case DOUBLE_VECTOR:
+        if (isNumberVector()) unpackNumbers();
         refValVector().emplace_back(val);
         return;
         break;
       default:;
     }
     clearNodeValue();
-    nodeValue_.value_ = createValue(val);
+    createValue(val);
     valueStatus_ = VALUE;
   }
 
@@ -498,7 +1679,7 @@ class RecTree {
   template <typename Iter>
   void assign(Iter begin, Iter end) {
     clearNodeValue();
-    nodeValue_.valueVec_ = createValVector(begin, end);
+    createValVector(begin, end);
     valueStatus_ = VALUE_VECTOR;
   }
 
@@ -513,6 +1694,8 @@ class RecTree {
       case INITAL:
       case VALUE:
       case VALUE_VECTOR:
+      case INT64_VECTOR:
+      case DOUBLE_VECTOR:
         ret = 1;
         break;
       case RECTREE:
@@ -533,56 +1716,59 @@ class RecTree {
 
  private:
   bool formatLisp(const RecTree* const tPtr, size_t preSpaceCount,
-                  std::string& lispStr) const {
-    std::string lispVal;
+                  DbLispWriter& writer) const {
     bool newline = false;
     size_t spaceCount = preSpaceCount;
+    size_t keySize;
     switch (tPtr->valueStatus_) {
       case INITAL:
-        lispStr.append("(")
-            .append(toLispVal(tPtr->refRealKey()))
-            .push_back(')');
+        writer.put('(');
+        writer.writeQuoted(tPtr->refRealKey());
+        writer.put(')');
         break;
       case VALUE:
-        lispStr.append("(")
-            .append(toLispVal(tPtr->refRealKey()))
-            .append(" ")
-            .append(toLispVal(tPtr->refRealVal()))
-            .push_back(')');
-        break;
       case VALUE_VECTOR:
-        lispStr.append("(").append(toLispVal(tPtr->refRealKey()));
-        for (const auto& val : tPtr->refValVector()) {
-          lispStr.append(" ").append(toLispVal(val));
-        }
-        lispStr.push_back(')');
+      case INT64_VECTOR:
+      case DOUBLE_VECTOR:
+        writer.put('(');
+        writer.writeQuoted(tPtr->refRealKey());
+        tPtr->visitValues([&writer](std::string_view val) {
+          writer.put(' ');
+          writer.writeQuoted(val);
+        });
+        writer.put(')');
         break;
       case RECTREE:
-        lispVal = toLispVal(tPtr->refRealKey());
-        lispStr.append("(").append(lispVal).push_back(' ');
+        writer.put('(');
+        keySize = writer.writeQuoted(tPtr->refRealKey());
+        writer.put(' ');
         if (tPtr->empty()) {
-          lispStr.push_back(')');
+          writer.put(')');
         } else if (tPtr->size() == 1) {
-          preSpaceCount += lispVal.size() + 2;
+          preSpaceCount += keySize + 2;
           newline = (formatLisp(tPtr->begin().node_->second, preSpaceCount,
-                                lispStr) ||
+                                writer) ||
                      newline);
-          if (newline) {
-            lispStr.push_back('\n');
-            lispStr.append(std::string(spaceCount, ' '));
+          if (newline && !writer.compact()) {
+            writer.newline(spaceCount);
           }
-          lispStr.push_back(')');
+          writer.put(')');
         } else {
           newline = true;
-          preSpaceCount += lispVal.size() + 2;
-          formatLisp(tPtr->begin().node_->second, preSpaceCount, lispStr);
+          preSpaceCount += keySize + 2;
+          formatLisp(tPtr->begin().node_->second, preSpaceCount, writer);
           for (auto iter = ++tPtr->begin(); iter != tPtr->end(); ++iter) {
-            lispStr.push_back('\n');
-            lispStr.append(std::string(preSpaceCount, ' '));
-            formatLisp(iter.node_->second, preSpaceCount, lispStr);
+            if (writer.compact()) {
+              writer.put(' ');
+            } else {
+              writer.newline(preSpaceCount);
+            }
+            formatLisp(iter.node_->second, preSpaceCount, writer);
           }
-          lispStr.push_back('\n');
-          lispStr.append(std::string(spaceCount, ' ')).push_back(')');
+          if (!writer.compact()) {
+            writer.newline(spaceCount);
+          }
+          writer.put(')');
         }
         break;
       default:;
@@ -590,54 +1776,118 @@ class RecTree {
     return newline;
   }
 
-  std::string toLispVal(const std::string& originVal) const {
-    std::string val("\"");
-    val.reserve(originVal.size());
-    for (const auto& c : originVal) {
-      if (c == '"') {
-        val.append("\\\"");
-      } else {
-        val.push_back(c);
-      }
-    }
-    val.push_back('"');
-    return val;
-  }
-
   bool isTree() const { return valueStatus_ == RECTREE; }
 
   void moveValToVec() {
-    ValType tempVal = std::move(*nodeValue_.value_);
-    freeValue();
-    nodeValue_.valueVec_ = createValVector();
-    nodeValue_.valueVec_->emplace_back(std::move(tempVal));
+    ValType tempVal = std::move(refValue());
+    clearNodeValue();
+    createValVector();
+    refValVector().reserve(kSmallVector);
+    refValVector().emplace_back(std::move(tempVal));
     valueStatus_ = VALUE_VECTOR;
   }
 
   bool isSingleValue() const { return valueStatus_ == VALUE; }
 
+  bool isNumberVector() const {
+    return valueStatus_ == INT64_VECTOR || valueStatus_ == DOUBLE_VECTOR;
+  }
+
+  // Longest text std::to_chars writes for an int64 or a double.
+  static constexpr size_t kNumberText = 32;
+
+  template <typename Number>
+  static std::string_view numberText(Number number, char* text) {
+    return std::string_view(
+        text, std::to_chars(text, text + kNumberText, number).ptr - text);
+  }
+
+  // Calls `visit` with the text of every value of a value node.
+  template <typename Visit>
+  void visitValues(Visit visit) const {
+    char text[kNumberText];
+    switch (valueStatus_) {
+      case VALUE:
+        visit(refRealVal());
+        break;
+      case VALUE_VECTOR:
+        for (const auto& val : refValVector()) visit(val.asStringView());
+        break;
+      case INT64_VECTOR:
+        for (int64_t val : nodeValue_.int64Vec_) visit(numberText(val, text));
+        break;
+      case DOUBLE_VECTOR:
+        for (double val : nodeValue_.doubleVec_) visit(numberText(val, text));
+        break;
+      default:;
+    }
+  }
+
+  void unpackNumbers() {
+    value_vector values(allocator());
+    values.reserve(std::max(asInt64Span().size(), asDoubleSpan().size()));
+    visitValues([&values](std::string_view val) { values.emplace_back(val); });
+    clearNodeValue();
+    createValVector(std::move(values));
+    valueStatus_ = VALUE_VECTOR;
+  }
+
+  void freeNumberVector() {
+    freeValueText();
+    if (valueStatus_ == INT64_VECTOR) {
+      nodeValue_.int64Vec_.~int64_vector();
+    } else {
+      nodeValue_.doubleVec_.~double_vector();
+    }
+  }
+
   link_type copy(const RecTree& x) {
 #ifdef _DBLISP_TEST_DEBUG_
     std::cout << "copy: " << x.key_ << std::endl;
 #endif
-    this->key_ = key_type(x.refRealKey());
-    this->valueStatus_ = x.valueStatus_;
+    this->key_ =
+        x.sameStorage(resource(), nullptr) ? x.key_ : makeKey(x.refRealKey());
+    return copyValue(x, false);
+  }
+
+  // This node is empty, its members are built from its resource before
+  // valueStatus_ says which one is alive.
+  link_type copyValue(const RecTree& x, bool share) {
+    this->childPolicy_ = x.childPolicy_;
     switch (x.valueStatus_) {
       case VALUE:
-        this->nodeValue_.value_ = this->createValue(x.refRealVal());
+        this->createValue(x.refRealVal());
         break;
       case VALUE_VECTOR:
-        this->nodeValue_.valueVec_ = this->createValVector(x.refValVector());
+        this->createValVector(x.refValVector());
+        break;
+      case INT64_VECTOR:
+        ::new (&nodeValue_.int64Vec_)
+            int64_vector(x.nodeValue_.int64Vec_, allocator());
+        break;
+      case DOUBLE_VECTOR:
+        ::new (&nodeValue_.doubleVec_)
+            double_vector(x.nodeValue_.doubleVec_, allocator());
         break;
       case RECTREE:
-        this->nodeValue_.children_ = this->copyChildren(x.refChildren());
+        if (share && x.sameStorage(resource(), keyPool())) {
+          x.refChildren().share();
+          this->nodeValue_.children_ = x.nodeValue_.children_;
+        } else {
+          this->nodeValue_.children_ = this->copyChildren(x.refChildren());
+        }
         break;
       default:;
     }
+    this->valueStatus_ = x.valueStatus_;
     return this;
   }
 
+  // Only the last node sharing the map frees the children.
   void clearChildren() {
+    if (!this->refChildren().release()) {
+      return;
+    }
     for (const auto& p : this->refChildren()) {
       freeTree(p.second);
     }
@@ -645,7 +1895,35 @@ class RecTree {
     this->freeChildren();
   }
 
+  // The map of children, cloned first when a copy of this node shares it.
+  // The clone shares the children in turn.
+  children_map& ownChildren() {
+    if (refChildren().shared()) {
+      children_map* children =
+          newObject<children_map>(refChildren(), resource());
+      for (const auto& p : *children) {
+        p.second->refs_.fetch_add(1, std::memory_order_relaxed);
+      }
+      clearChildren();
+      nodeValue_.children_ = children;
+    }
+    return refChildren();
+  }
+
+  // The child at `pos` of an owned map, cloned first when another map
+  // holds it too. The clone comes from the child's own resource, which is
+  // its parent's.
+  static link_type ownChild(map_iterator pos) {
+    link_type tree = pos->second;
+    if (tree->refs_.load(std::memory_order_acquire) > 1) {
+      pos->second = tree->createTree(*tree, ShareTag());
+      tree->freeTree(tree);
+    }
+    return pos->second;
+  }
+
   void clearNodeValue() {
+    std::pmr::memory_resource* resource = this->resource();
     switch (valueStatus_) {
       case VALUE:
         freeValue();
@@ -653,86 +1931,307 @@ class RecTree {
       case VALUE_VECTOR:
         freeValVector();
         break;
+      case INT64_VECTOR:
+      case DOUBLE_VECTOR:
+        freeNumberVector();
+        break;
       case RECTREE:
         clearChildren();
         break;
       default:;
     }
+    setInitial(resource);
+  }
+
+  // Empties the node, which keeps `resource` until it holds a value or a
+  // map again.
+  void setInitial(std::pmr::memory_resource* resource) {
     valueStatus_ = INITAL;
+    nodeValue_.resource_ = resource;
   }
 
-  ValType* createValue(const std::string& val) {
+  void createValue(std::string_view val) {
 #ifdef _DBLISP_TEST_DEBUG_
     std::cout << "createValue: " << val << std::endl;
 #endif
-    return new ValType(val);
+    ::new (&nodeValue_.value_) ValType(val, allocator());
   }
 
-  std::string& refRealKey() const { return *key_.keyPtr_; }
+  std::string_view refRealKey() const { return key_.constRefer(); }
+
+  static key_type makeKey(std::string_view key,
+                          std::pmr::memory_resource* resource,
+                          KeyPool* keyPool) {
+    return keyPool ? key_type(key, keyPool) : key_type(key, resource);
+  }
+
+  key_type makeKey(std::string_view key) const {
+    return makeKey(key, resource(), keyPool());
+  }
+
+  bool sameStorage(std::pmr::memory_resource* resource,
+                   KeyPool* keyPool) const {
+    return this->resource() == resource && this->keyPool() == keyPool;
+  }
 
   void freeValue() {
 #ifdef _DBLISP_TEST_DEBUG_
     std::cout << "freeValue: " << value() << std::endl;
 #endif
-    delete nodeValue_.value_;
+    freeValueText();
+    nodeValue_.value_.~ValType();
   }
 
   template <typename... types>
-  std::vector<ValType>* createValVector(types&&... args) {
-    return new std::vector<ValType>(std::forward<types>(args)...);
+  void createValVector(types&&... args) {
+    ::new (&nodeValue_.valueVec_)
+        value_vector(std::forward<types>(args)..., allocator());
+  }
+
+  void freeValVector() { nodeValue_.valueVec_.~value_vector(); }
+
+  // The vectors built by valueText, by node. Few nodes ever need one, so
+  // they are kept here rather than in every node; hasText_ says whether a
+  // node has an entry. Never destroyed, trees may outlive it at exit.
+  struct TextTable {
+    std::shared_mutex mutex;
+    std::unordered_map<const RecTree*, value_vector*> texts;
+  };
+
+  static TextTable& textTable() {
+    static TextTable* table = new TextTable;
+    return *table;
   }
 
-  void freeValVector() { delete nodeValue_.valueVec_; }
+  // The values of a single value or a number column as a vector, built by
+  // the first const function that needs one. Readers may race to build
+  // it, one of them wins.
+  const value_vector& valueText() const {
+    TextTable& table = textTable();
+    if (hasText_.load(std::memory_order_acquire)) {
+      std::shared_lock<std::shared_mutex> lock(table.mutex);
+      return *table.texts.find(this)->second;
+    }
+    value_vector* text = newObject<value_vector>(allocator());
+    text->reserve(isSingleValue() ? 1
+                                  : std::max(asInt64Span().size(),
+                                             asDoubleSpan().size()));
+    visitValues([text](std::string_view val) { text->emplace_back(val); });
+    std::unique_lock<std::shared_mutex> lock(table.mutex);
+    value_vector*& entry = table.texts[this];
+    if (hasText_.load(std::memory_order_relaxed)) {
+      deleteObject(text);
+      return *entry;
+    }
+    // Without hasText_ an entry was left by a released node.
+    entry = text;
+    hasText_.store(true, std::memory_order_release);
+    return *text;
+  }
 
-  ValType& refValue() const { return *nodeValue_.value_; }
+  void freeValueText() {
+    if (hasText_.load(std::memory_order_relaxed)) {
+      deleteObject(eraseText());
+    }
+  }
+
+  value_vector* eraseText() {
+    TextTable& table = textTable();
+    std::unique_lock<std::shared_mutex> lock(table.mutex);
+    auto pos = table.texts.find(this);
+    value_vector* text = pos->second;
+    table.texts.erase(pos);
+    hasText_.store(false, std::memory_order_relaxed);
+    return text;
+  }
 
-  std::string& refRealVal() const { return refValue().valStr_; }
+  ValType& refValue() const {
+    return const_cast<ValType&>(nodeValue_.value_);
+  }
 
-  std::vector<ValType>& refValVector() const { return *nodeValue_.valueVec_; }
+  std::string_view refRealVal() const { return refValue().asStringView(); }
 
-  std::map<key_type, link_type>& refChildren() const {
-    return *nodeValue_.children_;
+  value_vector& refValVector() const {
+    return const_cast<value_vector&>(nodeValue_.valueVec_);
   }
 
-  std::map<key_type, link_type>* copyChildren(
-      const std::map<key_type, link_type>& chidlren) {
+  children_map& refChildren() const { return *nodeValue_.children_; }
+
+  children_map* copyChildren(const children_map& chidlren) {
     auto child = createChildren();
+    child->reserve(chidlren.size());
     for (const auto& p : chidlren) {
-      link_type tree = createTree(*p.first.keyPtr_);
-      child->emplace(tree->key_, tree->copy(*p.second));
+      link_type tree = createTree(*p.second);
+      child->push_back(tree->key_, tree);
     }
+    child->sortFrom(0);
     return child;
   }
 
-  template <typename... types>
-  std::map<key_type, link_type>* createChildren(types&&... args) {
-    return new std::map<key_type, link_type>(std::forward<types>(args)...);
+  // Moves the contents of `x` into this empty node and leaves `x` empty.
+  // This node takes the resource of `x`, which keeps it too.
+  void takeNodeValue(RecTree& x) noexcept {
+    std::pmr::memory_resource* resource = x.resource();
+    switch (x.valueStatus_) {
+      case VALUE:
+        ::new (&nodeValue_.value_) ValType(std::move(x.refValue()));
+        x.freeValue();
+        break;
+      case VALUE_VECTOR:
+        ::new (&nodeValue_.valueVec_)
+            value_vector(std::move(x.refValVector()));
+        x.freeValVector();
+        break;
+      case INT64_VECTOR:
+        ::new (&nodeValue_.int64Vec_)
+            int64_vector(std::move(x.nodeValue_.int64Vec_));
+        x.freeNumberVector();
+        break;
+      case DOUBLE_VECTOR:
+        ::new (&nodeValue_.doubleVec_)
+            double_vector(std::move(x.nodeValue_.doubleVec_));
+        x.freeNumberVector();
+        break;
+      case RECTREE:
+        nodeValue_.children_ = x.nodeValue_.children_;
+        break;
+      default:
+        nodeValue_.resource_ = resource;
+    }
+    valueStatus_ = x.valueStatus_;
+    x.setInitial(resource);
+  }
+
+  children_map* createChildren() {
+    return newObject<children_map>(childPolicy_, resource());
+  }
+
+  void freeChildren() { deleteObject(nodeValue_.children_); }
+
+  // Turns this node into a map if it is not one yet and finds where `key`
+  // goes, returns whether it is already there.
+  bool prepareChild(const key_type& key, map_iterator& pos) {
+    if (isTree()) {
+      pos = ownChildren().lower_bound(key);
+      return pos != refChildren().end() && pos->first == key;
+    }
+    makeMap();
+    pos = refChildren().end();
+    return false;
   }
 
-  void freeChildren() { delete nodeValue_.children_; }
+  // Drops the values and makes this node a map without children.
+  void makeMap() {
+    clearNodeValue();
+    nodeValue_.children_ = createChildren();
+    valueStatus_ = RECTREE;
+  }
+
+  // A new empty child, with this node's resource, key pool and policy.
+  link_type createChild(const key_type& key) {
+    link_type tree = newObject<RecTree>(key, resource());
+    tree->childPolicy_ = childPolicy_;
+    return tree;
+  }
+
+  // Adopts trees whose keys are distinct from each other and from the
+  // current children, sorting them once. Trees must come from createTree
+  // of a node sharing this node's resource.
+  template <typename Iter>
+  void adoptChildren(Iter first, Iter last) {
+    if (first == last) {
+      return;
+    }
+    map_iterator pos;
+    prepareChild((*first)->key_, pos);
+    const size_t sortedSize = refChildren().size();
+    refChildren().reserve(sortedSize + (last - first));
+    for (; first != last; ++first) {
+      refChildren().push_back((*first)->key_, *first);
+    }
+    refChildren().sortFrom(sortedSize);
+  }
+
+  // The child `key` as it is, maybe shared, nullptr when there is none.
+  link_type findChild(std::string_view key) const {
+    map_const_iterator pos = refChildren().find(key_type::borrow(key));
+    return pos == refChildren().end() ? nullptr : pos->second;
+  }
+
+  // Adopts `tree`, which must come from createTree of a node sharing this
+  // node's resource. On a duplicate key the caller still owns it.
+  std::pair<map_iterator, bool> emplaceTree(link_type tree) {
+    map_iterator pos;
+    if (prepareChild(tree->key_, pos)) {
+      return {pos, false};
+    }
+    return {emplaceChild(pos, tree), true};
+  }
+
+  // The map key shares the string of the child's own key.
+  map_iterator emplaceChild(map_iterator hint, link_type tree) {
+    return refChildren().emplace_hint(hint, tree->key_, tree);
+  }
 
   template <typename... types>
-  link_type createTree(types... args) {
-    link_type tree = new RecTree(std::forward<types>(args)...);
+  link_type createTree(types&&... args) {
+    link_type tree = newObject<RecTree>(std::forward<types>(args)...,
+                                        resource(), keyPool());
 #ifdef _DBLISP_TEST_DEBUG_
     std::cout << "createTree: " << tree->key_ << std::endl;
 #endif
     return tree;
   }
 
+  // Drops one reference, the last one frees the tree.
   void freeTree(link_type treePtr) {
+    if (treePtr->refs_.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+      return;
+    }
 #ifdef _DBLISP_TEST_DEBUG_
     std::cout << "freeTree: " << treePtr->key_ << std::endl;
 #endif
     treePtr->clear();
-    delete treePtr;
+    deleteObject(treePtr);
+  }
+
+  ValType::allocator_type allocator() const {
+    return ValType::allocator_type(resource());
+  }
+
+  template <typename T, typename... types>
+  T* newObject(types&&... args) const {
+    void* ptr = resource()->allocate(sizeof(T), alignof(T));
+    return ::new (ptr) T(std::forward<types>(args)...);
+  }
+
+  template <typename T>
+  void deleteObject(T* ptr) const {
+    std::pmr::memory_resource* resource = this->resource();
+    ptr->~T();
+    resource->deallocate(ptr, sizeof(T), alignof(T));
   }
 
+ private:
+  // `key` already comes from makeKey, so it carries the key pool.
+  RecTree(const key_type& key, std::pmr::memory_resource* resource)
+      : key_(key), nodeValue_(resource), valueStatus_(INITAL) {}
+
  private:
   key_type key_;
   union value_type nodeValue_;
-  VALUE_TYPE valueStatus_;
+  // The small fields share the word after nodeValue_.
+  VALUE_TYPE valueStatus_ = INITAL;
+  ChildPolicy childPolicy_ = CHILD_MAP;
+  // See valueText.
+  mutable std::atomic<bool> hasText_{false};
+  // Maps of children holding this node, see ownChild.
+  std::atomic<uint32_t> refs_{1};
 };
+
+inline RecTree& RecTree_iterator::operator*() const {
+  return *RecTree::ownChild(this->node_);
+}
 }  // namespace dblisp
 #undef DBLISP_TEST_DEBUG
 #endif
\ No newline at end of file
@@ -1,10 +1,55 @@
 #include "gtest/gtest.h"
 
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <memory_resource>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+
+#include "../borrowed-tree.h"
+#include "../concurrent-tree.h"
+#include "../dblisp-binary.h"
+#include "../dblisp-file.h"
 #include "../dblisp-parser.h"
+#include "../dblisp-scan.h"
+#include "../dblisp-writer.h"
+#include "../lazy-tree.h"
+#include "../mapped-tree.h"
+#include "../published-tree.h"
 #include "../recursive-map.h"
 
+using dblisp::BorrowedNode;
+using dblisp::BorrowedTree;
+using dblisp::DbLispChunkLexer;
+using dblisp::ConcurrentTree;
+using dblisp::DbLispBinary;
+using dblisp::DbLispError;
+using dblisp::DbLispFile;
+using dblisp::DbLispHandler;
 using dblisp::DbLispParser;
+using dblisp::DbLispParserPool;
+using dblisp::DbLispProjection;
+using dblisp::DbLispPushParser;
+using dblisp::DbLispScanner;
+using dblisp::DbLispToken;
+using dblisp::DbLispWriter;
 using dblisp::KeyType;
+using dblisp::LazyTree;
+using dblisp::MappedNode;
+using dblisp::MappedTree;
+using dblisp::PublishedTree;
 using dblisp::RecTree;
 using dblisp::recursive_map;
 using dblisp::ValType;
@@ -172,6 +217,514 @@ TEST_F(TestRecursiveTree, formatLisp) {
   mergeTree.formatLisp(std::cout) << std::endl;
 }
 
+// Counts what is still allocated from it.
+class CountingResource : public std::pmr::memory_resource {
+ public:
+  size_t allocated = 0;
+  size_t allocCount = 0;
+
+ private:
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    allocated += bytes;
+    allocCount += 1;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void *ptr, size_t bytes, size_t alignment) override {
+    allocated -= bytes;
+    std::pmr::new_delete_resource()->deallocate(ptr, bytes, alignment);
+  }
+
+  bool do_is_equal(const memory_resource &x) const noexcept override {
+    return this == &x;
+  }
+};
+
+TEST_F(TestRecursiveTree, memoryResource) {
+  CountingResource resource, otherResource;
+  {
+    RecTree rt("key", &resource);
+    rt["key1"]["key2"]["key3"]["key4"].pushValue(std::string(100, 'v'));
+    std::vector<std::string> temp{"9", "8", "7", std::string(100, '6')};
+    rt["key1"]["key5"]["key3"]["key4"].assign(temp.begin(), temp.end());
+    EXPECT_EQ(rt.resource(), &resource);
+    EXPECT_EQ(rt["key1"]["key5"].resource(), &resource);
+    size_t allocCount = resource.allocCount;
+    EXPECT_GT(allocCount, 8);
+    RecTree copied(rt), other("other", &otherResource);
+    EXPECT_EQ(copied.resource(), std::pmr::get_default_resource());
+    EXPECT_EQ(resource.allocCount, allocCount);
+    other = rt;
+    EXPECT_EQ(other.resource(), &otherResource);
+    EXPECT_GT(otherResource.allocated, 0);
+    EXPECT_EQ(other.formatLisp(), rt.formatLisp());
+    RecTree parent("parent", &otherResource);
+    parent.insert(std::move(copied));
+    EXPECT_EQ(parent.at("key").resource(), &otherResource);
+    EXPECT_EQ(parent.at("key").formatLisp(), rt.formatLisp());
+    RecTree& leaf = rt["key6"];
+    leaf.pushValue("1");
+    leaf.value() = ValType(std::string(100, '2'));
+    EXPECT_EQ(leaf.resource(), &resource);
+    EXPECT_EQ(std::as_const(leaf).valueVector().size(), 1);
+    leaf.value() = ValType("2");
+    leaf.pushValue("3");
+    EXPECT_TRUE(leaf.packNumbers());
+    EXPECT_EQ(leaf.resource(), &resource);
+    leaf.clear();
+    EXPECT_EQ(leaf.resource(), &resource);
+    rt.erase("key6");
+    rt.erase("key1");
+    EXPECT_LT(resource.allocated, 200);
+  }
+  EXPECT_EQ(resource.allocated, 0);
+  EXPECT_EQ(otherResource.allocated, 0);
+}
+
+TEST_F(TestRecursiveTree, inlineValues) {
+  CountingResource resource;
+  {
+    RecTree rt("rt", &resource);
+    RecTree &leaf = rt["leaf"];
+    size_t allocCount = resource.allocCount;
+    leaf.pushValue("twenty bytes inline");
+    EXPECT_EQ(resource.allocCount, allocCount);
+    leaf.pushValue("80");
+    leaf.pushValue("120");
+    leaf.pushValue("360");
+    EXPECT_EQ(resource.allocCount, allocCount + 1);
+    EXPECT_EQ(leaf.valueVector().size(), 4);
+    EXPECT_EQ(leaf.value(0).asString(), "twenty bytes inline");
+    EXPECT_EQ(leaf[3].asInt(), 360);
+    const std::string longValue(100, 'v');
+    rt["long"].pushValue(longValue);
+    EXPECT_EQ(rt.at("long").value().asString(), longValue);
+    ValType copied(rt.at("long").value()), moved(std::move(copied));
+    EXPECT_EQ(moved.asStringView(), longValue);
+    EXPECT_EQ(copied.asStringView(), "");
+    moved = leaf.value(1);
+    EXPECT_EQ(moved.asInt(), 80);
+    RecTree other("other");
+    other = rt;
+    EXPECT_EQ(other.formatLisp(), rt.formatLisp());
+    other.swap(rt["leaf"]);
+    EXPECT_EQ(rt.at("leaf").at("long").value().asString(), longValue);
+    EXPECT_EQ(other.value(2).asInt(), 120);
+  }
+  EXPECT_EQ(resource.allocated, 0);
+}
+
+TEST_F(TestRecursiveTree, typedValues) {
+  RecTree rt("rt");
+  rt["int"].pushValue("16");
+  rt["negative"].pushValue("-7");
+  rt["big"].pushValue("18446744073709551615");
+  rt["double"].pushValue("0.5");
+  rt["bool"].pushValue("false");
+  rt["text"].pushValue(" 16 apples");
+  const ValType &intVal = rt.at("int").value();
+  int intResult = 0;
+  EXPECT_EQ(intVal.tryAsInt(intResult), std::errc());
+  EXPECT_EQ(intResult, 16);
+  EXPECT_EQ(intVal.asInt(), 16);
+  EXPECT_EQ(intVal.asULLInt(), 16);
+  EXPECT_EQ(intVal.asDouble(), 16);
+  EXPECT_EQ(intVal.asFloat(), 16);
+  unsigned int uintResult = 0;
+  EXPECT_EQ(rt.at("negative").value().tryAsUInt(uintResult),
+            std::errc::result_out_of_range);
+  EXPECT_EQ(rt.at("negative").value().asLInt(), -7);
+  const ValType &bigVal = rt.at("big").value();
+  EXPECT_EQ(bigVal.asULLInt(), std::numeric_limits<uint64_t>::max());
+  long long int llResult = 0;
+  EXPECT_EQ(bigVal.tryAsLLInt(llResult), std::errc::result_out_of_range);
+  EXPECT_THROW(bigVal.asLLInt(), std::out_of_range);
+  double doubleResult = 0;
+  EXPECT_EQ(rt.at("double").value().tryAsDouble(doubleResult), std::errc());
+  EXPECT_EQ(doubleResult, 0.5);
+  EXPECT_EQ(rt.at("double").value().tryAsInt(intResult),
+            std::errc::invalid_argument);
+  EXPECT_EQ(rt.at("double").value().asInt(), 0);
+  bool boolResult = true;
+  EXPECT_EQ(rt.at("bool").value().tryAsBool(boolResult), std::errc());
+  EXPECT_FALSE(boolResult);
+  EXPECT_EQ(intVal.tryAsBool(boolResult), std::errc::invalid_argument);
+  const ValType &textVal = rt.at("text").value();
+  EXPECT_EQ(textVal.tryAsInt(intResult), std::errc::invalid_argument);
+  EXPECT_EQ(textVal.tryAsDouble(doubleResult), std::errc::invalid_argument);
+  EXPECT_EQ(textVal.asInt(), 16);
+  EXPECT_TRUE(textVal.asBool());
+  EXPECT_THROW(ValType("apples").asDouble(), std::invalid_argument);
+  EXPECT_TRUE(std::signbit(ValType("-0").asDouble()));
+  ValType negativeZero("-0");
+  EXPECT_EQ(negativeZero.tryAsInt(intResult), std::errc());
+  EXPECT_EQ(intResult, 0);
+  EXPECT_EQ(negativeZero.tryAsDouble(doubleResult), std::errc());
+  EXPECT_TRUE(std::signbit(doubleResult));
+  EXPECT_EQ(negativeZero.asLLInt(), 0);
+  ValType copied(intVal);
+  EXPECT_EQ(copied.asInt(), 16);
+  copied = rt.at("double").value();
+  EXPECT_EQ(copied.asDouble(), 0.5);
+}
+
+TEST_F(TestRecursiveTree, numberColumns) {
+  RecTree rt("rt");
+  const std::vector<std::string> ints{"80", "-120", "0", "9223372036854775807",
+                                      "-9223372036854775808"};
+  const std::vector<std::string> doubles{"0.5", "-0", "80", "1e+300", "0.1"};
+  const std::vector<std::string> texts{"1", "007", "+5", "1.50", "1e3", ""};
+  rt["ints"].assign(ints.begin(), ints.end());
+  rt["doubles"].assign(doubles.begin(), doubles.end());
+  rt["texts"].assign(texts.begin(), texts.end());
+  rt["single"].pushValue("16");
+  const std::string lisp = rt.formatLisp();
+  EXPECT_TRUE(rt.at("ints").packNumbers());
+  EXPECT_TRUE(rt.at("doubles").packNumbers());
+  EXPECT_FALSE(rt.at("texts").packNumbers());
+  EXPECT_FALSE(rt.at("single").packNumbers());
+  EXPECT_EQ(rt.formatLisp(), lisp);
+  auto int64Span = rt.at("ints").asInt64Span();
+  ASSERT_EQ(int64Span.size(), ints.size());
+  EXPECT_EQ(int64Span[1], -120);
+  EXPECT_EQ(int64Span[4], std::numeric_limits<int64_t>::min());
+  EXPECT_TRUE(rt.at("ints").asDoubleSpan().empty());
+  auto doubleSpan = rt.at("doubles").asDoubleSpan();
+  EXPECT_EQ(std::vector<double>(doubleSpan.begin(), doubleSpan.end()),
+            (std::vector<double>{0.5, -0.0, 80, 1e300, 0.1}));
+  EXPECT_TRUE(std::signbit(doubleSpan[1]));
+  EXPECT_EQ(rt.at("ints").count(), 1);
+  EXPECT_TRUE(rt.at("ints").isValue());
+  RecTree copied(rt);
+  EXPECT_EQ(copied.at("ints").asInt64Span().size(), ints.size());
+  EXPECT_EQ(copied.formatLisp(), lisp);
+  EXPECT_EQ(rt.at("ints").value(3).asString(), ints[3]);
+  EXPECT_TRUE(rt.at("ints").asInt64Span().empty());
+  rt.at("doubles").pushValue("text");
+  EXPECT_EQ(rt.at("doubles").valueVector().size(), doubles.size() + 1);
+  copied["ints"]["child"];
+  EXPECT_FALSE(copied.at("ints").isValue());
+}
+
+TEST_F(TestRecursiveTree, keyPool) {
+  dblisp::KeyPool pool;
+  RecTree rt("key", std::pmr::get_default_resource(), &pool);
+  rt["key1"]["key2"]["key3"]["key4"].pushValue("this is a test");
+  rt["key1"]["key5"]["key3"]["key4"].pushValue("this is two test");
+  EXPECT_EQ(rt.keyPool(), &pool);
+  EXPECT_EQ(rt["key1"]["key5"].keyPool(), &pool);
+  EXPECT_EQ(pool.size(), 6);
+  EXPECT_EQ(pool.hits(), 2);
+  EXPECT_EQ(rt.at("key1").at("key2").at("key3").key(),
+            rt.at("key1").at("key5").at("key3").key());
+  // With another resource the copy does not share, it interns every key
+  // again.
+  std::pmr::monotonic_buffer_resource arena;
+  RecTree copied(rt), pooled(rt, &arena, &pool);
+  EXPECT_EQ(copied.keyPool(), nullptr);
+  EXPECT_EQ(copied.formatLisp(), rt.formatLisp());
+  EXPECT_EQ(pooled.formatLisp(), rt.formatLisp());
+  EXPECT_EQ(pool.size(), 6);
+  EXPECT_GT(pool.hitRate(), 0.5);
+  EXPECT_GT(pool.bytesSaved(), 0);
+  EXPECT_EQ(KeyType().toString(), "");
+  EXPECT_EQ(KeyType("abc").toString(), "abc");
+}
+
+TEST_F(TestRecursiveTree, keyOrder) {
+  const std::vector<std::string> keys{"",
+                                      std::string(1, '\0'),
+                                      std::string("a\0", 2),
+                                      "a",
+                                      "ab",
+                                      "gitlens.adv",
+                                      "gitlens.adva",
+                                      "gitlens.advanced",
+                                      "gitlens.advanced.messages",
+                                      "gitlens.advanced.messageS",
+                                      "gitlens.advanced.messages.a",
+                                      "\x80",
+                                      "\xff"};
+  dblisp::KeyPool pool;
+  for (const auto &left : keys) {
+    for (const auto &right : keys) {
+      KeyType leftKey(left), rightKey(right), pooledKey(right, &pool);
+      EXPECT_EQ(leftKey < rightKey, left < right) << left << " " << right;
+      EXPECT_EQ(leftKey == rightKey, left == right) << left << " " << right;
+      EXPECT_EQ(leftKey == pooledKey, left == right) << left << " " << right;
+      EXPECT_EQ(pooledKey < leftKey, right < left) << left << " " << right;
+    }
+  }
+  RecTree rt("rt");
+  for (const auto &key : keys) rt[key].pushValue(key);
+  auto iter = rt.begin();
+  for (const auto &key : std::set<std::string>(keys.begin(), keys.end())) {
+    EXPECT_EQ(iter->key().toString(), key);
+    EXPECT_EQ(rt.at(key).value().asString(), key);
+    ++iter;
+  }
+}
+
+TEST_F(TestRecursiveTree, childPolicy) {
+  for (auto policy : {dblisp::CHILD_MAP, dblisp::CHILD_FLAT, dblisp::CHILD_HASH,
+                      dblisp::CHILD_ADAPTIVE}) {
+    RecTree rt("rt");
+    rt.setChildPolicy(policy);
+    std::set<std::string> keys;
+    for (size_t i = 0; i != 200; ++i) {
+      std::string key = "key" + std::to_string((i * 7919) % 200);
+      keys.insert(key);
+      rt[key]["child"].pushValue(key);
+    }
+    EXPECT_EQ(rt.childPolicy(), policy);
+    EXPECT_EQ(rt.at("key7").childPolicy(), policy);
+    EXPECT_EQ(rt.size(), keys.size());
+    auto iter = rt.begin();
+    for (const auto &key : keys) {
+      EXPECT_EQ(iter->key().toString(), key);
+      EXPECT_EQ(rt.at(key).at("child").value().asString(), key);
+      ++iter;
+    }
+    EXPECT_TRUE(iter == rt.end());
+    EXPECT_TRUE(rt.find("key200") == rt.end());
+    for (size_t i = 0; i != 190; ++i) {
+      EXPECT_EQ(rt.erase("key" + std::to_string(i)), 1);
+    }
+    EXPECT_EQ(rt.size(), 10);
+    EXPECT_EQ(rt.at("key195").at("child").value().asString(), "key195");
+    EXPECT_TRUE(rt.find("key5") == rt.end());
+    RecTree copied(rt);
+    EXPECT_EQ(copied.childPolicy(), policy);
+    EXPECT_EQ(copied.formatLisp(), rt.formatLisp());
+  }
+  RecTree rt("rt");
+  rt["b"];
+  rt["a"];
+  rt.setChildPolicy(dblisp::CHILD_HASH);
+  EXPECT_EQ(rt.at("b").childPolicy(), dblisp::CHILD_HASH);
+  EXPECT_EQ(rt.begin()->key().toString(), "a");
+}
+
+TEST_F(TestRecursiveTree, sharedCopy) {
+  RecTree rt("rt");
+  rt["a"]["b"]["c"].pushValue("1");
+  rt["a"]["d"].pushValue("2");
+  rt["e"].pushValue("3");
+  const std::string lisp = rt.formatLisp();
+  RecTree copied(rt, RecTree::ShareTag());
+  const RecTree &original = rt, &shared = copied;
+  EXPECT_EQ(&shared.at("a"), &original.at("a"));
+  rt["a"]["b"]["c"].pushValue("4");
+  EXPECT_EQ(copied.formatLisp(), lisp);
+  // Only the path to the change was copied.
+  EXPECT_NE(&shared.at("a").at("b"), &original.at("a").at("b"));
+  EXPECT_EQ(&shared.at("a").at("d"), &original.at("a").at("d"));
+  EXPECT_EQ(&shared.at("e"), &original.at("e"));
+  const std::string changed = rt.formatLisp();
+  copied.erase("a");
+  copied.at("e").pushValue("5");
+  for (auto &child : copied) {
+    child.pushValue("6");
+  }
+  EXPECT_EQ(rt.formatLisp(), changed);
+  EXPECT_EQ(copied.at("e").valueVector().size(), 3);
+  // A subtree outlives the tree it was copied from.
+  RecTree subtree(rt.at("a"), RecTree::ShareTag());
+  rt.clear();
+  copied.clear();
+  EXPECT_EQ(subtree.at("b").at("c").valueVector().size(), 2);
+  subtree.setChildPolicy(dblisp::CHILD_HASH);
+  EXPECT_EQ(subtree.at("d").childPolicy(), dblisp::CHILD_HASH);
+  // Expanded variables share the tree they name.
+  DbLispParser parser;
+  recursive_map rmap("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(
+      "(\"tree\" (\"k\" \"v\"))(\"use\" (tree))", rmap));
+  const recursive_map &parsed = rmap;
+  EXPECT_EQ(&parsed.at("use").at("tree").at("k"), &parsed.at("tree").at("k"));
+  rmap["use"]["tree"]["k"].pushValue("w");
+  EXPECT_EQ(parsed.at("tree").at("k").valueVector().size(), 1);
+}
+
+TEST_F(TestRecursiveTree, independentCopy) {
+  RecTree rt("rt");
+  rt["a"].pushValue("1");
+  rt["b"]["c"].pushValue("1");
+  RecTree &leaf = rt["a"];
+  RecTree &deepLeaf = rt["b"]["c"];
+  RecTree copied(rt);
+  leaf.pushValue("2");
+  deepLeaf.pushValue("2");
+  EXPECT_EQ(copied.at("a").valueVector().size(), 1);
+  EXPECT_EQ(copied.at("b").at("c").valueVector().size(), 1);
+  RecTree assigned("assigned");
+  assigned = rt;
+  leaf.pushValue("3");
+  EXPECT_EQ(assigned.at("a").valueVector().size(), 2);
+  // Const reads of a shared number column leave it packed.
+  const std::vector<std::string> ints{"1", "2", "3"};
+  rt["ints"].assign(ints.begin(), ints.end());
+  EXPECT_TRUE(rt.at("ints").packNumbers());
+  const RecTree shared(rt, RecTree::ShareTag());
+  EXPECT_EQ(shared.at("ints").value(1).asString(), "2");
+  EXPECT_EQ(shared.at("ints").valueVector().size(), 3);
+  const RecTree &original = rt;
+  EXPECT_EQ(original.at("ints").asInt64Span().size(), 3);
+  EXPECT_EQ(shared.at("ints").asInt64Span().size(), 3);
+  rt.at("ints").pushValue("4");
+  EXPECT_TRUE(original.at("ints").asInt64Span().empty());
+  EXPECT_EQ(shared.at("ints").value(0).asString(), "1");
+  EXPECT_EQ(shared.at("ints").asInt64Span().size(), 3);
+}
+
+TEST_F(TestRecursiveTree, publishedTree) {
+  PublishedTree published;
+  EXPECT_FALSE(published.snapshot());
+  RecTree first("rt");
+  first["version"].pushValue("1");
+  EXPECT_EQ(published.publish(std::move(first)), 1);
+  PublishedTree::Snapshot old = published.snapshot();
+  RecTree second(*old, RecTree::ShareTag());
+  second["version"].pushValue("2");
+  EXPECT_EQ(published.publish(std::move(second)), 2);
+  // The replaced version lives on until its last snapshot is reset.
+  EXPECT_EQ(old.generation(), 1);
+  EXPECT_EQ(old->at("version").valueVector().size(), 1);
+  EXPECT_EQ(published.reclaim(), 1);
+  old.reset();
+  EXPECT_EQ(published.reclaim(), 0);
+  // One thread may hold more snapshots than a block has slots.
+  std::vector<PublishedTree::Snapshot> held;
+  for (size_t i = 0; i != PublishedTree::kSlotCount * 2 + 1; ++i) {
+    held.push_back(published.snapshot());
+  }
+  RecTree third(*held.back(), RecTree::ShareTag());
+  EXPECT_EQ(published.publish(std::move(third)), 3);
+  EXPECT_EQ(held.back().generation(), 2);
+  EXPECT_EQ(published.reclaim(), 1);
+  held.clear();
+  EXPECT_EQ(published.reclaim(), 0);
+  // Readers always see a whole version while a writer keeps publishing.
+  auto makeVersion = [](uint64_t generation) {
+    RecTree tree("rt");
+    tree["version"]["n"].pushValue(std::to_string(generation));
+    return tree;
+  };
+  EXPECT_EQ(published.publish(makeVersion(4)), 4);
+  std::atomic<bool> done{false};
+  std::vector<std::thread> readers;
+  std::atomic<size_t> errors{0};
+  for (size_t i = 0; i != 4; ++i) {
+    readers.emplace_back([&published, &done, &errors]() {
+      while (!done.load()) {
+        PublishedTree::Snapshot snapshot = published.snapshot();
+        const RecTree &version = snapshot->at("version");
+        if (version.size() != 1 ||
+            version.at("n").value().asULLInt() != snapshot.generation()) {
+          errors += 1;
+        }
+      }
+    });
+  }
+  for (uint64_t generation = 5; generation != 200; ++generation) {
+    EXPECT_EQ(published.publish(makeVersion(generation)), generation);
+  }
+  done = true;
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(errors.load(), 0);
+  EXPECT_EQ(published.reclaim(), 0);
+}
+
+TEST_F(TestRecursiveTree, concurrentTree) {
+  ConcurrentTree tree("rt");
+  std::vector<std::thread> writers;
+  for (size_t writer = 0; writer != 8; ++writer) {
+    writers.emplace_back([&tree, writer]() {
+      const std::string own = "own" + std::to_string(writer);
+      for (size_t i = 0; i != 100; ++i) {
+        tree.pushValue({own, "values"}, std::to_string(i));
+        tree.pushValue({"common", "key" + std::to_string(i % 10)}, own);
+      }
+    });
+  }
+  for (auto &writer : writers) {
+    writer.join();
+  }
+  EXPECT_EQ(tree.size(), 9);
+  EXPECT_TRUE(tree.read("own3", [](const RecTree &own) {
+    EXPECT_EQ(own.at("values").valueVector().size(), 100);
+  }));
+  EXPECT_FALSE(tree.read("none", [](const RecTree &) { FAIL(); }));
+  size_t count = tree.write("common", [](RecTree &common) {
+    return common.at("key7").valueVector().size();
+  });
+  EXPECT_EQ(count, 80);
+  EXPECT_TRUE(tree.contains({"common", "key7"}));
+  EXPECT_EQ(tree.erase({"common", "key7"}), 1);
+  EXPECT_FALSE(tree.contains({"common", "key7"}));
+  EXPECT_EQ(tree.erase({"common", "key7", "none"}), 0);
+  EXPECT_EQ(tree.erase({"own7"}), 1);
+  // The copy is ordered like any RecTree and no longer changes with the
+  // tree.
+  RecTree copied = tree.toRecTree();
+  EXPECT_EQ(copied.size(), 8);
+  EXPECT_EQ(copied.begin()->key().toString(), "common");
+  tree.pushValue({"own0", "values"}, "100");
+  EXPECT_EQ(copied.at("own0").at("values").valueVector().size(), 100);
+  EXPECT_EQ(tree.toRecTree().at("own0").at("values").valueVector().size(),
+            101);
+  EXPECT_FALSE(tree.pushValue({}, "1"));
+  EXPECT_EQ(tree.erase({}), 0);
+  EXPECT_FALSE(tree.contains({}));
+}
+
+TEST_F(TestRecursiveTree, concurrentTreeSecondLevel) {
+  // Writers below different second level children of one top level child
+  // only take its stripes, while copies keep sharing what they saw.
+  ConcurrentTree tree("rt");
+  for (size_t writer = 0; writer != 8; ++writer) {
+    tree.pushValue({"common", "child" + std::to_string(writer), "values"},
+                   "start");
+  }
+  std::atomic<bool> done{false};
+  std::thread copier([&tree, &done]() {
+    while (!done) {
+      RecTree copied = tree.toRecTree();
+      const RecTree &common = copied.at("common");
+      for (const auto &child : common) {
+        EXPECT_TRUE(child.isMap());
+        EXPECT_TRUE(tree.contains({"common", child.key().toString()}));
+      }
+    }
+  });
+  std::vector<std::thread> writers;
+  for (size_t writer = 0; writer != 8; ++writer) {
+    writers.emplace_back([&tree, writer]() {
+      const std::string child = "child" + std::to_string(writer);
+      for (size_t i = 0; i != 200; ++i) {
+        tree.pushValue({"common", child, "values"}, std::to_string(i));
+        tree.pushValue({"common", child, "key" + std::to_string(i % 4)}, "v");
+        EXPECT_EQ(tree.erase({"common", child, "key" + std::to_string(i % 4)}),
+                  1);
+      }
+    });
+  }
+  for (auto &writer : writers) {
+    writer.join();
+  }
+  done = true;
+  copier.join();
+  EXPECT_TRUE(tree.read("common", [](const RecTree &common) {
+    EXPECT_EQ(common.size(), 8);
+    for (const auto &child : common) {
+      EXPECT_EQ(child.at("values").valueVector().size(), 201);
+      EXPECT_EQ(child.size(), 1);
+    }
+  }));
+}
+
 class TestDbLispParser : public testing::Test {
  public:
   TestDbLispParser() {}
@@ -199,4 +752,1995 @@ TEST_F(TestDbLispParser, DISABLED_memory) {
     }
   }
   sleep(20);
-}
\ No newline at end of file
+}
+static void writeLispFile(const std::string &fileName,
+                          const std::string &content) {
+  std::ofstream outf(fileName);
+  outf << content;
+}
+
+// Bytes in MB for the benchmark reports, fractions included.
+static double megabytes(size_t bytes) { return bytes / double(1 << 20); }
+
+static std::string generateLisp(size_t formCount) {
+  std::string lisp;
+  for (size_t i = 0; i != formCount; ++i) {
+    std::string index = std::to_string(i);
+    lisp.append("(\"form" + index + "\" (\"editor.fontSize\" \"16\")\n")
+        .append("  (\"editor.rulers\" \"80\" \"120\" \"360\") ;comment\n")
+        .append("  (\"gitlens.advanced.messages\"\n")
+        .append("    (\"suppressLineUncommittedWarning\" \"true\")\n")
+        .append("    (\"value\" \"a \\\"quoted\\\" \n" + index + "\")))\n");
+  }
+  return lisp;
+}
+
+TEST_F(TestDbLispParser, fusedParseMode) {
+  DbLispParser parser;
+  recursive_map fused("rmap"), tokenVector("rmap");
+  EXPECT_EQ(parser.parseMode(), DbLispParser::PARSE_FUSED);
+  EXPECT_TRUE(parser.lispToRecMap("parser.scm", fused));
+  parser.setParseMode(DbLispParser::PARSE_TOKEN_VECTOR);
+  EXPECT_TRUE(parser.lispToRecMap("parser.scm", tokenVector));
+  EXPECT_EQ(fused.formatLisp(), tokenVector.formatLisp());
+  writeLispFile("fused.scm", generateLisp(20));
+  parser.setParseMode(DbLispParser::PARSE_FUSED);
+  EXPECT_TRUE(parser.lispToRecMap("fused.scm", fused));
+  parser.setParseMode(DbLispParser::PARSE_TOKEN_VECTOR);
+  EXPECT_TRUE(parser.lispToRecMap("fused.scm", tokenVector));
+  EXPECT_EQ(fused.formatLisp(), tokenVector.formatLisp());
+  EXPECT_EQ(fused.count(), 20 * 6 + 1);
+}
+
+TEST_F(TestDbLispParser, fusedParseErrors) {
+  const std::vector<std::string> badLisps{
+      "(\"a\"",      "(\"a\" (",         "((\"a\"))",
+      "()",          "(\"a\"))",         "\"a\"",
+      "(\"a\" \"b)", "(\"a\" \"b\" (\"c\"))", "(\"a\") (\"a\")",
+      "(\"a\" var)", "(\"a\" (var))",    "(\"a\" (\"b\")) (\"c\" a)"};
+  DbLispParser parser;
+  for (const auto &badLisp : badLisps) {
+    writeLispFile("bad.scm", badLisp);
+    recursive_map rmap("rmap");
+    testing::internal::CaptureStderr();
+    parser.setParseMode(DbLispParser::PARSE_TOKEN_VECTOR);
+    EXPECT_FALSE(parser.lispToRecMap("bad.scm", rmap)) << badLisp;
+    std::string tokenVectorError = testing::internal::GetCapturedStderr();
+    testing::internal::CaptureStderr();
+    parser.setParseMode(DbLispParser::PARSE_FUSED);
+    EXPECT_FALSE(parser.lispToRecMap("bad.scm", rmap)) << badLisp;
+    EXPECT_EQ(testing::internal::GetCapturedStderr(), tokenVectorError);
+    EXPECT_EQ(rmap.count(), 1);
+  }
+}
+
+TEST_F(TestDbLispParser, DISABLED_fusedBenchmark) {
+  const std::string lisp = generateLisp(200000);
+  writeLispFile("bench.scm", lisp);
+  for (auto mode :
+       {DbLispParser::PARSE_TOKEN_VECTOR, DbLispParser::PARSE_FUSED}) {
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+      DbLispParser parser;
+      parser.setParseMode(mode);
+      recursive_map rmap("rmap");
+      _exit(parser.lispToRecMap("bench.scm", rmap) ? 0 : 1);
+    }
+    int status = 0;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    std::chrono::duration<double> seconds =
+        std::chrono::steady_clock::now() - start;
+    EXPECT_EQ(status, 0);
+    std::cout << (mode == DbLispParser::PARSE_FUSED ? "fused" : "token vector")
+              << ": input " << megabytes(lisp.size()) << " MB, peak RSS "
+              << usage.ru_maxrss / 1024 << " MB, "
+              << megabytes(lisp.size()) / seconds.count() << " MB/s"
+              << std::endl;
+  }
+}
+
+TEST_F(TestDbLispParser, lispBufToRecMap) {
+  DbLispFile file;
+  EXPECT_FALSE(file.open("not-exist.scm"));
+  ASSERT_TRUE(file.open("parser.scm"));
+  EXPECT_TRUE(file.isMapped());
+  DbLispParser parser;
+  recursive_map fromFile("rmap"), fromBuf("rmap");
+  EXPECT_TRUE(parser.lispToRecMap("parser.scm", fromFile));
+  EXPECT_TRUE(parser.lispBufToRecMap(file.view(), fromBuf));
+  EXPECT_EQ(fromFile.formatLisp(), fromBuf.formatLisp());
+  const std::string lisp =
+      "(\"set\" (\"multi\" \"line \\\"one\\\"\nline two\") ;(\"x\")\n"
+      "       (\"tail\" \"\\\\\"\"))";
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp.data(), lisp.size(), fromBuf));
+  EXPECT_EQ(fromBuf.at("set").at("multi").value().asString(),
+            "line \"one\"\nline two");
+  EXPECT_EQ(fromBuf.at("set").at("tail").value().asString(), "\\\"");
+  EXPECT_EQ(fromBuf.at("set").size(), 2);
+  testing::internal::CaptureStderr();
+  EXPECT_FALSE(parser.lispBufToRecMap("(\"a\"\n  (\"b\" \"c)", fromBuf, "blob"));
+  EXPECT_EQ(testing::internal::GetCapturedStderr(),
+            "dblisp: parser: error: blob:2:8:`\" not close\n");
+}
+
+TEST_F(TestDbLispParser, borrowedTree) {
+  DbLispParser parser;
+  recursive_map rmap("rmap");
+  BorrowedTree tree("rmap");
+  EXPECT_TRUE(parser.lispToRecMap("parser.scm", rmap));
+  EXPECT_TRUE(parser.lispToBorrowedTree("parser.scm", tree));
+  EXPECT_EQ(tree.toRecTree().formatLisp(), rmap.formatLisp());
+  EXPECT_EQ(tree.root().count(), rmap.count());
+  std::string lisp = generateLisp(20) +
+                     "(\"esc\" (\"k \\\"q\\\"\" \"v \\\"q\\\"\" \"plain\"))";
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, rmap));
+  EXPECT_TRUE(parser.lispBufToBorrowedTree(std::string(lisp), tree));
+  EXPECT_EQ(tree.toRecTree().formatLisp(), rmap.formatLisp());
+  BorrowedNode esc = tree.root().at("esc").at("k \"q\"");
+  EXPECT_TRUE(esc.isValue());
+  EXPECT_EQ(esc.valueVector().size(), 2);
+  EXPECT_EQ(esc.value(0), "v \"q\"");
+  EXPECT_EQ(esc.value(0).data(), esc.value(0).data());
+  EXPECT_EQ(esc.value(1), "plain");
+  EXPECT_TRUE(tree.root().find("none") == tree.root().end());
+  EXPECT_THROW(tree.root().at("none"), std::out_of_range);
+}
+
+TEST_F(TestDbLispParser, borrowedTreeErrors) {
+  const std::vector<std::string> badLisps{
+      "(\"a\"", "()", "(\"a\"))", "(\"a\" \"b)", "(\"a\") (\"a\")",
+      "(\"a\" var)", "(\"a\" (\"b\")) (\"c\" a)"};
+  DbLispParser parser;
+  for (const auto &badLisp : badLisps) {
+    recursive_map rmap("rmap");
+    BorrowedTree tree("rmap");
+    testing::internal::CaptureStderr();
+    EXPECT_FALSE(parser.lispBufToRecMap(badLisp, rmap)) << badLisp;
+    std::string recMapError = testing::internal::GetCapturedStderr();
+    testing::internal::CaptureStderr();
+    EXPECT_FALSE(parser.lispBufToBorrowedTree(std::string(badLisp), tree));
+    EXPECT_EQ(testing::internal::GetCapturedStderr(), recMapError);
+    EXPECT_EQ(tree.root().count(), 1);
+  }
+}
+
+TEST_F(TestDbLispParser, freeze) {
+  DbLispParser parser;
+  parser.setPackNumbers(true);
+  recursive_map rmap("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(
+      generateLisp(100) + "(\"init\")(\"esc\\\"key\" \"v\")(\"n\" \"1\" \"2\")",
+      rmap));
+  rmap["emptyMap"]["child"];
+  rmap["emptyMap"].erase("child");
+  BorrowedTree tree = BorrowedTree::freeze(rmap);
+  EXPECT_EQ(tree.key(), "rmap");
+  EXPECT_EQ(tree.root().count(), rmap.count());
+  EXPECT_EQ(tree.toRecTree().formatLisp(), rmap.formatLisp());
+  for (const auto &child : rmap) {
+    std::string key = child.key().toString();
+    EXPECT_EQ(tree.root().at(key).key(), key);
+    EXPECT_TRUE(tree.root().find(key + "x") == tree.root().end());
+  }
+  EXPECT_EQ(tree.root().at("n").value(1), "2");
+  EXPECT_EQ(tree.root().at("esc\"key").value(), "v");
+  EXPECT_TRUE(tree.root().at("emptyMap").isMap());
+  EXPECT_FALSE(tree.root().at("init").isValue());
+  // One copy of a key for all of its nodes.
+  EXPECT_EQ(tree.root().at("form3").at("editor.fontSize").key().data(),
+            tree.root().at("form9").at("editor.fontSize").key().data());
+  BorrowedTree moved(std::move(tree));
+  rmap.clear();
+  EXPECT_EQ(moved.root().at("form7").at("editor.rulers").value(2), "360");
+  EXPECT_TRUE(BorrowedTree::freeze(recursive_map("empty")).root().empty());
+}
+
+TEST_F(TestDbLispParser, scanKernels) {
+  std::string buf;
+  for (size_t i = 0; i != 1000; ++i) {
+    buf.push_back(" \t\n\r\v\f()\";\\ab\x80\xff"[(i * 7919) % 16]);
+    buf.append(i % 97, i % 2 ? ' ' : 'x');
+  }
+  const char *first = buf.data(), *last = first + buf.size();
+  for (auto kernel : {DbLispScanner::SCAN_SSE2, DbLispScanner::SCAN_AVX2}) {
+    if (DbLispScanner::setKernel(kernel) != kernel) continue;
+    for (const char *pos = first; pos != last; ++pos) {
+      DbLispScanner::setKernel(DbLispScanner::SCAN_SCALAR);
+      const char *space = DbLispScanner::skipSpace(pos, last);
+      const char *quot = DbLispScanner::findChar(pos, last, '"');
+      const char *wordEnd = DbLispScanner::findWordEnd(pos, last);
+      const char *syntax = DbLispScanner::findSyntax(pos, last);
+      DbLispScanner::setKernel(kernel);
+      EXPECT_EQ(DbLispScanner::skipSpace(pos, last), space);
+      EXPECT_EQ(DbLispScanner::findChar(pos, last, '"'), quot);
+      EXPECT_EQ(DbLispScanner::findWordEnd(pos, last), wordEnd);
+      EXPECT_EQ(DbLispScanner::findSyntax(pos, last), syntax);
+    }
+  }
+  DbLispScanner::setKernel(DbLispScanner::SCAN_AVX2);
+}
+
+TEST_F(TestDbLispParser, numberKernels) {
+  std::vector<std::string> texts{"0",  "-0", "00", "01", "-", "",  "+1",
+                                 "1a", "9",  "-9", "1 ", "a", "/", ":"};
+  for (size_t digits = 1; digits != 21; ++digits) {
+    std::string number;
+    for (size_t i = 0; i != digits; ++i) {
+      number.push_back("1234567890"[(i * 7 + digits) % 10]);
+    }
+    texts.push_back(number);
+    texts.push_back("-" + number);
+    texts.push_back(std::string(digits, '9'));
+    texts.push_back(number.substr(0, digits - 1) + "x");
+  }
+  for (auto kernel : {DbLispScanner::SCAN_SCALAR, DbLispScanner::SCAN_SSE2}) {
+    if (DbLispScanner::setKernel(kernel) != kernel) continue;
+    for (const auto &text : texts) {
+      const char *first = text.data(), *last = first + text.size();
+      int64_t expected = 0, value = 0;
+      auto result = std::from_chars(first, last, expected);
+      char canonical[32];
+      bool valid = result.ec == std::errc() && result.ptr == last &&
+                   std::string(canonical,
+                               std::to_chars(canonical, canonical + 32,
+                                             expected)
+                                   .ptr) == text;
+      EXPECT_EQ(DbLispScanner::parseInt64(first, last, value), valid)
+          << text;
+      if (valid) {
+        EXPECT_EQ(value, expected) << text;
+      }
+    }
+  }
+  DbLispScanner::setKernel(DbLispScanner::SCAN_AVX2);
+}
+
+static std::string generateLongValueLisp(size_t formCount) {
+  std::string lisp, cert(3000, 'A');
+  for (size_t i = 0; i < cert.size(); i += 64) cert[i] = '\n';
+  for (size_t i = 0; i != formCount; ++i) {
+    lisp.append("(\"cert" + std::to_string(i) + "\"\n")
+        .append("        ;; " + std::string(200, '-') + "\n")
+        .append("        (\"pem\" \"" + cert + "\")\n")
+        .append("        (\"script\" \"echo \\\"" + cert + "\\\"\"))\n");
+  }
+  return lisp;
+}
+
+TEST_F(TestDbLispParser, scanKernelParse) {
+  const std::string lisp = generateLongValueLisp(10);
+  DbLispParser parser;
+  recursive_map scalar("rmap"), simd("rmap");
+  DbLispScanner::setKernel(DbLispScanner::SCAN_SCALAR);
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, scalar));
+  DbLispScanner::setKernel(DbLispScanner::SCAN_AVX2);
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, simd));
+  EXPECT_EQ(scalar.formatLisp(), simd.formatLisp());
+  EXPECT_EQ(simd.at("cert3").at("pem").value().asString().size(), 3000);
+}
+
+TEST_F(TestDbLispParser, DISABLED_scanKernelBenchmark) {
+  DbLispParser parser;
+  recursive_map rmap("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(generateLisp(100000), rmap));
+  const std::vector<std::string> lisps{generateLongValueLisp(20000),
+                                       rmap.formatLisp()};
+  for (const auto &lisp : lisps) {
+    for (auto kernel : {DbLispScanner::SCAN_SCALAR, DbLispScanner::SCAN_SSE2,
+                        DbLispScanner::SCAN_AVX2}) {
+      if (DbLispScanner::setKernel(kernel) != kernel) continue;
+      double best = 0;
+      size_t wordCount = 0;
+      for (size_t round = 0; round != 5; ++round) {
+        auto start = std::chrono::steady_clock::now();
+        dblisp::DbLispLexer lexer(lisp);
+        dblisp::DbLispToken token;
+        for (wordCount = 0; lexer.next(token);) ++wordCount;
+        std::chrono::duration<double> seconds =
+            std::chrono::steady_clock::now() - start;
+        best = std::max(best, megabytes(lisp.size()) / seconds.count());
+      }
+      std::cout << "kernel " << kernel << ": " << wordCount << " words, "
+                << best << " MB/s" << std::endl;
+    }
+  }
+}
+
+TEST_F(TestDbLispParser, memoryResource) {
+  DbLispParser parser;
+  CountingResource resource;
+  recursive_map rmap("rmap"), pmrMap("rmap", &resource);
+  const std::string lisp = generateLisp(20);
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, rmap));
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, pmrMap));
+  EXPECT_EQ(pmrMap.formatLisp(), rmap.formatLisp());
+  EXPECT_EQ(pmrMap.resource(), &resource);
+  EXPECT_GT(resource.allocCount, rmap.count());
+  pmrMap.clear();
+  EXPECT_LT(resource.allocated, 100);
+  std::pmr::monotonic_buffer_resource arena;
+  {
+    recursive_map arenaMap("rmap", &arena);
+    EXPECT_TRUE(parser.lispBufToRecMap(lisp, arenaMap));
+    EXPECT_EQ(arenaMap.formatLisp(), rmap.formatLisp());
+    arenaMap.release();
+    EXPECT_EQ(arenaMap.count(), 1);
+  }
+  arena.release();
+}
+
+TEST_F(TestDbLispParser, DISABLED_memoryResourceBenchmark) {
+  const std::string lisp = generateLisp(200000);
+  DbLispParser parser;
+  for (size_t round = 0; round != 3; ++round) {
+    std::pmr::monotonic_buffer_resource arena;
+    for (std::pmr::memory_resource *resource :
+         {std::pmr::new_delete_resource(),
+          static_cast<std::pmr::memory_resource *>(&arena)}) {
+      auto start = std::chrono::steady_clock::now();
+      auto rmap = std::make_unique<recursive_map>("rmap", resource);
+      EXPECT_TRUE(parser.lispBufToRecMap(lisp, *rmap));
+      auto parsed = std::chrono::steady_clock::now();
+      if (resource == &arena) {
+        rmap->release();
+        rmap.reset();
+        arena.release();
+      } else {
+        rmap.reset();
+      }
+      std::chrono::duration<double> parseSeconds = parsed - start;
+      std::chrono::duration<double> dropSeconds =
+          std::chrono::steady_clock::now() - parsed;
+      std::cout << (resource == &arena ? "arena" : "new/delete")
+                << ": parse " << parseSeconds.count() << " s, drop "
+                << dropSeconds.count() << " s" << std::endl;
+    }
+  }
+}
+
+TEST_F(TestDbLispParser, keyPool) {
+  DbLispParser parser;
+  dblisp::KeyPool pool;
+  recursive_map rmap("rmap");
+  recursive_map first("rmap", std::pmr::get_default_resource(), &pool);
+  recursive_map second("rmap", std::pmr::get_default_resource(), &pool);
+  const std::string lisp = generateLisp(20);
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, rmap));
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, first));
+  EXPECT_EQ(first.formatLisp(), rmap.formatLisp());
+  EXPECT_EQ(first.at("form3").keyPool(), &pool);
+  EXPECT_EQ(pool.size(), 20 + 5 + 1);
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, second));
+  EXPECT_EQ(second.formatLisp(), rmap.formatLisp());
+  EXPECT_EQ(pool.size(), 20 + 5 + 1);
+  EXPECT_GT(pool.hitRate(), 0.8);
+  std::cout << "key pool: " << pool.size() << " keys, hit rate "
+            << pool.hitRate() << ", " << pool.bytesSaved() << " bytes saved"
+            << std::endl;
+}
+
+static std::vector<std::string> wideNodeKeys(size_t keyCount) {
+  std::vector<std::string> keys;
+  for (size_t i = 0; i != keyCount; ++i) {
+    keys.push_back("gitlens.advanced.messages.suppress" + std::to_string(i));
+    keys.push_back("key" + std::to_string(i));
+  }
+  return keys;
+}
+
+TEST_F(TestDbLispParser, DISABLED_keyLookupBenchmark) {
+  for (size_t keyCount : {100, 10000}) {
+    const std::vector<std::string> keys = wideNodeKeys(keyCount);
+    RecTree rt("rt");
+    std::map<std::string, size_t> stringMap;
+    for (const auto &key : keys) {
+      rt[key].pushValue("v");
+      stringMap.emplace(key, 0);
+    }
+    size_t found = 0;
+    for (bool recTree : {false, true}) {
+      auto start = std::chrono::steady_clock::now();
+      for (size_t round = 0; round != 100; ++round) {
+        for (const auto &key : keys) {
+          found += recTree ? rt.find(key) != rt.end()
+                           : stringMap.find(key) != stringMap.end();
+        }
+      }
+      std::chrono::duration<double, std::nano> nanos =
+          std::chrono::steady_clock::now() - start;
+      std::cout << (recTree ? "RecTree::find" : "std::map<std::string>::find")
+                << ", " << keys.size() << " keys: "
+                << nanos.count() / (100 * keys.size()) << " ns/lookup"
+                << std::endl;
+    }
+    EXPECT_EQ(found, 2 * 100 * keys.size());
+  }
+}
+
+TEST_F(TestDbLispParser, childPolicy) {
+  DbLispParser parser;
+  const std::string lisp = generateLisp(200);
+  recursive_map reference("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, reference));
+  for (auto policy : {dblisp::CHILD_MAP, dblisp::CHILD_FLAT, dblisp::CHILD_HASH,
+                      dblisp::CHILD_ADAPTIVE}) {
+    recursive_map rmap("rmap");
+    rmap.setChildPolicy(policy);
+    EXPECT_TRUE(parser.lispBufToRecMap(lisp, rmap));
+    EXPECT_EQ(rmap.childPolicy(), policy);
+    EXPECT_EQ(rmap.at("form7").childPolicy(), policy);
+    EXPECT_EQ(rmap.formatLisp(), reference.formatLisp());
+    EXPECT_EQ(rmap.at("form42").at("editor.fontSize").value().asString(),
+              "16");
+  }
+}
+
+TEST_F(TestDbLispParser, DISABLED_childPolicyBenchmark) {
+  const std::vector<std::string> keys = wideNodeKeys(25000);
+  std::string lisp = "(\"wide\"";
+  for (const auto &key : keys) {
+    lisp.append(" (\"" + key + "\" \"v\")");
+  }
+  lisp.append(")");
+  DbLispParser parser;
+  for (auto policy : {dblisp::CHILD_MAP, dblisp::CHILD_FLAT, dblisp::CHILD_HASH,
+                      dblisp::CHILD_ADAPTIVE}) {
+    recursive_map rmap("rmap");
+    rmap.setChildPolicy(policy);
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_TRUE(parser.lispBufToRecMap(lisp, rmap));
+    std::chrono::duration<double> parseSeconds =
+        std::chrono::steady_clock::now() - start;
+    const RecTree &wide = rmap.at("wide");
+    size_t found = 0;
+    start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round != 20; ++round) {
+      for (const auto &key : keys) found += wide.find(key) != wide.end();
+    }
+    std::chrono::duration<double, std::nano> nanos =
+        std::chrono::steady_clock::now() - start;
+    EXPECT_EQ(found, 20 * keys.size());
+    std::cout << "policy " << int(policy) << ": parse " << parseSeconds.count()
+              << " s, " << nanos.count() / (20 * keys.size())
+              << " ns/lookup" << std::endl;
+  }
+}
+
+TEST_F(TestRecursiveTree, wideNode) {
+  const std::vector<std::string> keys = wideNodeKeys(2500);
+  for (auto policy : {dblisp::CHILD_MAP, dblisp::CHILD_HASH,
+                      dblisp::CHILD_ADAPTIVE}) {
+    RecTree rt("rt");
+    rt.setChildPolicy(policy);
+    rt["key0"].pushValue("v");
+    // Tree nodes keep their place while other children come and go.
+    RecTree::iterator first = rt.find("key0");
+    for (size_t i = 0; i != keys.size(); ++i) {
+      rt[keys[(i * 7919) % keys.size()]].pushValue("v");
+    }
+    EXPECT_EQ(rt.size(), keys.size());
+    if (policy != dblisp::CHILD_ADAPTIVE) {
+      EXPECT_TRUE(first == rt.find("key0"));
+    }
+    for (size_t i = 0; i != keys.size(); i += 2) {
+      EXPECT_EQ(rt.erase(keys[(i * 7919) % keys.size()]), 1);
+    }
+    EXPECT_EQ(rt.size(), keys.size() / 2);
+    for (size_t i = 0; i != keys.size(); ++i) {
+      const std::string &key = keys[(i * 7919) % keys.size()];
+      EXPECT_EQ(rt.find(key) != rt.end(), i % 2 == 1) << key;
+    }
+    std::set<std::string> left;
+    for (const auto &child : rt) left.insert(child.key().toString());
+    EXPECT_EQ(left.size(), rt.size());
+    EXPECT_TRUE(std::is_sorted(
+        rt.begin(), rt.end(), [](const RecTree &left, const RecTree &right) {
+          return left.key().toString() < right.key().toString();
+        }));
+  }
+}
+
+TEST_F(TestRecursiveTree, DISABLED_wideNodeBenchmark) {
+  const std::vector<std::string> keys = wideNodeKeys(25000);
+  // CHILD_FLAT moves half the node on every insert, so it is left out.
+  for (auto policy : {dblisp::CHILD_MAP, dblisp::CHILD_HASH,
+                      dblisp::CHILD_ADAPTIVE}) {
+    RecTree rt("rt");
+    rt.setChildPolicy(policy);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i != keys.size(); ++i) {
+      rt[keys[(i * 7919) % keys.size()]].pushValue("v");
+    }
+    std::chrono::duration<double> fillSeconds =
+        std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    for (const auto &key : keys) rt.erase(key);
+    std::chrono::duration<double> eraseSeconds =
+        std::chrono::steady_clock::now() - start;
+    EXPECT_TRUE(rt.empty());
+    std::cout << "policy " << int(policy) << ": fill " << keys.size()
+              << " shuffled keys " << fillSeconds.count() << " s, erase "
+              << eraseSeconds.count() << " s" << std::endl;
+  }
+}
+
+TEST_F(TestDbLispParser, DISABLED_nodeBytesBenchmark) {
+  DbLispParser parser;
+  CountingResource resource;
+  recursive_map rmap("rmap", &resource);
+  EXPECT_TRUE(parser.lispBufToRecMap(generateLisp(10000), rmap));
+  const double nodes = rmap.count();
+  std::cout << "sizeof(RecTree) " << sizeof(RecTree) << ", "
+            << resource.allocated / nodes << " bytes/node, "
+            << resource.allocCount / nodes << " allocations/node"
+            << std::endl;
+}
+
+TEST_F(TestRecursiveTree, DISABLED_typedValueBenchmark) {
+  RecTree rt("rt");
+  rt["editor.fontSize"].pushValue("16");
+  rt["editor.lineHeight"].pushValue("1.5");
+  const ValType &intVal = rt.at("editor.fontSize").value();
+  const ValType &doubleVal = rt.at("editor.lineHeight").value();
+  const size_t reads = 1000000;
+  auto time = [reads](const char *name, auto read) {
+    double sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i != reads; ++i) sum += read();
+    std::chrono::duration<double, std::nano> nanos =
+        std::chrono::steady_clock::now() - start;
+    std::cout << name << ": " << nanos.count() / reads << " ns/read ("
+              << sum << ")" << std::endl;
+  };
+  time("std::stoi", [&] { return std::stoi(intVal.asString()); });
+  time("ValType::asInt", [&] { return intVal.asInt(); });
+  time("std::stod", [&] { return std::stod(doubleVal.asString()); });
+  time("ValType::asDouble", [&] { return doubleVal.asDouble(); });
+}
+
+TEST_F(TestDbLispParser, packNumbers) {
+  const std::string lisp =
+      "(\"rulers\" \"80\" \"120\" \"360\")\n"
+      "(\"ratios\" \"0.25\" \"1.5\")\n"
+      "(\"mixed\" \"80\" \"auto\")\n"
+      "(\"copy\" rulers \"480\")\n"
+      "(\"more\" rulers ratios)\n";
+  DbLispParser parser;
+  recursive_map text("rmap"), packed("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, text));
+  EXPECT_FALSE(parser.packNumbers());
+  parser.setPackNumbers(true);
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, packed));
+  EXPECT_EQ(packed.formatLisp(), text.formatLisp());
+  auto rulers = packed.at("rulers").asInt64Span();
+  EXPECT_EQ(std::vector<int64_t>(rulers.begin(), rulers.end()),
+            (std::vector<int64_t>{80, 120, 360}));
+  EXPECT_EQ(packed.at("ratios").asDoubleSpan()[1], 1.5);
+  EXPECT_TRUE(packed.at("mixed").asInt64Span().empty());
+  EXPECT_EQ(packed.at("copy").asInt64Span().size(), 4);
+  EXPECT_EQ(packed.at("more").asDoubleSpan().size(), 5);
+}
+
+TEST_F(TestDbLispParser, DISABLED_numberColumnBenchmark) {
+  std::string lisp;
+  for (size_t i = 0; i != 10000; ++i) {
+    lisp.append("(\"buckets" + std::to_string(i) + "\"");
+    for (size_t j = 0; j != 100; ++j) {
+      lisp.append(" \"" + std::to_string((i * 7919 + j * 104729) % 100000) +
+                  "\"");
+    }
+    lisp.append(")\n");
+  }
+  DbLispParser parser;
+  for (bool packNumbers : {false, true}) {
+    CountingResource resource;
+    recursive_map rmap("rmap", &resource);
+    parser.setPackNumbers(packNumbers);
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_TRUE(parser.lispBufToRecMap(lisp, rmap));
+    std::chrono::duration<double> parseSeconds =
+        std::chrono::steady_clock::now() - start;
+    double sum = 0;
+    start = std::chrono::steady_clock::now();
+    for (const auto &leaf : rmap) {
+      if (packNumbers) {
+        for (int64_t val : leaf.asInt64Span()) sum += val;
+      } else {
+        for (size_t j = 0; j != 100; ++j) sum += leaf.value(j).asDouble();
+      }
+    }
+    std::chrono::duration<double, std::nano> nanos =
+        std::chrono::steady_clock::now() - start;
+    std::cout << (packNumbers ? "number columns" : "values") << ": parse "
+              << parseSeconds.count() << " s, " << resource.allocated
+              << " bytes, " << nanos.count() / 1000000 << " ns/read (" << sum
+              << ")" << std::endl;
+  }
+}
+
+TEST_F(TestDbLispParser, writer) {
+  DbLispParser parser;
+  recursive_map rmap("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(generateLisp(2000), rmap));
+  const std::string lisp = rmap.formatLisp();
+  std::stringstream stream;
+  rmap.formatLisp(stream);
+  EXPECT_EQ(stream.str(), lisp);
+  std::string chunked;
+  size_t maxChunk = 0;
+  {
+    DbLispWriter writer([&](const char *data, size_t size) {
+      maxChunk = std::max(maxChunk, size);
+      chunked.append(data, size);
+      return true;
+    });
+    EXPECT_TRUE(rmap.formatLisp(writer));
+  }
+  EXPECT_EQ(chunked, lisp);
+  EXPECT_EQ(maxChunk, DbLispWriter::kChunkSize);
+  const std::string compact = rmap.formatLisp(DbLispWriter::FORMAT_COMPACT);
+  // Only the values hold newlines.
+  EXPECT_EQ(std::count(compact.begin(), compact.end(), '\n'), 2000);
+  EXPECT_LT(compact.size(), lisp.size());
+  recursive_map reparsed("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(compact, reparsed));
+  EXPECT_EQ(reparsed.at("rmap").formatLisp(), lisp);
+  RecTree small("small");
+  small["a"]["b"].pushValue("x\"y");
+  small["c"];
+  EXPECT_EQ(small.formatLisp(DbLispWriter::FORMAT_COMPACT),
+            "(\"small\" (\"a\" (\"b\" \"x\\\"y\")) (\"c\"))");
+  DbLispWriter failing([](const char *, size_t) { return false; });
+  EXPECT_FALSE(rmap.formatLisp(failing));
+  EXPECT_FALSE(failing.good());
+}
+
+TEST_F(TestDbLispParser, saveToFile) {
+  DbLispParser parser;
+  recursive_map rmap("rmap"), loaded("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(generateLisp(200), rmap));
+  writeLispFile("save.scm", "(\"old\")");
+  EXPECT_TRUE(rmap.saveToFile("save.scm"));
+  EXPECT_EQ(DbLispFile("save.scm").view(), rmap.formatLisp());
+  EXPECT_TRUE(rmap.saveToFile("save.scm", DbLispWriter::FORMAT_COMPACT));
+  EXPECT_TRUE(parser.lispToRecMap("save.scm", loaded));
+  EXPECT_EQ(loaded.at("rmap").formatLisp(), rmap.formatLisp());
+  EXPECT_FALSE(rmap.saveToFile("no-such-dir/save.scm"));
+  std::string saved(DbLispFile("save.scm").view());
+  EXPECT_FALSE(DbLispWriter::saveToFile(
+      "save.scm", DbLispWriter::FORMAT_COMPACT, [](DbLispWriter &writer) {
+        writer.write("(");
+        return false;
+      }));
+  EXPECT_EQ(DbLispFile("save.scm").view(), saved);
+  EXPECT_EQ(std::remove("save.scm"), 0);
+  mode_t mask = ::umask(027);
+  EXPECT_TRUE(rmap.saveToFile("save.scm"));
+  struct stat fileStat;
+  EXPECT_EQ(::stat("save.scm", &fileStat), 0);
+  EXPECT_EQ(fileStat.st_mode & 0777, 0640u);
+  ::umask(mask);
+  EXPECT_EQ(std::remove("save.scm"), 0);
+}
+
+TEST_F(TestDbLispParser, DISABLED_formatLispBenchmark) {
+  DbLispParser parser;
+  recursive_map rmap("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(generateLisp(200000), rmap));
+  for (auto mode :
+       {DbLispWriter::FORMAT_INDENTED, DbLispWriter::FORMAT_COMPACT}) {
+    size_t size = 0;
+    auto start = std::chrono::steady_clock::now();
+    {
+      DbLispWriter writer([&size](const char *, size_t chunk) {
+        size += chunk;
+        return true;
+      }, mode);
+      EXPECT_TRUE(rmap.formatLisp(writer));
+    }
+    std::chrono::duration<double> seconds =
+        std::chrono::steady_clock::now() - start;
+    std::cout << "mode " << mode << ": " << megabytes(size) << " MB, "
+              << megabytes(size) / seconds.count() << " MB/s" << std::endl;
+  }
+}
+
+TEST_F(TestDbLispParser, binary) {
+  DbLispParser parser;
+  parser.setPackNumbers(true);
+  recursive_map rmap("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(
+      generateLisp(50) + "(\"init\")(\"ratios\" \"0.5\" \"-0\")\n"
+                         "(\"esc\\\"key\" \"" + std::string(100, 'v') + "\")",
+      rmap));
+  rmap["emptyMap"]["child"];
+  rmap["emptyMap"].erase("child");
+  std::string buf;
+  DbLispBinary binary;
+  {
+    DbLispWriter writer(buf);
+    EXPECT_TRUE(binary.saveBinary(rmap, writer));
+  }
+  recursive_map loaded("loaded");
+  EXPECT_TRUE(binary.loadBinaryBuf(buf, loaded));
+  EXPECT_EQ(loaded.key().toString(), "loaded");
+  for (const auto &child : rmap) {
+    const RecTree &copy = loaded.at(child.key());
+    EXPECT_EQ(copy.formatLisp(), child.formatLisp());
+    EXPECT_EQ(copy.isValue(), child.isValue());
+    EXPECT_EQ(copy.isMap(), child.isMap());
+    EXPECT_EQ(copy.asInt64Span().size(), child.asInt64Span().size());
+    EXPECT_EQ(copy.asDoubleSpan().size(), child.asDoubleSpan().size());
+  }
+  EXPECT_EQ(loaded.size(), rmap.size());
+  EXPECT_FALSE(loaded.at("init").isValue() || loaded.at("init").isMap());
+  EXPECT_TRUE(loaded.at("emptyMap").isMap());
+  EXPECT_TRUE(std::signbit(loaded.at("ratios").asDoubleSpan()[1]));
+  EXPECT_TRUE(binary.saveBinary(rmap, "binary.dbl"));
+  recursive_map fromFile("rmap");
+  EXPECT_TRUE(binary.loadBinary("binary.dbl", fromFile));
+  EXPECT_EQ(fromFile.formatLisp(), rmap.formatLisp());
+  EXPECT_EQ(std::remove("binary.dbl"), 0);
+}
+
+TEST_F(TestDbLispParser, binaryErrors) {
+  DbLispParser parser;
+  recursive_map rmap("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(generateLisp(3), rmap));
+  std::string buf;
+  {
+    DbLispWriter writer(buf);
+    EXPECT_TRUE(DbLispBinary().saveBinary(rmap, writer));
+  }
+  DbLispBinary binary;
+  recursive_map loaded("loaded");
+  loaded["kept"];
+  testing::internal::CaptureStderr();
+  for (size_t size = 0; size != buf.size(); ++size) {
+    EXPECT_FALSE(binary.loadBinaryBuf(buf.substr(0, size), loaded)) << size;
+  }
+  EXPECT_FALSE(binary.loadBinaryBuf(buf + "x", loaded));
+  for (size_t index = 0; index != buf.size(); ++index) {
+    std::string corrupt = buf;
+    corrupt[index] ^= 0x5A;
+    recursive_map any("any");
+    binary.loadBinaryBuf(corrupt, any);
+  }
+  std::string stderrText = testing::internal::GetCapturedStderr();
+  EXPECT_NE(stderrText.find("dblisp: binary: error: <buffer>:bad root offset"),
+            std::string::npos);
+  EXPECT_EQ(loaded.formatLisp(), "(\"loaded\" (\"kept\"))");
+}
+
+static void expectSameTree(const MappedNode &node, const RecTree &tree) {
+  EXPECT_EQ(node.key(), tree.key().toString());
+  EXPECT_EQ(node.isMap(), tree.isMap());
+  EXPECT_EQ(node.isValue(), tree.isValue());
+  EXPECT_EQ(node.size(), tree.size());
+  if (tree.asInt64Span().size() != 0 || tree.asDoubleSpan().size() != 0) {
+    EXPECT_TRUE(node.isNumberVector());
+    EXPECT_TRUE(node.valueVector().empty());
+    EXPECT_TRUE(std::equal(node.asInt64Span().begin(),
+                           node.asInt64Span().end(),
+                           tree.asInt64Span().begin(),
+                           tree.asInt64Span().end()));
+    EXPECT_EQ(node.asDoubleSpan().size(), tree.asDoubleSpan().size());
+  } else if (tree.isValue()) {
+    ASSERT_EQ(node.valueVector().size(), tree.valueVector().size());
+    size_t index = 0;
+    for (std::string_view val : node.valueVector()) {
+      EXPECT_EQ(val, tree.value(index++).asStringView());
+    }
+  }
+  if (!tree.isMap()) {
+    return;
+  }
+  auto child = tree.begin();
+  for (const MappedNode &mappedChild : node) {
+    ASSERT_NE(child, tree.end());
+    expectSameTree(mappedChild, *child);
+    EXPECT_EQ(node.at(mappedChild.key()).key(), mappedChild.key());
+    ++child;
+  }
+}
+
+TEST_F(TestDbLispParser, mappedTree) {
+  DbLispParser parser;
+  parser.setPackNumbers(true);
+  recursive_map rmap("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(
+      generateLisp(50) + "(\"init\")(\"ratios\" \"0.5\" \"-0\")\n"
+                         "(\"esc\\\"key\" \"" + std::string(100, 'v') + "\")",
+      rmap));
+  rmap["emptyMap"]["child"];
+  rmap["emptyMap"].erase("child");
+  DbLispBinary binary;
+  EXPECT_TRUE(binary.saveBinary(rmap, "mapped.dbl"));
+  MappedTree tree;
+  EXPECT_TRUE(binary.mapBinary("mapped.dbl", tree));
+  EXPECT_TRUE(tree.isMapped());
+  EXPECT_EQ(tree.key(), "rmap");
+  expectSameTree(tree.root(), rmap);
+  EXPECT_EQ(tree.root().count(), rmap.count());
+  MappedNode rulers = tree.root().at("form7").at("editor.rulers");
+  EXPECT_EQ(rulers.asInt64Span()[2], 360);
+  EXPECT_THROW(rulers.value(), std::out_of_range);
+  EXPECT_EQ(tree.root().at("esc\"key").value(), std::string(100, 'v'));
+  EXPECT_EQ(tree.root().at("form7").at("gitlens.advanced.messages")
+                .at("value").value(),
+            "a \"quoted\" \n7");
+  EXPECT_DOUBLE_EQ(tree.root().at("ratios").asDoubleSpan()[0], 0.5);
+  EXPECT_TRUE(tree.root().at("emptyMap").isMap());
+  EXPECT_FALSE(tree.root().at("init").isValue());
+  EXPECT_EQ(tree.root().find("form"), tree.root().end());
+  EXPECT_THROW(tree.root().at("zzz"), std::out_of_range);
+  std::vector<std::string> keys, reversedKeys;
+  for (auto it = tree.root().begin(); it != tree.root().end(); ++it) {
+    keys.emplace_back(it->key());
+  }
+  for (auto it = std::make_reverse_iterator(tree.root().end());
+       it != std::make_reverse_iterator(tree.root().begin()); ++it) {
+    reversedKeys.emplace_back((*it).key());
+  }
+  std::reverse(reversedKeys.begin(), reversedKeys.end());
+  EXPECT_EQ(reversedKeys, keys);
+  MappedTree moved(std::move(tree));
+  EXPECT_EQ(moved.root().at("form7").size(), 3);
+  EXPECT_EQ(std::remove("mapped.dbl"), 0);
+}
+
+TEST_F(TestDbLispParser, mappedTreeErrors) {
+  DbLispParser parser;
+  recursive_map rmap("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(generateLisp(3), rmap));
+  std::string buf;
+  {
+    DbLispWriter writer(buf);
+    EXPECT_TRUE(DbLispBinary().saveBinary(rmap, writer));
+  }
+  DbLispBinary binary;
+  MappedTree tree;
+  testing::internal::CaptureStderr();
+  EXPECT_FALSE(binary.mapBinary("missing.dbl", tree));
+  writeLispFile("mapped.dbl", buf.substr(0, buf.size() - 1));
+  EXPECT_FALSE(binary.mapBinary("mapped.dbl", tree));
+  // Any flipped byte either fails to map, throws on the way down or
+  // reads some other tree, but never reads outside the file.
+  for (size_t index = 0; index != buf.size(); ++index) {
+    std::string corrupt = buf;
+    corrupt[index] ^= 0x5A;
+    writeLispFile("mapped.dbl", corrupt);
+    if (!binary.mapBinary("mapped.dbl", tree)) {
+      continue;
+    }
+    try {
+      for (const MappedNode &child : tree.root()) {
+        child.count();
+        for (const MappedNode &grandChild : child) {
+          for (std::string_view val : grandChild.valueVector()) {
+            EXPECT_LE(val.size(), buf.size());
+          }
+        }
+      }
+    } catch (const std::runtime_error &) {
+    }
+  }
+  std::string stderrText = testing::internal::GetCapturedStderr();
+  EXPECT_NE(stderrText.find("dblisp: binary: error: missing.dbl:open error"),
+            std::string::npos);
+  EXPECT_EQ(std::remove("mapped.dbl"), 0);
+}
+
+TEST_F(TestDbLispParser, DISABLED_mappedTreeBenchmark) {
+  DbLispParser parser;
+  recursive_map rmap("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(generateLisp(200000), rmap));
+  DbLispBinary binary;
+  EXPECT_TRUE(binary.saveBinary(rmap, "mapped.dbl"));
+  auto start = std::chrono::steady_clock::now();
+  recursive_map loaded("rmap");
+  EXPECT_TRUE(binary.loadBinary("mapped.dbl", loaded));
+  std::chrono::duration<double> loadSeconds =
+      std::chrono::steady_clock::now() - start;
+  start = std::chrono::steady_clock::now();
+  MappedTree tree;
+  EXPECT_TRUE(binary.mapBinary("mapped.dbl", tree));
+  std::chrono::duration<double> mapSeconds =
+      std::chrono::steady_clock::now() - start;
+  const size_t lookups = 1000000;
+  size_t found = 0;
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i != lookups; ++i) {
+    found += tree.root()
+                 .at("form" + std::to_string(i * 7919 % 200000))
+                 .at("editor.fontSize")
+                 .value()
+                 .size();
+  }
+  std::chrono::duration<double> mappedSeconds =
+      std::chrono::steady_clock::now() - start;
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i != lookups; ++i) {
+    found += loaded.at("form" + std::to_string(i * 7919 % 200000))
+                 .at("editor.fontSize")
+                 .value()
+                 .asStringView()
+                 .size();
+  }
+  std::chrono::duration<double> heapSeconds =
+      std::chrono::steady_clock::now() - start;
+  EXPECT_EQ(found, 2 * 2 * lookups);
+  std::cout << "loadBinary " << loadSeconds.count() << " s, mapBinary "
+            << mapSeconds.count() * 1e6 << " us, lookup mapped "
+            << mappedSeconds.count() * 1e9 / lookups << " ns, heap "
+            << heapSeconds.count() * 1e9 / lookups << " ns" << std::endl;
+  EXPECT_EQ(std::remove("mapped.dbl"), 0);
+}
+
+static size_t valueSize(const ValType &value) {
+  return value.asStringView().size();
+}
+
+static size_t valueSize(std::string_view value) { return value.size(); }
+
+// The node count plus the size of every first value.
+template <typename Node>
+static size_t walkTree(const Node &node) {
+  size_t ret = 1;
+  if (node.isValue()) {
+    ret += valueSize(node.value());
+  }
+  if (node.isMap()) {
+    for (const auto &child : node) {
+      ret += walkTree(child);
+    }
+  }
+  return ret;
+}
+
+TEST_F(TestDbLispParser, DISABLED_freezeBenchmark) {
+  DbLispParser parser;
+  recursive_map rmap("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(generateLisp(200000), rmap));
+  auto start = std::chrono::steady_clock::now();
+  BorrowedTree tree = BorrowedTree::freeze(rmap);
+  std::chrono::duration<double> freezeSeconds =
+      std::chrono::steady_clock::now() - start;
+  std::vector<std::string> keys;
+  for (size_t i = 0; i != 1000000; ++i) {
+    keys.push_back("form" + std::to_string(i * 7919 % 200000));
+  }
+  size_t found = 0;
+  start = std::chrono::steady_clock::now();
+  for (const auto &key : keys) {
+    found += rmap.at(key).at("editor.fontSize").size();
+  }
+  std::chrono::duration<double> heapLookup =
+      std::chrono::steady_clock::now() - start;
+  start = std::chrono::steady_clock::now();
+  for (const auto &key : keys) {
+    found += tree.root().at(key).at("editor.fontSize").size();
+  }
+  std::chrono::duration<double> frozenLookup =
+      std::chrono::steady_clock::now() - start;
+  start = std::chrono::steady_clock::now();
+  size_t heapBytes = 0;
+  for (int round = 0; round != 5; ++round) heapBytes += walkTree(rmap);
+  std::chrono::duration<double> heapWalk =
+      std::chrono::steady_clock::now() - start;
+  start = std::chrono::steady_clock::now();
+  size_t frozenBytes = 0;
+  for (int round = 0; round != 5; ++round) frozenBytes += walkTree(tree.root());
+  std::chrono::duration<double> frozenWalk =
+      std::chrono::steady_clock::now() - start;
+  start = std::chrono::steady_clock::now();
+  RecTree thawed = tree.toRecTree();
+  std::chrono::duration<double> thawSeconds =
+      std::chrono::steady_clock::now() - start;
+  EXPECT_EQ(found, 0);
+  EXPECT_EQ(frozenBytes, heapBytes);
+  EXPECT_EQ(thawed.count(), rmap.count());
+  std::cout << "freeze " << freezeSeconds.count() << " s, thaw "
+            << thawSeconds.count() << " s, lookup heap "
+            << heapLookup.count() * 1e9 / keys.size() << " ns, frozen "
+            << frozenLookup.count() * 1e9 / keys.size() << " ns, walk heap "
+            << heapWalk.count() / 5 << " s, frozen " << frozenWalk.count() / 5
+            << " s" << std::endl;
+}
+
+TEST_F(TestDbLispParser, lazyTree) {
+  DbLispParser parser;
+  recursive_map rmap("rmap"), lazyRmap("rmap");
+  LazyTree tree;
+  EXPECT_TRUE(parser.lispToRecMap("parser.scm", rmap));
+  EXPECT_TRUE(parser.lispToLazyTree("parser.scm", tree));
+  EXPECT_EQ(tree.parsedSize(), 0);
+  EXPECT_TRUE(tree.toRecTree(lazyRmap));
+  EXPECT_EQ(lazyRmap.formatLisp(), rmap.formatLisp());
+  auto lisp = std::make_shared<const std::string>(
+      generateLisp(20) + "(\"var\" \"x\" \"y\")\n(\"use\" (\"v\" var))");
+  EXPECT_TRUE(parser.lispBufToRecMap(*lisp, rmap));
+  EXPECT_TRUE(parser.lispBufToLazyTree(lisp, tree));
+  EXPECT_EQ(tree.size(), 22);
+  EXPECT_EQ(tree.parsedSize(), 0);
+  EXPECT_EQ(tree.at("use").at("v").valueVector().size(), 2);
+  EXPECT_EQ(tree.parsedSize(), 2);
+  EXPECT_EQ(tree.find("form7")->formatLisp(), rmap.at("form7").formatLisp());
+  EXPECT_EQ(tree.parsedSize(), 3);
+  EXPECT_EQ(tree.find("none"), nullptr);
+  EXPECT_THROW(tree.at("none"), std::out_of_range);
+  std::vector<std::string> keys;
+  for (auto pos = tree.begin(); pos != tree.end(); ++pos) {
+    keys.push_back(pos.key());
+  }
+  EXPECT_EQ(tree.parsedSize(), 3);
+  EXPECT_TRUE(std::is_sorted(keys.begin(), keys.end()));
+  size_t count = 1;
+  for (const recursive_map &section : tree) {
+    count += section.count();
+  }
+  EXPECT_EQ(count, rmap.count());
+  EXPECT_EQ(tree.parsedSize(), tree.size());
+}
+
+TEST_F(TestDbLispParser, lazyTreeErrors) {
+  const std::vector<std::string> badLisps{
+      "(\"a\"", "()", "(\"a\"))", "(\"a\" \"b)", "(\"a\") (\"a\")", "\"a\""};
+  DbLispParser parser;
+  LazyTree tree;
+  for (const auto &badLisp : badLisps) {
+    testing::internal::CaptureStderr();
+    EXPECT_FALSE(parser.lispBufToLazyTree(
+        std::make_shared<const std::string>(badLisp), tree))
+        << badLisp;
+    EXPECT_NE(testing::internal::GetCapturedStderr(), "");
+  }
+  // Errors inside a definition only show up once it is parsed.
+  writeLispFile("lazy.scm",
+                "(\"ok\" \"1\")\n(\"bad\"\n  (\"b\" \"c\") \"d\")\n"
+                "(\"var\" (\"v\" later))\n(\"later\" \"1\")");
+  testing::internal::CaptureStderr();
+  EXPECT_TRUE(parser.lispToLazyTree("lazy.scm", tree));
+  EXPECT_EQ(testing::internal::GetCapturedStderr(), "");
+  EXPECT_EQ(tree.at("ok").value().asString(), "1");
+  testing::internal::CaptureStderr();
+  EXPECT_THROW(tree.at("bad"), std::runtime_error);
+  EXPECT_THROW(tree.find("bad"), std::runtime_error);
+  EXPECT_THROW(tree.at("var"), std::runtime_error);
+  EXPECT_EQ(testing::internal::GetCapturedStderr(),
+            "dblisp: parser: error: lazy.scm:3:13:The definition of `bad` is "
+            "ambiguous\n"
+            "dblisp: parser: error: lazy.scm:4:13:Variable `later` is "
+            "Undefined\n");
+  recursive_map rmap("rmap");
+  testing::internal::CaptureStderr();
+  EXPECT_FALSE(tree.toRecTree(rmap));
+  EXPECT_EQ(testing::internal::GetCapturedStderr(), "");
+  EXPECT_EQ(std::remove("lazy.scm"), 0);
+}
+
+TEST_F(TestDbLispParser, DISABLED_lazyTreeBenchmark) {
+  writeLispFile("lazy.scm", generateLisp(200000));
+  DbLispParser parser;
+  auto start = std::chrono::steady_clock::now();
+  recursive_map rmap("rmap");
+  EXPECT_TRUE(parser.lispToRecMap("lazy.scm", rmap));
+  std::chrono::duration<double> eagerSeconds =
+      std::chrono::steady_clock::now() - start;
+  start = std::chrono::steady_clock::now();
+  LazyTree tree;
+  EXPECT_TRUE(parser.lispToLazyTree("lazy.scm", tree));
+  size_t found = 0;
+  for (size_t i = 0; i != 100; ++i) {
+    found += tree.at("form" + std::to_string(i * 1999)).size();
+  }
+  std::chrono::duration<double> lazySeconds =
+      std::chrono::steady_clock::now() - start;
+  EXPECT_EQ(found, 3 * 100);
+  std::cout << "eager parse " << eagerSeconds.count()
+            << " s, lazy load and 100 lookups " << lazySeconds.count() << " s"
+            << std::endl;
+  EXPECT_EQ(std::remove("lazy.scm"), 0);
+}
+
+TEST_F(TestDbLispParser, projection) {
+  EXPECT_TRUE(DbLispProjection::globMatch("editor.*", "editor.fontSize"));
+  EXPECT_TRUE(DbLispProjection::globMatch("*", ""));
+  EXPECT_TRUE(DbLispProjection::globMatch("a*b*c", "aXbYbZc"));
+  EXPECT_FALSE(DbLispProjection::globMatch("a*b", "aXbY"));
+  EXPECT_FALSE(DbLispProjection::globMatch("editor", "editor.fontSize"));
+  const std::string lisp =
+      generateLisp(20) +
+      "(\"set\" (\"editor.fontSize\" \"16\") (\"editor.tabSize\" \"4\")\n"
+      "       (\"window.zoomLevel\" \"1\") (\"window.title\" \"(;\\\"\")\n"
+      "       (\"other\" (\"deep\" \"1\")))\n"
+      "(\"base\" \"a\" \"b\") ; (\"use\"\n"
+      "(\"bad\" (\"x\" \"1\") \"y\")\n"
+      "(\"use\" (\"v\" base) (\"w\" \"1\"))";
+  DbLispParser parser;
+  recursive_map rmap("rmap"), expected("rmap");
+  parser.setKeyPaths({"set/editor.*", "set/window.zoomLevel", "use/v",
+                      "form1*/editor.rulers"});
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, rmap));
+  EXPECT_EQ(parser.keyPaths().size(), 4);
+  parser.setKeyPaths({});
+  EXPECT_TRUE(parser.lispBufToRecMap(
+      "(\"set\" (\"editor.fontSize\" \"16\") (\"editor.tabSize\" \"4\")\n"
+      "       (\"window.zoomLevel\" \"1\"))\n"
+      "(\"use\" (\"v\" \"a\" \"b\"))",
+      expected));
+  EXPECT_EQ(rmap.at("set").formatLisp(), expected.at("set").formatLisp());
+  EXPECT_EQ(rmap.at("use").formatLisp(), expected.at("use").formatLisp());
+  EXPECT_TRUE(rmap.find("base") == rmap.end());
+  EXPECT_EQ(rmap.size(), 2 + 11);
+  EXPECT_EQ(rmap.at("form13").size(), 1);
+  EXPECT_EQ(rmap.at("form13").at("editor.rulers").valueVector().size(), 3);
+  writeLispFile("projection.scm", lisp);
+  recursive_map fromFile("rmap");
+  EXPECT_TRUE(parser.lispToRecMap("projection.scm", fromFile, {"form7"}));
+  EXPECT_TRUE(parser.keyPaths().empty());
+  EXPECT_EQ(fromFile.count(), 1 + 6);
+  writeLispFile("projection.scm", generateLisp(20));
+  EXPECT_TRUE(parser.lispToRecMap("projection.scm", fromFile, {"form7", "*"}));
+  EXPECT_TRUE(parser.lispBufToRecMap(generateLisp(20), rmap));
+  EXPECT_EQ(fromFile.formatLisp(), rmap.formatLisp());
+  EXPECT_EQ(std::remove("projection.scm"), 0);
+}
+
+TEST_F(TestDbLispParser, projectionErrors) {
+  DbLispParser parser;
+  parser.setKeyPaths({"a"});
+  recursive_map rmap("rmap");
+  const std::vector<std::pair<std::string, std::string>> badLisps{
+      {"(\"a\" \"1\") (\"b\" (\"c\" \"d)", "blob:1:21:`\" not close"},
+      {"(\"a\" \"1\") (\"b\" (\"c\")", "`(` not close"},
+      {"(\"a\" (\"b\") \"c\")", "The definition of `a` is ambiguous"},
+      {"(\"b\" (\"x\") \"y\") (\"a\" b)", "Variable `b` is Undefined"}};
+  for (const auto &badLisp : badLisps) {
+    testing::internal::CaptureStderr();
+    EXPECT_FALSE(parser.lispBufToRecMap(badLisp.first, rmap, "blob"))
+        << badLisp.first;
+    EXPECT_NE(testing::internal::GetCapturedStderr().find(badLisp.second),
+              std::string::npos)
+        << badLisp.first;
+  }
+  EXPECT_TRUE(
+      parser.lispBufToRecMap("(\"a\" \"1\") (\"b\" (\"x\") \"y\")", rmap));
+  EXPECT_EQ(rmap.count(), 2);
+}
+
+TEST_F(TestDbLispParser, DISABLED_projectionBenchmark) {
+  writeLispFile("projection.scm", generateLisp(200000));
+  DbLispParser parser;
+  auto start = std::chrono::steady_clock::now();
+  recursive_map rmap("rmap");
+  EXPECT_TRUE(parser.lispToRecMap("projection.scm", rmap));
+  std::chrono::duration<double> fullSeconds =
+      std::chrono::steady_clock::now() - start;
+  start = std::chrono::steady_clock::now();
+  recursive_map projected("rmap");
+  EXPECT_TRUE(parser.lispToRecMap("projection.scm", projected,
+                                  {"form1/editor.*", "form199999"}));
+  std::chrono::duration<double> projectedSeconds =
+      std::chrono::steady_clock::now() - start;
+  EXPECT_EQ(projected.count(), 1 + 3 + 6);
+  std::cout << "full parse " << fullSeconds.count() << " s, projected "
+            << projectedSeconds.count() << " s" << std::endl;
+  EXPECT_EQ(std::remove("projection.scm"), 0);
+}
+
+static std::string generateVariableLisp(size_t formCount) {
+  std::string lisp = "(\"base\" \"a\" \"b\")\n(\"tree\" (\"k\" \"v\"))\n";
+  for (size_t i = 0; i != formCount; ++i) {
+    std::string index = std::to_string(i);
+    lisp.append("(\"var" + index + "\" \"" + index + "\")\n")
+        .append("(\"use" + index + "\" (\"v\" base var" + index + ")")
+        .append(" (tree))\n");
+  }
+  return lisp;
+}
+
+TEST_F(TestDbLispParser, parallelParse) {
+  const std::string lisp = generateLisp(500) + generateVariableLisp(500);
+  DbLispParser parser;
+  recursive_map fused("rmap"), parallel("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, fused));
+  parser.setParseMode(DbLispParser::PARSE_PARALLEL);
+  EXPECT_GE(parser.threadCount(), 1);
+  parser.setThreadCount(4);
+  EXPECT_EQ(parser.threadCount(), 4);
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, parallel));
+  EXPECT_EQ(parallel.formatLisp(), fused.formatLisp());
+  EXPECT_EQ(parallel.at("use7").at("v").valueVector().size(), 3);
+  EXPECT_TRUE(parser.lispToRecMap("parser.scm", parallel));
+  parser.setParseMode(DbLispParser::PARSE_FUSED);
+  EXPECT_TRUE(parser.lispToRecMap("parser.scm", fused));
+  EXPECT_EQ(parallel.formatLisp(), fused.formatLisp());
+  // Key pools are not thread safe, such a parse runs serially.
+  parser.setParseMode(DbLispParser::PARSE_PARALLEL);
+  parser.setPackNumbers(true);
+  dblisp::KeyPool pool;
+  recursive_map pooled("rmap", std::pmr::get_default_resource(), &pool);
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, pooled));
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, parallel));
+  EXPECT_EQ(parallel.at("form7").at("editor.rulers").asInt64Span().size(), 3);
+  EXPECT_EQ(parallel.formatLisp(), pooled.formatLisp());
+}
+
+TEST_F(TestDbLispParser, parallelParseErrors) {
+  const std::string lisp = generateLisp(100);
+  const std::vector<std::string> badLisps{
+      lisp + "(\"form7\")",
+      "(\"first\" later)" + lisp + "(\"later\" \"1\")",
+      lisp + "(\"a\" (\"b\") \"c\")" + lisp,
+      lisp + "(\"a\" \"b)",
+      lisp + "(\"a\" (",
+      lisp + "\"a\"",
+      lisp + "(\"a\"))",
+      lisp + "(\"a\" (\"b\" var))"};
+  DbLispParser parser;
+  parser.setThreadCount(4);
+  for (const auto &badLisp : badLisps) {
+    recursive_map rmap("rmap");
+    testing::internal::CaptureStderr();
+    parser.setParseMode(DbLispParser::PARSE_FUSED);
+    EXPECT_FALSE(parser.lispBufToRecMap(badLisp, rmap));
+    std::string fusedError = testing::internal::GetCapturedStderr();
+    testing::internal::CaptureStderr();
+    parser.setParseMode(DbLispParser::PARSE_PARALLEL);
+    EXPECT_FALSE(parser.lispBufToRecMap(badLisp, rmap));
+    EXPECT_EQ(testing::internal::GetCapturedStderr(), fusedError);
+    EXPECT_EQ(rmap.count(), 1);
+  }
+}
+
+TEST_F(TestDbLispParser, DISABLED_parallelBenchmark) {
+  writeLispFile("parallel.scm", generateLisp(200000));
+  DbLispParser parser;
+  size_t count = 0;
+  for (size_t threadCount :
+       {size_t(1), size_t(2), size_t(4), parser.threadCount()}) {
+    parser.setParseMode(threadCount == 1 ? DbLispParser::PARSE_FUSED
+                                         : DbLispParser::PARSE_PARALLEL);
+    parser.setThreadCount(threadCount);
+    auto start = std::chrono::steady_clock::now();
+    recursive_map rmap("rmap");
+    EXPECT_TRUE(parser.lispToRecMap("parallel.scm", rmap));
+    std::chrono::duration<double> seconds =
+        std::chrono::steady_clock::now() - start;
+    EXPECT_EQ(rmap.count(), count == 0 ? rmap.count() : count);
+    count = rmap.count();
+    std::cout << threadCount << " threads: " << seconds.count() << " s"
+              << std::endl;
+  }
+  EXPECT_EQ(std::remove("parallel.scm"), 0);
+}
+
+static void replaceFirst(std::string &lisp, const std::string &from,
+                         const std::string &to) {
+  lisp.replace(lisp.find(from), from.size(), to);
+}
+
+TEST_F(TestDbLispParser, reparse) {
+  std::string lisp = generateVariableLisp(100) + generateLisp(100);
+  DbLispParser parser;
+  dblisp::DbLispFormIndex index;
+  recursive_map rmap("rmap"), fused("rmap");
+  EXPECT_TRUE(parser.lispBufReparse(lisp, rmap, index));
+  EXPECT_EQ(index.size(), 302);
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, fused));
+  EXPECT_EQ(rmap.formatLisp(), fused.formatLisp());
+  const RecTree *form5 = &rmap.at("form5");
+  const RecTree *use3 = &rmap.at("use3");
+  const RecTree *use4 = &rmap.at("use4");
+  // A changed variable rebuilds the definitions that use it.
+  replaceFirst(lisp, "(\"var3\" \"3\")", "(\"var3\" \"x\" \"y\")");
+  replaceFirst(lisp, "(\"form7\" (\"editor.fontSize\" \"16\")",
+               "(\"form7\" (\"editor.fontSize\" \"18\")");
+  replaceFirst(lisp, "(\"form8\"", "(\"renamed8\"");
+  lisp += "(\"added\" (\"v\" var9 base))\n";
+  EXPECT_TRUE(parser.lispBufReparse(lisp, rmap, index));
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, fused));
+  EXPECT_EQ(rmap.formatLisp(), fused.formatLisp());
+  EXPECT_EQ(&rmap.at("form5"), form5);
+  EXPECT_EQ(&rmap.at("use4"), use4);
+  EXPECT_NE(&rmap.at("use3"), use3);
+  EXPECT_EQ(rmap.at("use3").at("v").valueVector().size(), 4);
+  EXPECT_TRUE(rmap.find("form8") == rmap.end());
+  EXPECT_EQ(index.size(), 303);
+  // Changing most definitions rebuilds the root at once.
+  lisp = generateLisp(300) + generateVariableLisp(10);
+  EXPECT_TRUE(parser.lispBufReparse(lisp, rmap, index));
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, fused));
+  EXPECT_EQ(rmap.formatLisp(), fused.formatLisp());
+  EXPECT_TRUE(parser.lispBufReparse(lisp, rmap, index));
+  EXPECT_EQ(rmap.formatLisp(), fused.formatLisp());
+  // A file without definitions is parsed whole, not indexed.
+  EXPECT_TRUE(parser.lispBufReparse("; empty\n", rmap, index));
+  EXPECT_TRUE(index.empty());
+  EXPECT_EQ(rmap.count(), 1);
+}
+
+TEST_F(TestDbLispParser, reparseErrors) {
+  std::string lisp = generateVariableLisp(20);
+  const std::vector<std::string> badLisps{
+      "(\"first\" var3)" + lisp,
+      lisp + "(\"use3\" \"again\")",
+      lisp + "(\"a\" (\"b\" var))",
+      lisp + "(\"a\" \"b)"};
+  DbLispParser parser;
+  dblisp::DbLispFormIndex index;
+  recursive_map rmap("rmap"), fused("rmap");
+  EXPECT_TRUE(parser.lispBufReparse(lisp, rmap, index));
+  const std::string expected = rmap.formatLisp();
+  for (const auto &badLisp : badLisps) {
+    testing::internal::CaptureStderr();
+    EXPECT_FALSE(parser.lispBufToRecMap(badLisp, fused));
+    std::string fusedError = testing::internal::GetCapturedStderr();
+    testing::internal::CaptureStderr();
+    EXPECT_FALSE(parser.lispBufReparse(badLisp, rmap, index));
+    EXPECT_EQ(testing::internal::GetCapturedStderr(), fusedError);
+    EXPECT_EQ(rmap.formatLisp(), expected);
+    EXPECT_EQ(index.size(), 42);
+  }
+  // Once fixed, only the definitions that changed are built again.
+  const RecTree *use3 = &rmap.at("use3");
+  EXPECT_TRUE(parser.lispBufReparse(lisp + "(\"a\" \"b\")", rmap, index));
+  EXPECT_EQ(&rmap.at("use3"), use3);
+  EXPECT_EQ(rmap.at("a").value().asString(), "b");
+}
+
+TEST_F(TestDbLispParser, DISABLED_reparseBenchmark) {
+  std::string lisp = generateLisp(200000);
+  DbLispParser parser;
+  dblisp::DbLispFormIndex index;
+  recursive_map rmap("rmap");
+  EXPECT_TRUE(parser.lispBufReparse(lisp, rmap, index));
+  replaceFirst(lisp, "(\"form100000\" (\"editor.fontSize\" \"16\")",
+               "(\"form100000\" (\"editor.fontSize\" \"17\")");
+  auto start = std::chrono::steady_clock::now();
+  recursive_map full("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, full));
+  std::chrono::duration<double> fullSeconds =
+      std::chrono::steady_clock::now() - start;
+  start = std::chrono::steady_clock::now();
+  EXPECT_TRUE(parser.lispBufReparse(lisp, rmap, index));
+  std::chrono::duration<double> reparseSeconds =
+      std::chrono::steady_clock::now() - start;
+  EXPECT_EQ(rmap.at("form100000").at("editor.fontSize").value().asString(),
+            "17");
+  EXPECT_EQ(rmap.count(), full.count());
+  std::cout << "full parse: " << fullSeconds.count() << " s" << std::endl;
+  std::cout << "reparse: " << reparseSeconds.count() << " s" << std::endl;
+}
+
+TEST_F(TestDbLispParser, DISABLED_sharedCopyBenchmark) {
+  DbLispParser parser;
+  recursive_map rmap("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(generateLisp(200000), rmap));
+  std::pmr::unsynchronized_pool_resource resource;
+  auto start = std::chrono::steady_clock::now();
+  recursive_map deep(rmap, &resource);
+  std::chrono::duration<double> deepSeconds =
+      std::chrono::steady_clock::now() - start;
+  // A snapshot per request while the live tree keeps changing. Each edit
+  // clones the root's child map, the only node on its path with many
+  // children.
+  const recursive_map first(rmap);
+  start = std::chrono::steady_clock::now();
+  size_t count = 0;
+  for (size_t i = 0; i != 100; ++i) {
+    recursive_map snapshot(rmap, recursive_map::ShareTag());
+    rmap.at("form" + std::to_string(i)).at("editor.fontSize").pushValue("1");
+    count += snapshot.size();
+  }
+  std::chrono::duration<double> sharedSeconds =
+      std::chrono::steady_clock::now() - start;
+  EXPECT_EQ(count, 100 * first.size());
+  EXPECT_EQ(first.at("form0").at("editor.fontSize").value().asInt(), 16);
+  EXPECT_EQ(deep.count(), first.count());
+  std::cout << "deep copy: " << deepSeconds.count() << " s" << std::endl;
+  std::cout << "shared copy and edit: " << sharedSeconds.count() / 100
+            << " s" << std::endl;
+}
+
+// Reads per second of `readerCount` threads while a writer parses and
+// publishes a new version every `reloadEvery`. `read` gets a key and
+// returns the value found.
+template <typename Read, typename Publish>
+static double readThroughput(size_t readerCount,
+                             std::chrono::milliseconds reloadEvery,
+                             const std::string &lisp, Read read,
+                             Publish publish) {
+  std::vector<std::string> keys;
+  for (size_t i = 0; i != 1000; ++i) {
+    keys.push_back("form" + std::to_string(i));
+  }
+  std::atomic<bool> done{false};
+  std::atomic<size_t> reads{0};
+  std::vector<std::thread> readers;
+  for (size_t reader = 0; reader != readerCount; ++reader) {
+    readers.emplace_back([&, reader]() {
+      size_t count = 0, sum = 0;
+      for (size_t i = reader; !done.load(std::memory_order_relaxed); ++i) {
+        sum += read(keys[i % keys.size()]);
+        count += 1;
+      }
+      reads += count;
+      EXPECT_EQ(sum, count * 16);
+    });
+  }
+  auto start = std::chrono::steady_clock::now();
+  size_t reloads = 0;
+  DbLispParser parser;
+  for (; std::chrono::steady_clock::now() - start < std::chrono::seconds(2);
+       ++reloads) {
+    recursive_map rmap("rmap");
+    EXPECT_TRUE(parser.lispBufToRecMap(lisp, rmap));
+    publish(std::move(rmap));
+    std::this_thread::sleep_for(reloadEvery);
+  }
+  done = true;
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  std::chrono::duration<double> seconds =
+      std::chrono::steady_clock::now() - start;
+  EXPECT_GT(reloads, 0);
+  return reads / seconds.count();
+}
+
+TEST_F(TestDbLispParser, DISABLED_publishedTreeBenchmark) {
+  const std::string lisp = generateLisp(1000);
+  for (size_t readerCount : {size_t(1), size_t(4), size_t(16)}) {
+    PublishedTree published;
+    std::mutex mutex;
+    recursive_map locked("rmap");
+    DbLispParser parser;
+    EXPECT_TRUE(parser.lispBufToRecMap(lisp, locked));
+    published.publish(locked);
+    double mutexReads = readThroughput(
+        readerCount, std::chrono::milliseconds(10), lisp,
+        [&](const std::string &key) {
+          std::lock_guard<std::mutex> lock(mutex);
+          const recursive_map &rmap = locked;
+          return rmap.at(key).at("editor.fontSize").value().asUInt();
+        },
+        [&](recursive_map &&rmap) {
+          std::lock_guard<std::mutex> lock(mutex);
+          locked.swap(rmap);
+        });
+    double snapshotReads = readThroughput(
+        readerCount, std::chrono::milliseconds(10), lisp,
+        [&](const std::string &key) {
+          PublishedTree::Snapshot snapshot = published.snapshot();
+          return snapshot->at(key).at("editor.fontSize").value().asUInt();
+        },
+        [&](recursive_map &&rmap) { published.publish(std::move(rmap)); });
+    std::cout << readerCount << " readers, mutex: " << mutexReads
+              << " reads/s, snapshot: " << snapshotReads << " reads/s"
+              << std::endl;
+  }
+}
+
+TEST_F(TestDbLispParser, treeErrorPosition) {
+  struct BadLisp {
+    std::string lisp;
+    size_t line;
+    size_t column;
+    std::string message;
+  };
+  const std::vector<BadLisp> badLisps{
+      {"(\"a\" \"1\")\n(\"a\" \"2\")", 2, 9, "duplicate key `a`"},
+      {"(\"a\"\n  (\"b\" undefined))", 2, 8,
+       "Variable `undefined` is Undefined"},
+      {"(\"a\" \"1\")\n  (\"b\" (\"c\")", 2, 3, "`(` not close"},
+      {"(\"a\" \"1\"))", 1, 10, "`) not close"},
+      {"(\"a\" \"1\")\n  a", 2, 3, "The definition of `rmap` is ambiguous"},
+      {"a", 1, 1, "The definition of `rmap` is ambiguous"}};
+  DbLispParser parser;
+  for (const auto &badLisp : badLisps) {
+    recursive_map rmap("rmap");
+    testing::internal::CaptureStderr();
+    EXPECT_FALSE(parser.lispBufToRecMap(badLisp.lisp, rmap, "blob"))
+        << badLisp.lisp;
+    // The logged line keeps its old format, without the position.
+    EXPECT_EQ(testing::internal::GetCapturedStderr(),
+              "dblisp: parser: error: blob:" + badLisp.message + "\n");
+    EXPECT_EQ(parser.lastError().line, badLisp.line) << badLisp.lisp;
+    EXPECT_EQ(parser.lastError().column, badLisp.column) << badLisp.lisp;
+    EXPECT_EQ(parser.lastError().message, badLisp.message);
+  }
+}
+
+TEST_F(TestDbLispParser, parserErrors) {
+  DbLispParser parser;
+  recursive_map rmap("rmap");
+  testing::internal::CaptureStderr();
+  EXPECT_FALSE(parser.lispBufToRecMap("(\"a\"\n  (\"b\" \"c)", rmap, "blob"));
+  const DbLispError error = parser.lastError();
+  EXPECT_FALSE(parser.lispToRecMap("not-exist.scm", rmap));
+  EXPECT_EQ(testing::internal::GetCapturedStderr(),
+            error.toString() + "\n" + parser.lastError().toString() + "\n");
+  EXPECT_EQ(error.file, "blob");
+  EXPECT_EQ(error.line, 2);
+  EXPECT_EQ(error.column, 8);
+  EXPECT_EQ(error.message, "`\" not close");
+  EXPECT_EQ(parser.lastError().line, 0);
+  EXPECT_EQ(parser.lastError().message, "open error: not-exist.scm");
+  parser.setLogErrors(false);
+  testing::internal::CaptureStderr();
+  EXPECT_FALSE(parser.lispBufToRecMap("(\"a\") (\"a\")", rmap));
+  EXPECT_EQ(testing::internal::GetCapturedStderr(), "");
+  EXPECT_EQ(parser.lastError().message, "duplicate key `a`");
+  EXPECT_TRUE(parser.lispBufToRecMap("(\"a\")", rmap));
+  EXPECT_TRUE(parser.lastError().empty());
+}
+
+TEST_F(TestDbLispParser, parserPool) {
+  DbLispParserPool pool(
+      [](DbLispParser &parser) { parser.setPackNumbers(true); });
+  std::atomic<size_t> parsed{0};
+  testing::internal::CaptureStderr();
+  std::vector<std::thread> threads;
+  for (size_t thread = 0; thread != 4; ++thread) {
+    threads.emplace_back([&pool, &parsed, thread]() {
+      for (size_t i = 0; i != 200; ++i) {
+        const std::string name = std::to_string(thread) + "/" +
+                                 std::to_string(i);
+        recursive_map rmap("rmap");
+        DbLispError error;
+        if (i % 2 == 0) {
+          const std::string lisp = "(\"f\" (\"x\" \"" +
+                                   std::to_string(i) + "\" \"1\"))";
+          EXPECT_TRUE(pool.lispBufToRecMap(lisp, rmap, &error, name));
+          EXPECT_TRUE(error.empty());
+          ASSERT_EQ(rmap.at("f").at("x").asInt64Span().size(), 2);
+          EXPECT_EQ(rmap.at("f").at("x").asInt64Span()[0], i);
+          parsed += 1;
+        } else {
+          const std::string lisp = "(\"f\" \"x\")\n (\"g\" (var))";
+          EXPECT_FALSE(pool.lispBufToRecMap(lisp, rmap, &error, name));
+          EXPECT_EQ(error.file, name);
+          EXPECT_EQ(error.message, "Variable `(var)` is Undefined");
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(testing::internal::GetCapturedStderr(), "");
+  EXPECT_EQ(parsed.load(), 400);
+  EXPECT_GE(pool.idleSize(), 1);
+  EXPECT_LE(pool.idleSize(), 4);
+  {
+    DbLispParserPool::Lease parser = pool.acquire();
+    recursive_map rmap("rmap");
+    EXPECT_FALSE(parser->lispToRecMap("not-exist.scm", rmap));
+    EXPECT_EQ(parser->lastError().message, "open error: not-exist.scm");
+  }
+}
+
+// Writes every event as a word, skips the forms named `skip` and stops
+// at the form named `stop`.
+class EventLog : public DbLispHandler {
+ public:
+  dblisp::DbLispAction onOpen(std::string_view key) {
+    log.append("(").append(key).append(" ");
+    return key == "skip"   ? dblisp::ACTION_SKIP
+           : key == "stop" ? dblisp::ACTION_STOP
+                           : dblisp::ACTION_CONTINUE;
+  }
+
+  dblisp::DbLispAction onOpenVariable(std::string_view name) {
+    log.append("(<").append(name).append("> ");
+    return dblisp::ACTION_CONTINUE;
+  }
+
+  dblisp::DbLispAction onValue(std::string_view value) {
+    log.append("[").append(value).append("] ");
+    return dblisp::ACTION_CONTINUE;
+  }
+
+  dblisp::DbLispAction onVariable(std::string_view name) {
+    log.append("<").append(name).append("> ");
+    return dblisp::ACTION_CONTINUE;
+  }
+
+  dblisp::DbLispAction onClose() {
+    log.append(") ");
+    return dblisp::ACTION_CONTINUE;
+  }
+
+  std::string log;
+};
+
+TEST_F(TestDbLispParser, events) {
+  DbLispParser parser;
+  EventLog events;
+  EXPECT_TRUE(parser.lispBufToEvents(
+      "(\"a\" \"1\" \"t\\\"x\") ; (\"c\"\n"
+      "(\"b\" (\"skip\" (\"x\" \")\") \"y\") (a) (\"c\" a undefined))\n"
+      "(\"a\") (\"stop\" \"z\") (\"(\"",
+      events));
+  EXPECT_EQ(events.log,
+            "(a [1] [t\"x] ) (b (skip (<a> ) (c <a> <undefined> ) ) (a ) "
+            "(stop ");
+  // The event stream builds the same tree as the parser.
+  const std::string lisp = generateLisp(20);
+  events.log.clear();
+  EXPECT_TRUE(parser.lispBufToEvents(lisp, events));
+  recursive_map rmap("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, rmap));
+  size_t opens = 0, values = 0;
+  for (char c : events.log) {
+    opens += c == '(';
+    values += c == '[';
+  }
+  EXPECT_EQ(opens + 1, rmap.count());
+  EXPECT_EQ(values, 20 * 6);
+}
+
+TEST_F(TestDbLispParser, eventErrors) {
+  const std::vector<std::pair<std::string, std::string>> badLisps{
+      {"(\"a\" \"b)", "1:6:`\" not close"},
+      {"(\"a\"\n  (\"b\")", "1:1:`(` not close"},
+      {"(\"a\") (\"skip\" (\"c\")", "1:7:`(` not close"},
+      {"(\"a\" ()", "1:7:`()` is invalid syntax"},
+      {"(\"a\" (\"b\"))\n)", "2:1:`) not close"},
+      {"(\"a\") \"b\"", "1:7:`\"b\" is invalid syntax"},
+      {"(\"a\")\n  b", "2:3:`b` is invalid syntax"}};
+  DbLispParser parser;
+  parser.setLogErrors(false);
+  for (const auto &badLisp : badLisps) {
+    EventLog events;
+    EXPECT_FALSE(parser.lispBufToEvents(badLisp.first, events, "blob"))
+        << badLisp.first;
+    EXPECT_EQ(parser.lastError().toString(),
+              "dblisp: parser: error: blob:" + badLisp.second);
+  }
+  EventLog events;
+  EXPECT_FALSE(parser.lispToEvents("not-exist.scm", events));
+  EXPECT_EQ(parser.lastError().message, "open error: not-exist.scm");
+}
+
+// Every word of `lisp` as "type:offset:value", lexed whole, or fed in
+// chunks of `chunkSize` bytes.
+static std::vector<std::string> lexedWords(const std::string &lisp,
+                                           size_t chunkSize) {
+  std::vector<std::string> words;
+  DbLispToken token;
+  auto push = [&words, &token]() {
+    words.push_back(std::to_string(token.wordType()) + ":" +
+                    std::to_string(token.offset()) + ":" + token.value());
+  };
+  if (chunkSize == 0) {
+    dblisp::DbLispLexer lexer(lisp);
+    for (; lexer.next(token);) {
+      push();
+    }
+    return words;
+  }
+  DbLispChunkLexer lexer;
+  for (size_t first = 0; first < lisp.size(); first += chunkSize) {
+    // Each chunk lives only until the lexer is done with it.
+    std::string chunk = lisp.substr(first, chunkSize);
+    lexer.feed(chunk.data(), chunk.size());
+    for (; lexer.next(token);) {
+      push();
+    }
+  }
+  lexer.finish();
+  for (; lexer.next(token);) {
+    push();
+  }
+  return words;
+}
+
+TEST_F(TestDbLispParser, chunkLexer) {
+  const std::string lisp =
+      "(\"a\" \"1\" \"t\\\"x\\\"\") ; (\"c\" \"\n"
+      "(\"b\\\"\" (a) (\"long key\" \"\" var)) ;\n"
+      "(\"c\" \"\\\"\" \"line\nbreak\")\n"
+      "(\"d\" last)";
+  const std::vector<std::string> expected = lexedWords(lisp, 0);
+  EXPECT_EQ(expected.size(), 25);
+  for (size_t chunkSize = 1; chunkSize <= lisp.size(); ++chunkSize) {
+    EXPECT_EQ(lexedWords(lisp, chunkSize), expected) << chunkSize;
+  }
+  EXPECT_EQ(lexedWords(lisp + "\n; end", 4), expected);
+  EXPECT_EQ(lexedWords(lisp + " tail", 3).back(), "3:" +
+            std::to_string(lisp.size() + 1) + ":tail");
+  for (size_t chunkSize : {1, 2, 5}) {
+    DbLispChunkLexer lexer;
+    DbLispToken token;
+    const std::string open = "(\"a\"\n  (\"b\" \"c\\\")";
+    for (size_t first = 0; first < open.size(); first += chunkSize) {
+      lexer.feed(open.data() + first, std::min(chunkSize, open.size() - first));
+      for (; lexer.next(token);) {
+      }
+    }
+    EXPECT_FALSE(lexer.quotNotClose());
+    lexer.finish();
+    EXPECT_FALSE(lexer.next(token));
+    EXPECT_TRUE(lexer.quotNotClose());
+    EXPECT_EQ(lexer.errorOffset(), 12);
+    auto lineColumn = lexer.lineColumn(lexer.errorOffset());
+    EXPECT_EQ(lineColumn.first, 1);
+    EXPECT_EQ(lineColumn.second, 7);
+  }
+}
+
+TEST_F(TestDbLispParser, pushParser) {
+  const std::string lisp = generateVariableLisp(10) + generateLisp(10);
+  DbLispParser parser;
+  recursive_map expected("rmap");
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, expected));
+  for (size_t chunkSize : {1, 3, 64, 4096}) {
+    recursive_map rmap("rmap");
+    DbLispPushParser pushParser(rmap);
+    for (size_t first = 0; first < lisp.size(); first += chunkSize) {
+      EXPECT_TRUE(pushParser.feed(std::string(lisp, first, chunkSize)));
+    }
+    EXPECT_EQ(rmap.count(), 1);
+    EXPECT_TRUE(pushParser.finish());
+    EXPECT_EQ(rmap.formatLisp(), expected.formatLisp()) << chunkSize;
+    EXPECT_FALSE(pushParser.finish());
+  }
+  const std::vector<std::pair<std::string, std::string>> badLisps{
+      {"(\"a\"\n  (\"b\" \"c)", "2:8:`\" not close"},
+      {"(\"a\" (\"b\")", "1:1:`(` not close"},
+      {"(\"a\")\n\n  (\"b\" (\"c\")", "3:3:`(` not close"},
+      {"(;c\"b\" \"b\" \"1\"e \") ", "1:1:`(` not close"},
+      {"(\"a\" \"1\")\n(\"a\" \"2\")", "2:9:duplicate key `a`"},
+      {"(\"a\" \"1\")\n(\"b\" undefinedVariable)",
+       "2:6:Variable `undefinedVariable` is Undefined"}};
+  for (const auto &badLisp : badLisps) {
+    for (size_t chunkSize : {1, 4}) {
+      recursive_map rmap("rmap");
+      DbLispPushParser pushParser(rmap, "stream");
+      pushParser.setLogErrors(false);
+      bool parsed = true;
+      for (size_t first = 0; first < badLisp.first.size();
+           first += chunkSize) {
+        parsed = pushParser.feed(std::string(badLisp.first, first, chunkSize));
+        if (!parsed) {
+          break;
+        }
+      }
+      EXPECT_FALSE(parsed && pushParser.finish()) << badLisp.first;
+      EXPECT_EQ(pushParser.lastError().toString(),
+                "dblisp: parser: error: stream:" + badLisp.second);
+      parser.setLogErrors(false);
+      EXPECT_FALSE(parser.lispBufToRecMap(badLisp.first, rmap));
+      EXPECT_EQ(pushParser.lastError().line, parser.lastError().line);
+      EXPECT_EQ(pushParser.lastError().column, parser.lastError().column);
+      EXPECT_FALSE(pushParser.feed("(\"c\")"));
+      EXPECT_EQ(rmap.count(), 1);
+    }
+  }
+}
+
+#ifdef _DBLISP_COROUTINES_
+TEST_F(TestDbLispParser, tokenStream) {
+  const std::string lisp = generateLisp(3) + "(\"a\" \"long string\" var)";
+  size_t first = 0;
+  DbLispChunkLexer lexer;
+  std::vector<std::string> words;
+  for (const DbLispToken &token : dblisp::lispTokens(
+           [&lisp, &first]() {
+             std::string_view chunk(lisp.data() + first,
+                                    std::min<size_t>(5, lisp.size() - first));
+             first += chunk.size();
+             return chunk;
+           },
+           lexer)) {
+    words.push_back(std::to_string(token.wordType()) + ":" +
+                    std::to_string(token.offset()) + ":" + token.value());
+  }
+  EXPECT_EQ(words, lexedWords(lisp, 0));
+  EXPECT_FALSE(lexer.quotNotClose());
+}
+#endif
+
+TEST_F(TestRecursiveTree, DISABLED_concurrentTreeBenchmark) {
+  // Each write pushes a value under its thread's own top level key, or
+  // under one of 4 shared ones.
+  // By path, the threads sharing a top level key write below their own
+  // second level child, which only locks its stripe.
+  for (int mode : {0, 1, 2}) {
+    const bool disjoint = mode == 0;
+    for (size_t threadCount : {1, 2, 4, 8, 16, 32}) {
+      ConcurrentTree tree("rt");
+      const size_t writes = 400000 / threadCount;
+      auto start = std::chrono::steady_clock::now();
+      std::vector<std::thread> writers;
+      for (size_t writer = 0; writer != threadCount; ++writer) {
+        writers.emplace_back([&tree, writer, writes, disjoint, mode]() {
+          const std::string key =
+              "key" + std::to_string(disjoint ? writer : writer % 4);
+          const std::string child = "child" + std::to_string(writer);
+          for (size_t i = 0; i != writes; ++i) {
+            if (mode == 2) {
+              tree.pushValue({key, child, std::to_string(i % 64)}, "value");
+              continue;
+            }
+            tree.write(key, [&child](RecTree &node) {
+              RecTree &values = node[child];
+              if (values.isValue() && values.valueVector().size() == 64) {
+                values.clear();
+              }
+              values.pushValue("value");
+            });
+          }
+        });
+      }
+      for (auto &writer : writers) {
+        writer.join();
+      }
+      std::chrono::duration<double> seconds =
+          std::chrono::steady_clock::now() - start;
+      std::cout << (mode == 0   ? "disjoint"
+                    : mode == 1 ? "overlapping"
+                                : "overlapping by path")
+                << ", "
+                << threadCount << " threads: "
+                << writes * threadCount / seconds.count() << " writes/s"
+                << std::endl;
+    }
+  }
+}
+
+TEST_F(TestDbLispParser, DISABLED_parserPoolBenchmark) {
+  // Small fragments parsed by a new parser each, or by pooled ones, into
+  // trees that allocate from a stack buffer.
+  std::vector<std::string> fragments;
+  for (size_t i = 0; i != 1000; ++i) {
+    fragments.push_back(generateLisp(1 + i % 4));
+  }
+  for (bool pooled : {false, true}) {
+    for (size_t threadCount : {1, 4}) {
+      DbLispParserPool pool;
+      const size_t parses = 400000 / threadCount;
+      auto start = std::chrono::steady_clock::now();
+      std::vector<std::thread> threads;
+      for (size_t thread = 0; thread != threadCount; ++thread) {
+        threads.emplace_back([&, thread]() {
+          char buf[1 << 14];
+          for (size_t i = thread; i < parses * threadCount;
+               i += threadCount) {
+            std::pmr::monotonic_buffer_resource arena(buf, sizeof(buf));
+            recursive_map rmap("rmap", &arena);
+            const std::string &lisp = fragments[i % fragments.size()];
+            if (pooled) {
+              EXPECT_TRUE(pool.lispBufToRecMap(lisp, rmap));
+            } else {
+              DbLispParser parser;
+              EXPECT_TRUE(parser.lispBufToRecMap(lisp, rmap));
+            }
+          }
+        });
+      }
+      for (auto &thread : threads) {
+        thread.join();
+      }
+      std::chrono::duration<double> seconds =
+          std::chrono::steady_clock::now() - start;
+      std::cout << (pooled ? "pooled" : "new parser") << ", " << threadCount
+                << " threads: " << parses * threadCount / seconds.count()
+                << " parses/s" << std::endl;
+    }
+  }
+}
+
+TEST_F(TestDbLispParser, DISABLED_eventsBenchmark) {
+  // Counts the values under `editor.rulers`, from events or from a tree.
+  struct RulerCount : DbLispHandler {
+    dblisp::DbLispAction onOpen(std::string_view key) {
+      inRulers = key == "editor.rulers";
+      return dblisp::ACTION_CONTINUE;
+    }
+
+    dblisp::DbLispAction onValue(std::string_view) {
+      count += inRulers;
+      return dblisp::ACTION_CONTINUE;
+    }
+
+    bool inRulers = false;
+    size_t count = 0;
+  };
+  const std::string lisp = generateLisp(200000);
+  DbLispParser parser;
+  for (bool tree : {true, false}) {
+    auto start = std::chrono::steady_clock::now();
+    size_t count = 0;
+    if (tree) {
+      recursive_map rmap("rmap");
+      EXPECT_TRUE(parser.lispBufToRecMap(lisp, rmap));
+      for (const auto &form : rmap) {
+        count += form.at("editor.rulers").valueVector().size();
+      }
+    } else {
+      RulerCount rulers;
+      EXPECT_TRUE(parser.lispBufToEvents(lisp, rulers));
+      count = rulers.count;
+    }
+    std::chrono::duration<double> seconds =
+        std::chrono::steady_clock::now() - start;
+    EXPECT_EQ(count, 200000 * 3);
+    std::cout << (tree ? "tree" : "events") << ": "
+              << megabytes(lisp.size()) / seconds.count() << " MB/s"
+              << std::endl;
+  }
+}
+
+TEST_F(TestDbLispParser, DISABLED_pushParserBenchmark) {
+  // A file read whole and parsed, or pushed in 64 KB chunks as it is
+  // read. The tree dominates the peak either way, the buffer is the
+  // difference.
+  writeLispFile("bench.scm", generateLisp(200000));
+  for (bool push : {false, true}) {
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+      std::ifstream in("bench.scm", std::ios::binary);
+      recursive_map rmap("rmap");
+      bool parsed = false;
+      if (push) {
+        DbLispPushParser pushParser(rmap);
+        std::vector<char> chunk(1 << 16);
+        for (parsed = true; parsed && in;) {
+          in.read(chunk.data(), chunk.size());
+          parsed = pushParser.feed(chunk.data(), in.gcount());
+        }
+        parsed = parsed && pushParser.finish();
+      } else {
+        std::stringstream buf;
+        buf << in.rdbuf();
+        parsed = DbLispParser().lispBufToRecMap(buf.str(), rmap);
+      }
+      _exit(parsed && rmap.size() == 200000 ? 0 : 1);
+    }
+    int status = 0;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    std::chrono::duration<double> seconds =
+        std::chrono::steady_clock::now() - start;
+    EXPECT_EQ(status, 0);
+    std::cout << (push ? "push" : "whole") << ": peak RSS "
+              << usage.ru_maxrss / 1024 << " MB, " << seconds.count()
+              << " s" << std::endl;
+  }
+  EXPECT_EQ(std::remove("bench.scm"), 0);
+}
+
+TEST_F(TestDbLispParser, DISABLED_binaryBenchmark) {
+  const std::string lisp = generateLisp(200000);
+  DbLispParser parser;
+  DbLispBinary binary;
+  recursive_map parsed("rmap"), loaded("rmap");
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_TRUE(parser.lispBufToRecMap(lisp, parsed));
+  std::chrono::duration<double> parseSeconds =
+      std::chrono::steady_clock::now() - start;
+  std::string buf;
+  start = std::chrono::steady_clock::now();
+  {
+    DbLispWriter writer(buf);
+    EXPECT_TRUE(binary.saveBinary(parsed, writer));
+  }
+  std::chrono::duration<double> saveSeconds =
+      std::chrono::steady_clock::now() - start;
+  start = std::chrono::steady_clock::now();
+  EXPECT_TRUE(binary.loadBinaryBuf(buf, loaded));
+  std::chrono::duration<double> loadSeconds =
+      std::chrono::steady_clock::now() - start;
+  EXPECT_EQ(loaded.count(), parsed.count());
+  std::cout << "text " << megabytes(lisp.size()) << " MB parse "
+            << parseSeconds.count() << " s, binary " << megabytes(buf.size())
+            << " MB save " << saveSeconds.count() << " s, load "
+            << loadSeconds.count() << " s" << std::endl;
+}